@@ -0,0 +1,127 @@
+/****************************************************************************
+ bench-lineindex - Line Indexing Microbenchmark
+
+ Copyright 2011 John Kleint
+ This is free software, licensed under the GNU General Public License v3,
+ available in the accompanying file LICENSE.txt.
+
+ Time each index_lines() implementation on buffers of random lines of
+ various average lengths, and check that they all agree with the scalar one.
+ The scalar one is memchr(3) once per line, which is what hsplit used to do.
+*****************************************************************************/
+
+#define _POSIX_C_SOURCE 200112L     // For clock_gettime(2)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "lineindex.h"
+
+
+#define BUF_BYTES    (64*1024*1024)
+#define BATCH        (1024)             // Same as hsplit's LINE_BATCH
+#define REPEATS      (5)
+
+
+typedef size_t (*index_fn)(const char * buf, size_t len, uint32_t * ends, size_t maxends);
+
+
+double now_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/** Fill buf with lines of printable junk whose lengths average about avglen. */
+void fill_lines(char * buf, size_t len, size_t avglen)
+{
+    srand(1);
+    for (size_t pos = 0 ; pos < len ; pos++)
+        buf[pos] = (char) ('a' + rand() % 26);
+    for (size_t pos = 0 ; pos < len ; pos += 1 + rand() % (2 * avglen))
+        buf[pos] = '\n';
+}
+
+
+/** Index all of buf the way hsplit does, a batch at a time; returns the number of lines. */
+size_t index_all(index_fn fn, const char * buf, size_t len, uint32_t * ends)
+{
+    size_t numlines = 0;
+    size_t start = 0;
+    size_t found;
+
+    while ((found = fn(buf + start, len - start, ends, BATCH)) > 0)
+    {
+        numlines += found;
+        start += ends[found - 1] + 1;
+        if (found < BATCH)
+            break;
+    }
+    return numlines;
+}
+
+
+int main()
+{
+    const char * names[] = {"scalar", "sse2", "avx2"};
+    const index_fn fns[] = {index_lines_scalar, index_lines_sse2, index_lines_avx2};
+    const size_t avglens[] = {8, 32, 128, 1024, 16384};
+    char * buf = malloc(BUF_BYTES);
+    uint32_t * ends = malloc(BATCH * sizeof (uint32_t));
+    uint32_t * expected = malloc(BATCH * sizeof (uint32_t));
+
+    if (buf == NULL || ends == NULL || expected == NULL)
+    {
+        perror("bench-lineindex: Error allocating memory");
+        exit(1);
+    }
+
+    printf("%-8s %8s %10s %10s\n", "impl", "avglen", "GB/s", "ns/line");
+    for (size_t a = 0 ; a < sizeof avglens / sizeof avglens[0] ; a++)
+    {
+        fill_lines(buf, BUF_BYTES, avglens[a]);
+        for (size_t f = 0 ; f < sizeof fns / sizeof fns[0] ; f++)
+        {
+            if (!index_lines_supported(names[f]))
+            {
+                printf("%-8s %8zu %10s %10s\n", names[f], avglens[a], "-", "-");
+                continue;
+            }
+
+            // Check the first batch against scalar, at every alignment we might start at.
+            for (size_t offset = 0 ; offset < 64 ; offset++)
+            {
+                size_t want = index_lines_scalar(buf + offset, BUF_BYTES - offset, expected, BATCH);
+                size_t got = fns[f](buf + offset, BUF_BYTES - offset, ends, BATCH);
+                if (got != want || memcmp(ends, expected, got * sizeof (uint32_t)) != 0)
+                {
+                    fprintf(stderr, "bench-lineindex: %s disagrees with scalar at offset %zu\n", names[f], offset);
+                    exit(1);
+                }
+            }
+
+            double best = 1e9;
+            size_t numlines = 0;
+            for (int r = 0 ; r < REPEATS ; r++)
+            {
+                double start = now_seconds();
+                numlines = index_all(fns[f], buf, BUF_BYTES, ends);
+                double elapsed = now_seconds() - start;
+                if (elapsed < best)
+                    best = elapsed;
+            }
+            printf("%-8s %8zu %10.2f %10.2f\n", names[f], avglens[a],
+                   BUF_BYTES / best / 1e9, best * 1e9 / (numlines > 0 ? numlines : 1));
+        }
+    }
+
+    free(buf);
+    free(ends);
+    free(expected);
+    return 0;
+}
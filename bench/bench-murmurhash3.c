@@ -0,0 +1,145 @@
+/****************************************************************************
+ bench-murmurhash3 - Batched MurmurHash3 Microbenchmark
+
+ Copyright 2011 John Kleint
+ This is free software, licensed under the GNU General Public License v3,
+ available in the accompanying file LICENSE.txt.
+
+ Check that every MurmurHash3_x86_32_batch implementation the CPU supports,
+ and the incremental interface, give the same hashes as MurmurHash3_x86_32,
+ then time the batch implementations against one MurmurHash3_x86_32 call per
+ key, on keys of various lengths.
+*****************************************************************************/
+
+#define _POSIX_C_SOURCE 200112L     // For clock_gettime(2)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "murmurhash3.h"
+
+
+#define NUMKEYS      (1024*1024)
+#define BATCH        (1024)             // Same as hsplit's LINE_BATCH
+#define SEED         (0x5ca1ab1e)
+#define REPEATS      (5)
+
+
+double now_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/** Check that hashing every key in random pieces gives the same hashes. */
+void check_incremental(const void ** keys, const size_t * lens, const uint32_t * expected, size_t numkeys)
+{
+    for (size_t k = 0 ; k < numkeys ; k++)
+    {
+        MurmurHash3_x86_32_state state;
+        const char * key = keys[k];
+        size_t left = lens[k];
+        uint32_t got;
+
+        MurmurHash3_x86_32_init(&state, SEED);
+        while (left > 0)
+        {
+            size_t piece = 1 + (size_t) rand() % left;
+            MurmurHash3_x86_32_update(&state, key, piece);
+            key += piece;
+            left -= piece;
+        }
+        MurmurHash3_x86_32_final(&state, &got);
+        if (got != expected[k])
+        {
+            fprintf(stderr, "bench-murmurhash3: incremental hash disagrees with MurmurHash3_x86_32\n");
+            exit(1);
+        }
+    }
+}
+
+
+int main()
+{
+    const char * names[] = {"scalar", "avx2", "avx512f"};
+    const size_t maxlens[] = {16, 40, 80, 160, 1000};
+    const size_t numnames = sizeof names / sizeof names[0];
+    char * data = malloc(NUMKEYS * 1000);
+    const void ** keys = malloc(NUMKEYS * sizeof (void *));
+    size_t * lens = malloc(NUMKEYS * sizeof (size_t));
+    uint32_t * expected = malloc(NUMKEYS * sizeof (uint32_t));
+    uint32_t * got = malloc(NUMKEYS * sizeof (uint32_t));
+
+    if (data == NULL || keys == NULL || lens == NULL || expected == NULL || got == NULL)
+    {
+        perror("bench-murmurhash3: Error allocating memory");
+        exit(1);
+    }
+    srand(1);
+    for (size_t b = 0 ; b < NUMKEYS * 1000 ; b++)
+        data[b] = (char) rand();
+
+    printf("%-8s %8s %10s %10s\n", "impl", "maxlen", "Mkeys/s", "ns/key");
+    for (size_t m = 0 ; m < sizeof maxlens / sizeof maxlens[0] ; m++)
+    {
+        // Keys of every length up to maxlen, at every alignment.
+        size_t offset = 0;
+        for (size_t k = 0 ; k < NUMKEYS ; k++)
+        {
+            lens[k] = (size_t) rand() % (maxlens[m] + 1);
+            keys[k] = data + offset;
+            offset += lens[k] + 1;
+            MurmurHash3_x86_32(keys[k], (int) lens[k], SEED, &expected[k]);
+        }
+        check_incremental(keys, lens, expected, NUMKEYS / 16);
+
+        // One call per key
+        double best = 1e9;
+        for (int r = 0 ; r < REPEATS ; r++)
+        {
+            double start = now_seconds();
+            for (size_t k = 0 ; k < NUMKEYS ; k++)
+                MurmurHash3_x86_32(keys[k], (int) lens[k], SEED, &got[k]);
+            double elapsed = now_seconds() - start;
+            best = elapsed < best ? elapsed : best;
+        }
+        printf("%-8s %8zu %10.1f %10.2f\n", "single", maxlens[m], NUMKEYS / best / 1e6, best * 1e9 / NUMKEYS);
+
+        for (size_t n = 0 ; n < numnames ; n++)
+        {
+            if (!MurmurHash3_x86_32_batch_use(names[n]))
+            {
+                printf("%-8s %8zu %10s %10s\n", names[n], maxlens[m], "-", "-");
+                continue;
+            }
+            best = 1e9;
+            for (int r = 0 ; r < REPEATS ; r++)
+            {
+                memset(got, 0, NUMKEYS * sizeof (uint32_t));
+                double start = now_seconds();
+                for (size_t k = 0 ; k < NUMKEYS ; k += BATCH)
+                    MurmurHash3_x86_32_batch(keys + k, lens + k, BATCH, SEED, got + k);
+                double elapsed = now_seconds() - start;
+                best = elapsed < best ? elapsed : best;
+                if (memcmp(got, expected, NUMKEYS * sizeof (uint32_t)) != 0)
+                {
+                    fprintf(stderr, "bench-murmurhash3: %s disagrees with MurmurHash3_x86_32\n", names[n]);
+                    exit(1);
+                }
+            }
+            printf("%-8s %8zu %10.1f %10.2f\n", names[n], maxlens[m], NUMKEYS / best / 1e6, best * 1e9 / NUMKEYS);
+        }
+    }
+
+    free(data);
+    free(keys);
+    free(lens);
+    free(expected);
+    free(got);
+    return 0;
+}
@@ -0,0 +1,99 @@
+#!/bin/bash
+
+# Throughput benchmarks for pcat and hsplit.
+
+# Copyright 2011 John Kleint 
+# This is free software, licensed under the GNU General Public License v3,
+# available in the accompanying file LICENSE.txt.
+
+# Prints one JSON object per line for each case: which tool, line length
+# distribution, kind and number of inputs, and number of buckets it ran with,
+# and how it did (see runstat.c).  The input is the same every time (see
+# gen-lines.c), so results from different builds or machines are comparable.
+#
+# BENCH_BYTES sets how much input each case gets (default 128 MiB), and
+# BENCH_FILTER is a regular expression for which cases to run, matched
+# against names like "hsplit/medium/pipe/1/16".
+
+export LC_ALL=C
+set -e
+bindir=$(dirname $(readlink -f "${BASH_SOURCE[0]}"))/../bin
+bytes=${BENCH_BYTES:-$((128 * 1024 * 1024))}
+filter=${BENCH_FILTER:-.}
+tmpdir="$(mktemp -d -t ptpbench.XXXXXX)"
+trap 'rm -rf "$tmpdir"' EXIT
+ulimit -n 16384 2> /dev/null || true      # For pcat with thousands of inputs
+
+declare -A dists=(
+    [short]=fixed:16
+    [medium]=uniform:20-200
+    [long]=uniform:1000-10000
+    [mixed]=exp:80
+)
+
+# Usage: run TOOL DIST INPUT NUMINPUTS NUMBUCKETS DATAFILE [RUNSTAT OPTION]... -- COMMAND...
+function run {
+    local tool=$1 dist=$2 input=$3 inputs=$4 buckets=$5 data=$6
+    shift 6
+    local name="$tool/$dist/$input/$inputs/$buckets"
+    [[ $name =~ $filter ]] || return 0
+    local lines=$(wc -l < "$data")
+    local runstat_opts=()
+    while [[ $1 != -- ]]; do
+        runstat_opts+=("$1")
+        shift
+    done
+    shift
+    local stats=$("$bindir/runstat" "${runstat_opts[@]}" "$bytes" "$lines" "$@")
+    printf '{"case": "%s", "tool": "%s", "dist": "%s", "input": "%s", "inputs": %d, "buckets": %d, "bytes": %d, "lines": %d, %s}\n' \
+        "$name" "$tool" "${dists[$dist]}" "$input" "$inputs" "$buckets" "$bytes" "$lines" "$stats"
+}
+
+# Start feeding the split-up data to numbered FIFOs in the background.
+function feed_fifos {
+    local num=$1
+    for ((i=0; i < num; i++)); do
+        rm -f "$tmpdir/fifo.$i"
+        mkfifo "$tmpdir/fifo.$i"
+        cat "$tmpdir/split.$i" > "$tmpdir/fifo.$i" &
+    done
+}
+
+for dist in short medium long mixed; do
+    data="$tmpdir/data.$dist"
+    "$bindir/gen-lines" "$bytes" "${dists[$dist]}" > "$data"
+
+    # hsplit: hashcodes only, and to a few or many files, from a file or a pipe.
+    for buckets in 0 16 256; do
+        outputs=()
+        for ((b=0; b < buckets; b++)); do
+            outputs+=("$tmpdir/out.$b")
+        done
+        run hsplit $dist file 1 $buckets "$data" -f "$data" -- "$bindir/hsplit" "${outputs[@]}"
+        run hsplit $dist pipe 1 $buckets "$data" -p "$data" -- "$bindir/hsplit" "${outputs[@]}"
+        rm -f "$tmpdir"/out.*
+    done
+
+    # pcat: one input, from a file or a pipe.
+    run pcat $dist file 1 0 "$data" -f "$data" -- "$bindir/pcat"
+    run pcat $dist pipe 1 0 "$data" -p "$data" -- "$bindir/pcat"
+
+    # pcat: many inputs, all files or all pipes.
+    if [[ $dist == medium ]]; then
+        for inputs in 16 1000 10000; do
+            [[ "pcat/$dist/file/$inputs/0" =~ $filter || "pcat/$dist/pipe/$inputs/0" =~ $filter ]] || continue
+            split -n l/$inputs -d -a 5 "$data" "$tmpdir/split."
+            for ((i=0; i < inputs; i++)); do
+                mv "$tmpdir/split.$(printf '%05d' $i)" "$tmpdir/split.$i"
+            done
+            run pcat $dist file $inputs 0 "$data" -- "$bindir/pcat" "$tmpdir"/split.*
+            if [[ $inputs -le 16 && "pcat/$dist/pipe/$inputs/0" =~ $filter ]]; then
+                feed_fifos $inputs
+                run pcat $dist pipe $inputs 0 "$data" -- "$bindir/pcat" "$tmpdir"/fifo.*
+                wait
+            fi
+            rm -f "$tmpdir"/split.* "$tmpdir"/fifo.*
+        done
+    fi
+    rm -f "$data"
+done
@@ -0,0 +1,122 @@
+/****************************************************************************
+ gen-lines - Deterministic Synthetic Text for Benchmarks
+
+ Copyright 2011 John Kleint
+ This is free software, licensed under the GNU General Public License v3,
+ available in the accompanying file LICENSE.txt.
+
+ Write BYTES bytes of newline-terminated lines of random letters and digits
+ to standard output, with line lengths drawn from a distribution.  The same
+ arguments always give the same bytes, so benchmark runs are comparable.
+*****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+
+
+#define OUT_BYTES    (1024*1024)
+
+
+void printusage()
+{
+    fputs(
+        "Usage: gen-lines BYTES DIST [SEED]\n"
+        "Write BYTES bytes of random lines to standard output.  DIST gives the\n"
+        "lengths of the lines, not counting their newlines:\n\n"
+        "  fixed:N           all N bytes\n"
+        "  uniform:MIN-MAX   evenly spread between MIN and MAX\n"
+        "  exp:MEAN          exponentially distributed (many short lines, a few\n"
+        "                    long ones), with the given mean\n\n"
+        "The last line is cut short to make BYTES, but still ends with a newline.\n",
+        stderr);
+}
+
+
+/* xorshift64*: fast, and the same everywhere. */
+uint64_t next_random(uint64_t * state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 2685821657736338717ULL;
+}
+
+
+int main(int argc, char * argv[])
+{
+    static const char alphabet[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_-";
+    static char out[OUT_BYTES];
+    unsigned long long bytes, min = 0, max = 0;
+    double mean = 0;
+    enum { FIXED, UNIFORM, EXP } dist;
+    uint64_t state = 0x5ca1ab1e;
+
+    if (argc < 3 || argc > 4)
+    {
+        printusage();
+        exit(1);
+    }
+    bytes = strtoull(argv[1], NULL, 10);
+    if (sscanf(argv[2], "fixed:%llu", &min) == 1)
+    {
+        dist = FIXED;
+        max = min;
+    }
+    else if (sscanf(argv[2], "uniform:%llu-%llu", &min, &max) == 2 && min <= max)
+    {
+        dist = UNIFORM;
+    }
+    else if (sscanf(argv[2], "exp:%lf", &mean) == 1 && mean > 0)
+    {
+        dist = EXP;
+    }
+    else
+    {
+        fprintf(stderr, "gen-lines: Invalid distribution '%s'.\n", argv[2]);
+        exit(1);
+    }
+    if (argc == 4)
+        state += strtoull(argv[3], NULL, 10) * 0x9E3779B97F4A7C15ULL;
+
+    size_t outlen = 0;
+    while (bytes > 0)
+    {
+        unsigned long long len = min;
+        if (dist == UNIFORM)
+            len = min + next_random(&state) % (max - min + 1);
+        else if (dist == EXP)
+            len = (unsigned long long) (-mean * log(1.0 - (next_random(&state) >> 11) * 0x1.0p-53));
+        if (len + 1 > bytes)
+            len = bytes - 1;
+        bytes -= len + 1;
+
+        // Letters come from a random word, 6 bits at a time.
+        uint64_t word = 0;
+        for (unsigned long long c = 0 ; c <= len ; c++)
+        {
+            if (outlen == OUT_BYTES)
+            {
+                fwrite(out, 1, outlen, stdout);
+                outlen = 0;
+            }
+            if (c == len)
+            {
+                out[outlen++] = '\n';
+                break;
+            }
+            if (c % 10 == 0)
+                word = next_random(&state);
+            out[outlen++] = alphabet[word & 63];
+            word >>= 6;
+        }
+    }
+    if (fwrite(out, 1, outlen, stdout) < outlen || fflush(stdout) != 0)
+    {
+        perror("gen-lines: Error writing output");
+        exit(1);
+    }
+    return 0;
+}
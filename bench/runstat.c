@@ -0,0 +1,202 @@
+/****************************************************************************
+ runstat - Run a Command and Measure It
+
+ Copyright 2011 John Kleint
+ This is free software, licensed under the GNU General Public License v3,
+ available in the accompanying file LICENSE.txt.
+
+ Run a command on BYTES bytes (LINES lines) of input, and print how it did
+ as JSON object members: elapsed time, GB/s and lines/s, read and write
+ system calls per GB, and peak resident memory.  Measurements we can't make
+ are null.  For bench.sh.
+*****************************************************************************/
+
+#define _GNU_SOURCE                 // For wait4(2)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+
+#define FEED_BYTES   (64*1024)
+
+
+void printusage()
+{
+    fputs(
+        "Usage: runstat [OPTION]... BYTES LINES COMMAND [ARG]...\n"
+        "Run COMMAND, with its standard output going to /dev/null, and print\n"
+        "measurements of it as JSON object members.\n\n"
+        "  -f FILE    give COMMAND FILE as standard input\n"
+        "  -p FILE    feed FILE to COMMAND's standard input through a pipe\n"
+        "  -o FILE    send COMMAND's standard output to FILE\n",
+        stderr);
+}
+
+
+double now_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/** Our read and write system calls so far, including those of children
+ * we've waited for, or -1 if we can't tell. */
+long long io_syscalls()
+{
+    FILE * io = fopen("/proc/self/io", "r");
+    long long syscr = -1, syscw = -1;
+    char name[32];
+    long long value;
+
+    if (io == NULL)
+        return -1;
+    while (fscanf(io, "%31s %lld", name, &value) == 2)
+    {
+        if (strcmp(name, "syscr:") == 0)
+            syscr = value;
+        else if (strcmp(name, "syscw:") == 0)
+            syscw = value;
+    }
+    fclose(io);
+    return syscr < 0 || syscw < 0 ? -1 : syscr + syscw;
+}
+
+
+/** Copy fd in to fd out, counting our system calls in *calls. */
+void feed(int in, int out, long long * calls)
+{
+    static char buf[FEED_BYTES];
+    ssize_t len;
+
+    while (++*calls, (len = read(in, buf, sizeof buf)) > 0)
+    {
+        for (ssize_t done = 0 ; done < len ; )
+        {
+            ssize_t written = write(out, buf + done, len - done);
+            ++*calls;
+            if (written < 0)
+                return;             // The command stopped reading; it'll tell us why
+            done += written;
+        }
+    }
+}
+
+
+int main(int argc, char * argv[])
+{
+    const char * infile = NULL;
+    const char * outfile = "/dev/null";
+    int pipe_input = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "+f:p:o:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'f':
+        case 'p':
+            infile = optarg;
+            pipe_input = (opt == 'p');
+            break;
+        case 'o':
+            outfile = optarg;
+            break;
+        default:
+            printusage();
+            exit(1);
+        }
+    }
+    if (argc - optind < 3)
+    {
+        printusage();
+        exit(1);
+    }
+    double bytes = strtod(argv[optind], NULL);
+    double lines = strtod(argv[optind + 1], NULL);
+    char ** command = argv + optind + 2;
+
+    int in = infile != NULL ? open(infile, O_RDONLY) : STDIN_FILENO;
+    int out = open(outfile, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    int fds[2];
+    if (in < 0 || out < 0 || (pipe_input && pipe(fds) != 0))
+    {
+        perror("runstat");
+        exit(1);
+    }
+
+    long long fed = 0;
+    long long before = io_syscalls();
+    double start = now_seconds();
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        perror("runstat");
+        exit(1);
+    }
+    if (pid == 0)
+    {
+        if (pipe_input)
+        {
+            dup2(fds[0], STDIN_FILENO);
+            close(fds[0]);
+            close(fds[1]);
+        }
+        else
+        {
+            dup2(in, STDIN_FILENO);
+        }
+        dup2(out, STDOUT_FILENO);
+        execvp(command[0], command);
+        fprintf(stderr, "runstat: Can't run %s", command[0]);
+        perror("");
+        _exit(127);
+    }
+    if (pipe_input)
+    {
+        close(fds[0]);
+        feed(in, fds[1], &fed);
+        close(fds[1]);
+    }
+
+    int status;
+    struct rusage usage;
+    while (wait4(pid, &status, 0, &usage) < 0)
+    {
+        if (errno != EINTR)
+        {
+            perror("runstat");
+            exit(1);
+        }
+    }
+    double elapsed = now_seconds() - start;
+    long long after = io_syscalls();
+
+    int exitstatus = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    printf("\"exit_status\": %d, ", exitstatus);
+    if (exitstatus != 0)
+    {
+        printf("\"seconds\": null, \"gb_per_s\": null, \"lines_per_s\": null, "
+               "\"syscalls_per_gb\": null, \"peak_rss_kb\": null\n");
+        return 0;
+    }
+    printf("\"seconds\": %.4f, \"gb_per_s\": %.4f, \"lines_per_s\": %.0f, ",
+           elapsed, bytes / elapsed / 1e9, lines / elapsed);
+    // Our own calls, feeding the pipe and reading /proc, don't count.
+    if (before < 0 || after < 0 || bytes == 0)
+        printf("\"syscalls_per_gb\": null, ");
+    else
+        printf("\"syscalls_per_gb\": %.0f, ", (after - before - fed - 1) / (bytes / 1e9));
+    printf("\"peak_rss_kb\": %ld\n", usage.ru_maxrss);
+    return 0;
+}
@@ -0,0 +1,485 @@
+/****************************************************************************
+ Parallel Text Processing -- Bucket Output Buffers
+
+ Copyright 2011 John Kleint
+
+ This is free software, licensed under the GNU General Public License v3,
+ available in the accompanying file LICENSE.txt.
+
+ See buckets.h for documentation.
+****************************************************************************/
+
+#define _XOPEN_SOURCE 700       // For writev(2)
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "buckets.h"
+
+
+int buckets_init(bucket_set * set, const int * fds, unsigned int numbuckets, size_t bufsize, size_t budget)
+{
+    memset(set, 0, sizeof (bucket_set));
+    set->buckets = calloc(numbuckets > 0 ? numbuckets : 1, sizeof (struct bucket));
+    set->order = calloc(numbuckets > 0 ? numbuckets : 1, sizeof (struct bucket_rank));
+    if (set->buckets == NULL || set->order == NULL)
+    {
+        buckets_cleanup(set);
+        return 1;
+    }
+    for (unsigned int b = 0 ; b < numbuckets ; b++)
+    {
+        set->buckets[b].fd = fds[b];
+        set->buckets[b].flags = -1;
+    }
+    set->numbuckets = numbuckets;
+    set->bufsize = bufsize > 0 ? bufsize : 1;
+    set->budget = budget > set->bufsize ? budget : set->bufsize;
+    return 0;
+}
+
+
+/* Undo buckets_nonblocking(): outputs like stdout may be shared with programs that expect to block. */
+static void restore_blocking(bucket_set * set)
+{
+    for (unsigned int b = 0 ; b < set->numbuckets ; b++)
+    {
+        if (set->buckets[b].flags >= 0)
+            fcntl(set->buckets[b].fd, F_SETFL, set->buckets[b].flags);
+        set->buckets[b].flags = -1;
+    }
+    set->nonblock = 0;
+}
+
+
+int buckets_nonblocking(bucket_set * set)
+{
+    set->polls = calloc(set->numbuckets > 0 ? set->numbuckets : 1, sizeof (struct pollfd));
+    if (set->polls == NULL)
+        return 1;
+    for (unsigned int b = 0 ; b < set->numbuckets ; b++)
+    {
+        int flags = fcntl(set->buckets[b].fd, F_GETFL);
+        if (flags < 0 || fcntl(set->buckets[b].fd, F_SETFL, flags | O_NONBLOCK) < 0)
+        {
+            set->failed = b;
+            return 1;
+        }
+        set->buckets[b].flags = flags;
+        set->buckets[b].next_try = set->bufsize;
+    }
+    set->queuesize = set->numbuckets > 0 ? set->budget / set->numbuckets : set->budget;
+    if (set->queuesize < set->bufsize)
+        set->queuesize = set->bufsize;
+    set->nonblock = 1;
+    return 0;
+}
+
+
+void buckets_compress(bucket_set * set, compresspool * pool)
+{
+    set->compress = pool;
+}
+
+
+void buckets_time(bucket_set * set)
+{
+    set->timed = 1;
+}
+
+
+/* The time in nanoseconds, if we're keeping track of it. */
+static unsigned long long clock_if_timed(const bucket_set * set)
+{
+    struct timespec now;
+    if (!set->timed)
+        return 0;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+
+/* Write all of iov to fd, however many calls that takes.  Returns nonzero on error. */
+static int writev_fully(bucket_set * set, int fd, struct iovec * iov, int iovcnt)
+{
+    while (iovcnt > 0)
+    {
+        unsigned long long start = clock_if_timed(set);
+        ssize_t written = writev(fd, iov, iovcnt);
+        set->write_ns += clock_if_timed(set) - start;
+        set->writes++;
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return 1;
+        }
+        // Skip what got written; a short write leaves us partway through some iovec.
+        while (iovcnt > 0 && (size_t) written >= iov->iov_len)
+        {
+            written -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (char *) iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return 0;
+}
+
+
+/* Hand buf[0, len) to the compressor pool for bucket b, taking back a spare
+ * buffer in its place (in *buf and *size).  Returns nonzero on error. */
+static int hand_off(bucket_set * set, unsigned int b, char ** buf, size_t * size, size_t len)
+{
+    unsigned long long start = clock_if_timed(set);
+    int result = compresspool_write(set->compress, b, buf, size, len);
+    set->write_ns += clock_if_timed(set) - start;
+    set->writes++;
+    if (result != 0)
+        set->failed = compresspool_failed(set->compress);
+    return result;
+}
+
+
+/* flush_with(), when compressing: hand the buffer off, and a copy of data. */
+static int compress_with(bucket_set * set, unsigned int b, const char * data, size_t len)
+{
+    struct bucket * bucket = set->buckets + b;
+
+    if (bucket->len > 0)
+    {
+        if (hand_off(set, b, &bucket->buf, &bucket->size, bucket->len) != 0)
+            return 1;
+        set->buffered -= bucket->len;
+        bucket->len = 0;
+        // Don't let a spare that held a big chunk of data stay with a bucket.
+        if (bucket->size > set->bufsize)
+        {
+            free(bucket->buf);
+            bucket->buf = NULL;
+            bucket->size = 0;
+        }
+    }
+    if (len > 0)
+    {
+        char * copy = malloc(len);
+        size_t copysize = len;
+        if (copy == NULL)
+        {
+            set->failed = b;
+            return 1;
+        }
+        memcpy(copy, data, len);
+        int result = hand_off(set, b, &copy, &copysize, len);
+        free(copy);
+        return result;
+    }
+    return 0;
+}
+
+
+/* Write out bucket b's buffer, followed by len bytes of data (if any). */
+static int flush_with(bucket_set * set, unsigned int b, const char * data, size_t len)
+{
+    struct bucket * bucket = set->buckets + b;
+    struct iovec iov[2];
+    int iovcnt = 0;
+
+    if (set->compress != NULL)
+        return compress_with(set, b, data, len);
+
+    if (bucket->len > 0)
+    {
+        iov[iovcnt].iov_base = bucket->buf;
+        iov[iovcnt++].iov_len = bucket->len;
+    }
+    if (len > 0)
+    {
+        iov[iovcnt].iov_base = (void *) data;
+        iov[iovcnt++].iov_len = len;
+    }
+    if (writev_fully(set, bucket->fd, iov, iovcnt) != 0)
+    {
+        set->failed = b;
+        return 1;
+    }
+    set->buffered -= bucket->len;
+    bucket->len = 0;
+    return 0;
+}
+
+
+/*
+ * Nonblocking writes.  Each bucket is a queue: buf[start, len) hasn't been
+ * written yet.  We write what a bucket's reader will take whenever another
+ * bufsize bytes are waiting, and poll(2) only when some queue is full (or the
+ * set is over budget, or being flushed).
+ */
+
+/* Write as much of bucket b's queue as its file will take right now. */
+static int write_some(bucket_set * set, unsigned int b)
+{
+    struct bucket * bucket = set->buckets + b;
+
+    while (bucket->start < bucket->len)
+    {
+        unsigned long long start = clock_if_timed(set);
+        ssize_t written = write(bucket->fd, bucket->buf + bucket->start, bucket->len - bucket->start);
+        set->write_ns += clock_if_timed(set) - start;
+        set->writes++;
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            set->failed = b;
+            return 1;
+        }
+        bucket->start += written;
+        set->buffered -= written;
+    }
+    if (bucket->start == bucket->len)
+        bucket->start = bucket->len = 0;
+    bucket->next_try = bucket->len - bucket->start + set->bufsize;
+    return 0;
+}
+
+
+/* Wait until some bucket with anything queued (or bucket `also`) can be
+ * written to, and write to every one that can. */
+static int wait_and_write(bucket_set * set, unsigned int also)
+{
+    nfds_t numpolls = 0;
+
+    for (unsigned int b = 0 ; b < set->numbuckets ; b++)
+    {
+        if (set->buckets[b].len > set->buckets[b].start || b == also)
+        {
+            set->polls[numpolls].fd = set->buckets[b].fd;
+            set->polls[numpolls].events = POLLOUT;
+            set->polls[numpolls++].revents = 0;
+        }
+    }
+    unsigned long long start = clock_if_timed(set);
+    while (poll(set->polls, numpolls, -1) < 0)
+    {
+        if (errno != EINTR)
+            return 1;
+    }
+    set->write_ns += clock_if_timed(set) - start;
+    set->wakeups++;
+    for (nfds_t p = 0, b = 0 ; p < numpolls ; b++)
+    {
+        if (set->buckets[b].len > set->buckets[b].start || b == also)
+        {
+            // A reader that's gone shows up as POLLERR; the write will say so.
+            if (set->polls[p].revents != 0 && write_some(set, b) != 0)
+                return 1;
+            p++;
+        }
+    }
+    return 0;
+}
+
+
+/* Make room in bucket b's buffer for len more bytes, up to its queue size. */
+static int make_room(bucket_set * set, unsigned int b, size_t len)
+{
+    struct bucket * bucket = set->buckets + b;
+
+    if (bucket->len + len <= bucket->size)
+        return 0;
+    if (bucket->start > 0)
+    {
+        memmove(bucket->buf, bucket->buf + bucket->start, bucket->len - bucket->start);
+        bucket->len -= bucket->start;
+        bucket->start = 0;
+    }
+    if (bucket->len + len <= bucket->size)
+        return 0;
+    size_t newsize = bucket->size > 0 ? bucket->size : 4096;
+    while (newsize < bucket->len + len)
+        newsize *= 2;
+    if (newsize > set->queuesize)
+        newsize = set->queuesize;
+    char * newbuf = realloc(bucket->buf, newsize);
+    if (newbuf == NULL)
+    {
+        set->failed = b;
+        return 1;
+    }
+    bucket->buf = newbuf;
+    bucket->size = newsize;
+    return 0;
+}
+
+
+/* buckets_write(), when nonblocking: queue data, waiting only while b's queue is full. */
+static int queue_write(bucket_set * set, unsigned int b, const char * data, size_t len)
+{
+    struct bucket * bucket = set->buckets + b;
+
+    while (len > 0)
+    {
+        size_t queued = bucket->len - bucket->start;
+        if (queued + len >= bucket->next_try && queued > 0 && write_some(set, b) != 0)
+            return 1;
+        queued = bucket->len - bucket->start;
+        if (queued == set->queuesize)
+        {
+            if (wait_and_write(set, b) != 0)
+                return 1;
+            continue;
+        }
+        size_t piece = set->queuesize - queued < len ? set->queuesize - queued : len;
+        if (make_room(set, b, piece) != 0)
+            return 1;
+        memcpy(bucket->buf + bucket->len, data, piece);
+        bucket->len += piece;
+        set->buffered += piece;
+        if (set->buffered > set->peak)
+            set->peak = set->buffered;
+        data += piece;
+        len -= piece;
+    }
+    // Only possible when bufsize is more than an even share of the budget.
+    while (set->buffered > set->budget)
+        if (wait_and_write(set, set->numbuckets) != 0)
+            return 1;
+    return 0;
+}
+
+
+int buckets_flush(bucket_set * set, unsigned int b)
+{
+    if (set->nonblock)
+    {
+        while (set->buckets[b].len > set->buckets[b].start)
+            if (write_some(set, b) != 0 || (set->buckets[b].len > 0 && wait_and_write(set, b) != 0))
+                return 1;
+        return 0;
+    }
+    return flush_with(set, b, NULL, 0);
+}
+
+
+int buckets_flush_all(bucket_set * set)
+{
+    if (set->nonblock)
+    {
+        // Write to whichever buckets are ready, rather than one at a time.
+        int result = 0;
+        while (set->buffered > 0 && result == 0)
+            result = wait_and_write(set, set->numbuckets);
+        int error = errno;
+        restore_blocking(set);
+        errno = error;
+        return result;
+    }
+    for (unsigned int b = 0 ; b < set->numbuckets ; b++)
+        if (set->buckets[b].len > 0 && buckets_flush(set, b) != 0)
+            return 1;
+    if (set->compress != NULL && compresspool_finish(set->compress) != 0)
+    {
+        set->failed = compresspool_failed(set->compress);
+        return 1;
+    }
+    return 0;
+}
+
+
+/* qsort(3) comparison: fullest buckets first. */
+static int fuller(const void * a, const void * b)
+{
+    size_t alen = ((const struct bucket_rank *) a)->len;
+    size_t blen = ((const struct bucket_rank *) b)->len;
+    return alen > blen ? -1 : alen < blen;
+}
+
+
+/* Flush the fullest buckets until we're under half our budget. */
+static int flush_fullest(bucket_set * set)
+{
+    unsigned int numfull = 0;
+
+    for (unsigned int b = 0 ; b < set->numbuckets ; b++)
+    {
+        if (set->buckets[b].len > 0)
+        {
+            set->order[numfull].len = set->buckets[b].len;
+            set->order[numfull++].b = b;
+        }
+    }
+    qsort(set->order, numfull, sizeof (struct bucket_rank), fuller);
+    for (unsigned int f = 0 ; f < numfull && set->buffered > set->budget / 2 ; f++)
+        if (buckets_flush(set, set->order[f].b) != 0)
+            return 1;
+    return 0;
+}
+
+
+int buckets_write(bucket_set * set, unsigned int b, const char * data, size_t len)
+{
+    struct bucket * bucket = set->buckets + b;
+
+    if (set->nonblock)
+        return queue_write(set, b, data, len);
+    if (bucket->len + len > set->bufsize)
+    {
+        if (len >= set->bufsize)
+            return flush_with(set, b, data, len);       // Too big to be worth copying
+        if (buckets_flush(set, b) != 0)
+            return 1;
+    }
+    if (bucket->len + len > bucket->size)
+    {
+        // Start small, so buckets that never see much don't tie up a whole buffer.
+        size_t newsize = bucket->size > 0 ? bucket->size : 4096;
+        while (newsize < bucket->len + len)
+            newsize *= 2;
+        if (newsize > set->bufsize)
+            newsize = set->bufsize;
+        char * newbuf = realloc(bucket->buf, newsize);
+        if (newbuf == NULL)
+        {
+            set->failed = b;
+            return 1;
+        }
+        bucket->buf = newbuf;
+        bucket->size = newsize;
+    }
+    memcpy(bucket->buf + bucket->len, data, len);
+    bucket->len += len;
+    set->buffered += len;
+    if (set->buffered > set->peak)
+        set->peak = set->buffered;
+    if (set->buffered > set->budget)
+        return flush_fullest(set);
+    return 0;
+}
+
+
+void buckets_cleanup(bucket_set * set)
+{
+    if (set->buckets != NULL)
+    {
+        restore_blocking(set);
+        for (unsigned int b = 0 ; b < set->numbuckets ; b++)
+            free(set->buckets[b].buf);
+    }
+    free(set->buckets);
+    free(set->order);
+    free(set->polls);
+    set->buckets = NULL;
+    set->order = NULL;
+    set->polls = NULL;
+}
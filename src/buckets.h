@@ -0,0 +1,111 @@
+/****************************************************************************
+ Parallel Text Processing -- Bucket Output Buffers
+
+ Copyright 2011 John Kleint
+
+ This is free software, licensed under the GNU General Public License v3,
+ available in the accompanying file LICENSE.txt.
+*****************************************************************************/
+
+#ifndef BUCKETS_H_
+#define BUCKETS_H_
+
+#include <stdlib.h>
+#include <poll.h>
+
+#include "compresspool.h"
+
+#define BUCKET_BUFFER_BYTES     (64*1024)           // Default most to buffer per bucket
+#define BUCKET_MEMORY_BYTES     (64*1024*1024)      // Default most to buffer over all buckets
+
+
+/* One output file and the bytes waiting to be written to it. */
+struct bucket {
+    int fd;
+    char * buf;                 // Allocated as needed, up to the set's bufsize (or queuesize)
+    size_t len;
+    size_t size;
+    size_t start;               // Where the unwritten data in buf begins, when nonblocking
+    size_t next_try;            // Try writing when this much is waiting, when nonblocking
+    int flags;                  // fcntl(2) flags to restore, once made nonblocking (else -1)
+};
+
+/* How full a bucket is, for choosing which to flush. */
+struct bucket_rank {
+    size_t len;
+    unsigned int b;
+};
+
+/* A set of buckets sharing a memory budget. */
+typedef struct {
+    struct bucket * buckets;
+    unsigned int numbuckets;
+    size_t bufsize;             // Most to buffer for any one bucket
+    size_t budget;              // Most to buffer for all of them together
+    size_t buffered;            // How much is buffered right now
+    struct bucket_rank * order; // Scratch for choosing which buckets to flush
+    unsigned long long writes;  // write(2)/writev(2) calls made so far
+    unsigned int failed;        // Which bucket, when a call returns nonzero
+    int nonblock;               // Write without blocking, queueing what can't be written yet
+    size_t queuesize;           // Most to queue for any one bucket, when nonblocking
+    struct pollfd * polls;      // Scratch for waiting on buckets, when nonblocking
+    unsigned long long wakeups; // poll(2) calls made so far, when nonblocking
+    size_t peak;                // Most that's been buffered at once
+    int timed;                  // Keep track of write_ns (see buckets_time())
+    unsigned long long write_ns;    // Time spent writing, or waiting to
+    compresspool * compress;    // Where buffers go to be compressed and written, if anywhere
+} bucket_set;
+
+
+/**
+ * Set up numbuckets buckets writing to the (open) file descriptors fds,
+ * buffering up to bufsize bytes for each and budget bytes for all of them.
+ * Returns nonzero on error.  Buffers are only allocated once something is
+ * written to them.
+ */
+int buckets_init(bucket_set * set, const int * fds, unsigned int numbuckets, size_t bufsize, size_t budget);
+
+/**
+ * Append len bytes of data to bucket b.  Writes the bucket out when it fills
+ * up; data that wouldn't fit in an empty buffer is written straight through,
+ * along with what's buffered, in one writev(2).  If all the buckets together
+ * go over budget, the fullest are written out first until they're back under
+ * half of it.  Returns nonzero on error, with errno and set->failed set.
+ */
+int buckets_write(bucket_set * set, unsigned int b, const char * data, size_t len);
+
+/**
+ * Make writes to the buckets' file descriptors nonblocking, so a slow reader
+ * of one (a pipe, say) doesn't hold up the rest.  Each bucket then queues up
+ * to the larger of bufsize and an even share of the budget: when a bucket's
+ * queue fills, buckets_write() waits with poll(2) for it to take more,
+ * meanwhile writing to whichever others will take data.  Only waits for input
+ * when a queue is full.  buckets_flush_all() and buckets_cleanup() put the
+ * descriptors back the way they were.  Returns nonzero on error, with errno set.
+ */
+int buckets_nonblocking(bucket_set * set);
+
+/**
+ * Compress the buckets' output with pool, which writes to the same file
+ * descriptors: instead of being written, each bucket's buffer is handed to
+ * the pool whenever it would be, and compressed (as a gzip member or zstd
+ * frame of its own) while the next one fills.  Bigger buffers compress
+ * better.  The pool is still the caller's to free, after buckets_flush_all().
+ */
+void buckets_compress(bucket_set * set, compresspool * pool);
+
+/** Keep track of how long writing to the buckets takes, in set->write_ns. */
+void buckets_time(bucket_set * set);
+
+/** Write out everything buffered for bucket b.  Returns nonzero on error, like buckets_write(). */
+int buckets_flush(bucket_set * set, unsigned int b);
+
+/** Write out everything buffered (and wait for it to be compressed and written,
+ * if compressing).  Returns nonzero on error, like buckets_write(). */
+int buckets_flush_all(bucket_set * set);
+
+/** Free a bucket set's buffers.  Does not flush them or close the file descriptors. */
+void buckets_cleanup(bucket_set * set);
+
+
+#endif /* BUCKETS_H_ */
@@ -0,0 +1,343 @@
+/****************************************************************************
+ Parallel Text Processing -- Compressed Input and Output
+
+ Copyright 2011 John Kleint
+
+ This is free software, licensed under the GNU General Public License v3,
+ available in the accompanying file LICENSE.txt.
+
+ See codec.h for documentation.
+****************************************************************************/
+
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+#ifdef PTP_ZSTD
+#include <zstd.h>
+#endif
+
+#include "codec.h"
+
+#define GZIP_WINDOW_BITS (15 + 16)      // The largest window, with a gzip header rather than zlib's
+
+
+struct decoder {
+    int fd;
+    enum codec codec;           // Once sniffed
+    int sniffed;
+    int eof;                    // Nothing more to read from fd
+    int ended;                  // The member or frame we were in has ended
+    unsigned char * in;         // Compressed input...
+    size_t inpos;               // ...of which in[inpos, inlen) hasn't been decompressed yet
+    size_t inlen;
+    z_stream z;
+    int zinit;
+#ifdef PTP_ZSTD
+    ZSTD_DStream * zstd;
+#endif
+};
+
+struct encoder {
+    enum codec codec;
+    char * out;
+    size_t outsize;
+    z_stream z;
+#ifdef PTP_ZSTD
+    ZSTD_CCtx * zstd;
+#endif
+};
+
+
+int parse_codec(const char * name, enum codec * codec)
+{
+    if (strcmp(name, "gzip") == 0)
+        *codec = CODEC_GZIP;
+#ifdef PTP_ZSTD
+    else if (strcmp(name, "zstd") == 0)
+        *codec = CODEC_ZSTD;
+#endif
+    else
+        return 1;
+    return 0;
+}
+
+
+decoder * decoder_create(void)
+{
+    decoder * dec = calloc(1, sizeof (decoder));
+    if (dec == NULL)
+        return NULL;
+    dec->in = malloc(CODEC_INPUT_BYTES);
+    if (dec->in == NULL)
+    {
+        free(dec);
+        return NULL;
+    }
+    dec->fd = -1;
+    return dec;
+}
+
+
+void decoder_start(decoder * dec, int fd)
+{
+    dec->fd = fd;
+    dec->codec = CODEC_NONE;
+    dec->sniffed = dec->eof = dec->ended = 0;
+    dec->inpos = dec->inlen = 0;
+}
+
+
+/* Read more compressed input, once what we have is used up.  Returns nonzero on error. */
+static int fill_input(decoder * dec)
+{
+    ssize_t got = read(dec->fd, dec->in, CODEC_INPUT_BYTES);
+    if (got < 0)
+        return 1;
+    dec->inpos = 0;
+    dec->inlen = (size_t) got;
+    dec->eof = (got == 0);
+    return 0;
+}
+
+
+/* Read the first few bytes, and tell from them how the input is compressed.
+ * Returns nonzero on error. */
+static int sniff(decoder * dec)
+{
+    static const unsigned char gzip_magic[] = { 0x1f, 0x8b };
+    static const unsigned char zstd_magic[] = { 0x28, 0xb5, 0x2f, 0xfd };
+
+    while (dec->inlen < sizeof zstd_magic && !dec->eof)
+    {
+        ssize_t got = read(dec->fd, dec->in + dec->inlen, CODEC_INPUT_BYTES - dec->inlen);
+        if (got < 0)
+            return 1;
+        dec->inlen += got;
+        dec->eof = (got == 0);
+    }
+    dec->sniffed = 1;
+    if (dec->inlen >= sizeof gzip_magic && memcmp(dec->in, gzip_magic, sizeof gzip_magic) == 0)
+    {
+        dec->codec = CODEC_GZIP;
+        if (dec->zinit)
+            return inflateReset(&dec->z) != Z_OK;
+        dec->zinit = inflateInit2(&dec->z, GZIP_WINDOW_BITS) == Z_OK;
+        return !dec->zinit;
+    }
+    if (dec->inlen >= sizeof zstd_magic && memcmp(dec->in, zstd_magic, sizeof zstd_magic) == 0)
+    {
+        dec->codec = CODEC_ZSTD;
+#ifdef PTP_ZSTD
+        if (dec->zstd == NULL && (dec->zstd = ZSTD_createDStream()) == NULL)
+            return 1;
+        return ZSTD_isError(ZSTD_initDStream(dec->zstd));
+#else
+        errno = ENOTSUP;
+        return 1;
+#endif
+    }
+    return 0;
+}
+
+
+/* decoder_read() for gzip: inflate members one after another until we get something. */
+static ssize_t read_gzip(decoder * dec, void * buf, size_t len)
+{
+    for (;;)
+    {
+        if (dec->inpos == dec->inlen && !dec->eof && fill_input(dec) != 0)
+            return -1;
+        if (dec->ended)                 // Another member, or the end
+        {
+            if (dec->inpos == dec->inlen)
+                return 0;               // (We'd have read more if there were any)
+            // Zeros after a member are padding (from tar, or a block device), like gzip -d takes them to be.
+            const unsigned char * nonzero = dec->in + dec->inpos;
+            while (nonzero < dec->in + dec->inlen && *nonzero == 0)
+                nonzero++;
+            if (nonzero == dec->in + dec->inlen)
+            {
+                dec->inpos = dec->inlen;
+                continue;
+            }
+            if (inflateReset(&dec->z) != Z_OK)
+                break;
+            dec->ended = 0;
+        }
+
+        dec->z.next_in = dec->in + dec->inpos;
+        dec->z.avail_in = (uInt) (dec->inlen - dec->inpos);
+        dec->z.next_out = buf;
+        dec->z.avail_out = len < UINT_MAX ? (uInt) len : UINT_MAX;
+        int result = inflate(&dec->z, Z_NO_FLUSH);
+        size_t produced = (len < UINT_MAX ? len : UINT_MAX) - dec->z.avail_out;
+        dec->inpos = dec->inlen - dec->z.avail_in;
+        if (result == Z_STREAM_END)
+            dec->ended = 1;
+        else if (result != Z_OK && result != Z_BUF_ERROR)
+            break;
+        if (produced > 0)
+            return (ssize_t) produced;
+        if (!dec->ended && dec->eof && dec->inpos == dec->inlen)
+            break;                      // Cut short
+    }
+    errno = EBADMSG;
+    return -1;
+}
+
+
+#ifdef PTP_ZSTD
+/* decoder_read() for zstd, which goes from one frame to the next by itself. */
+static ssize_t read_zstd(decoder * dec, void * buf, size_t len)
+{
+    for (;;)
+    {
+        if (dec->inpos == dec->inlen && !dec->eof && fill_input(dec) != 0)
+            return -1;
+        if (dec->eof && dec->inpos == dec->inlen)
+        {
+            if (dec->ended)
+                return 0;
+            break;                      // Cut short
+        }
+
+        ZSTD_inBuffer input = { dec->in, dec->inlen, dec->inpos };
+        ZSTD_outBuffer output = { buf, len, 0 };
+        size_t result = ZSTD_decompressStream(dec->zstd, &output, &input);
+        if (ZSTD_isError(result))
+            break;
+        dec->inpos = input.pos;
+        dec->ended = (result == 0);
+        if (output.pos > 0)
+            return (ssize_t) output.pos;
+    }
+    errno = EBADMSG;
+    return -1;
+}
+#endif
+
+
+ssize_t decoder_read(decoder * dec, void * buf, size_t len)
+{
+    if (!dec->sniffed && sniff(dec) != 0)
+        return -1;
+    switch (dec->codec)
+    {
+    case CODEC_GZIP:
+        return read_gzip(dec, buf, len);
+#ifdef PTP_ZSTD
+    case CODEC_ZSTD:
+        return read_zstd(dec, buf, len);
+#endif
+    default:
+        break;
+    }
+
+    // Not compressed: hand over what we sniffed, then read straight through.
+    if (dec->inpos < dec->inlen)
+    {
+        size_t n = dec->inlen - dec->inpos < len ? dec->inlen - dec->inpos : len;
+        memcpy(buf, dec->in + dec->inpos, n);
+        dec->inpos += n;
+        return (ssize_t) n;
+    }
+    return dec->eof ? 0 : read(dec->fd, buf, len);
+}
+
+
+void decoder_destroy(decoder * dec)
+{
+    if (dec->zinit)
+        inflateEnd(&dec->z);
+#ifdef PTP_ZSTD
+    ZSTD_freeDStream(dec->zstd);
+#endif
+    free(dec->in);
+    free(dec);
+}
+
+
+encoder * encoder_create(enum codec codec)
+{
+    encoder * enc = calloc(1, sizeof (encoder));
+    if (enc == NULL)
+        return NULL;
+    enc->codec = codec;
+    if (codec == CODEC_GZIP
+            && deflateInit2(&enc->z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, GZIP_WINDOW_BITS, 8, Z_DEFAULT_STRATEGY) == Z_OK)
+        return enc;
+#ifdef PTP_ZSTD
+    if (codec == CODEC_ZSTD && (enc->zstd = ZSTD_createCCtx()) != NULL)
+        return enc;
+#endif
+    free(enc);
+    return NULL;
+}
+
+
+/* Make sure enc->out can hold size bytes.  Returns nonzero on error. */
+static int reserve_output(encoder * enc, size_t size)
+{
+    if (size <= enc->outsize)
+        return 0;
+    char * out = realloc(enc->out, size);
+    if (out == NULL)
+        return 1;
+    enc->out = out;
+    enc->outsize = size;
+    return 0;
+}
+
+
+const char * encoder_compress(encoder * enc, const char * data, size_t len, size_t * outlen)
+{
+#ifdef PTP_ZSTD
+    if (enc->codec == CODEC_ZSTD)
+    {
+        if (reserve_output(enc, ZSTD_compressBound(len)) != 0)
+            return NULL;
+        size_t result = ZSTD_compressCCtx(enc->zstd, enc->out, enc->outsize, data, len, ZSTD_CLEVEL_DEFAULT);
+        if (ZSTD_isError(result))
+        {
+            errno = EINVAL;
+            return NULL;
+        }
+        *outlen = result;
+        return enc->out;
+    }
+#endif
+
+    // One deflate(Z_FINISH) call does it all, given room for the worst case.
+    if (len > UINT_MAX / 2)
+    {
+        errno = EFBIG;
+        return NULL;
+    }
+    if (deflateReset(&enc->z) != Z_OK || reserve_output(enc, deflateBound(&enc->z, len)) != 0)
+        return NULL;
+    enc->z.next_in = (Bytef *) data;
+    enc->z.avail_in = (uInt) len;
+    enc->z.next_out = (Bytef *) enc->out;
+    enc->z.avail_out = enc->outsize < UINT_MAX ? (uInt) enc->outsize : UINT_MAX;
+    if (deflate(&enc->z, Z_FINISH) != Z_STREAM_END)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    *outlen = enc->z.total_out;
+    return enc->out;
+}
+
+
+void encoder_destroy(encoder * enc)
+{
+    if (enc->codec == CODEC_GZIP)
+        deflateEnd(&enc->z);
+#ifdef PTP_ZSTD
+    ZSTD_freeCCtx(enc->zstd);
+#endif
+    free(enc->out);
+    free(enc);
+}
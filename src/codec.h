@@ -0,0 +1,68 @@
+/****************************************************************************
+ Parallel Text Processing -- Compressed Input and Output
+
+ Copyright 2011 John Kleint
+
+ This is free software, licensed under the GNU General Public License v3,
+ available in the accompanying file LICENSE.txt.
+*****************************************************************************/
+
+#ifndef CODEC_H_
+#define CODEC_H_
+
+#include <stdlib.h>
+#include <sys/types.h>
+
+#define CODEC_INPUT_BYTES   (256*1024)          // How much compressed input a decoder reads at a time
+
+
+/* Compression formats.  zstd is only there if built with it (make ZSTD=1). */
+enum codec { CODEC_NONE, CODEC_GZIP, CODEC_ZSTD };
+
+/* Reads a file that may be compressed, decompressing as it goes.  Opaque. */
+typedef struct decoder decoder;
+
+/* Compresses data a chunk at a time.  Opaque. */
+typedef struct encoder encoder;
+
+
+/** Parse the name of a compression format ("gzip" or "zstd").  Returns nonzero if unknown or not built in. */
+int parse_codec(const char * name, enum codec * codec);
+
+/** Set up a decoder.  Returns NULL on error. */
+decoder * decoder_create(void);
+
+/**
+ * Start decoding (open) file descriptor fd from the beginning.  Whether it's
+ * compressed, and how, is up to its first few bytes: gzip and zstd streams
+ * are decompressed (all their members or frames, one after another, ignoring
+ * zero padding after the last gzip member), and anything else is read as it is.
+ */
+void decoder_start(decoder * dec, int fd);
+
+/**
+ * Like read(2): read up to len decompressed bytes into buf.  Returns how many,
+ * 0 at the end, or -1 with errno set on error -- EBADMSG if the data is
+ * corrupt or cut short, ENOTSUP for zstd without zstd support.
+ */
+ssize_t decoder_read(decoder * dec, void * buf, size_t len);
+
+/** Free a decoder.  Does not close its file descriptor. */
+void decoder_destroy(decoder * dec);
+
+/** Set up an encoder for the given format, at its default level.  Returns NULL on error. */
+encoder * encoder_create(enum codec codec);
+
+/**
+ * Compress len bytes of data as one complete gzip member or zstd frame, which
+ * can just be appended to ones before it: decompressing them all gives all
+ * their data, in order.  Returns the compressed data, in a buffer that's good
+ * until the next call, and its length in *outlen; or NULL on error.
+ */
+const char * encoder_compress(encoder * enc, const char * data, size_t len, size_t * outlen);
+
+/** Free an encoder. */
+void encoder_destroy(encoder * enc);
+
+
+#endif /* CODEC_H_ */
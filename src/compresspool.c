@@ -0,0 +1,243 @@
+/****************************************************************************
+ Parallel Text Processing -- Compressor Thread Pool
+
+ Copyright 2011 John Kleint
+
+ This is free software, licensed under the GNU General Public License v3,
+ available in the accompanying file LICENSE.txt.
+
+ See compresspool.h for documentation.
+****************************************************************************/
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "compresspool.h"
+
+/* A chunk of data waiting to be compressed and written. */
+struct job {
+    unsigned int output;
+    char * data;
+    size_t len;
+    size_t size;
+};
+
+/* Output b always goes to thread b % numthreads, which keeps each output's
+ * chunks in order without any more bookkeeping.  head and tail only ever
+ * increase, and are guarded by the pool's lock. */
+struct worker {
+    pthread_t thread;
+    struct job jobs[COMPRESSPOOL_QUEUE];
+    unsigned int head;          // Next job to do
+    unsigned int tail;          // Where the next job goes
+    pthread_cond_t work;        // Signaled when a job is queued, or we're stopping
+    encoder * encoder;
+    compresspool * pool;
+};
+
+struct compresspool {
+    struct worker * workers;
+    unsigned int numthreads;
+    unsigned int started;       // Threads running
+    const int * fds;
+    pthread_mutex_t lock;
+    pthread_cond_t done;        // Signaled when a job is done
+    struct job * spares;        // Buffers done with, to hand back
+    unsigned int numspares;
+    int stop;
+    int error;                  // The first write error (an errno), or 0...
+    unsigned int failed;        // ...and which output it was for
+};
+
+
+/* Write all of data[0, len) to fd.  Returns nonzero on error. */
+static int write_fully(int fd, const char * data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t written = write(fd, data, len);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return 1;
+        }
+        data += written;
+        len -= written;
+    }
+    return 0;
+}
+
+
+/* A pool thread: compress and write its outputs' chunks, in order. */
+static void * compress_jobs(void * arg)
+{
+    struct worker * worker = arg;
+    compresspool * pool = worker->pool;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;)
+    {
+        while (worker->head == worker->tail && !pool->stop)
+            pthread_cond_wait(&worker->work, &pool->lock);
+        if (worker->head == worker->tail)
+            break;
+        struct job job = worker->jobs[worker->head % COMPRESSPOOL_QUEUE];
+        int failing = pool->error != 0;
+        pthread_mutex_unlock(&pool->lock);
+
+        // Once something has failed, the rest is going nowhere anyway.
+        int error = 0;
+        if (!failing)
+        {
+            size_t outlen;
+            errno = 0;
+            const char * out = encoder_compress(worker->encoder, job.data, job.len, &outlen);
+            if (out == NULL || write_fully(pool->fds[job.output], out, outlen) != 0)
+                error = errno != 0 ? errno : EIO;
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        if (error != 0 && pool->error == 0)
+        {
+            pool->error = error;
+            pool->failed = job.output;
+        }
+        if (pool->numspares < pool->numthreads * COMPRESSPOOL_QUEUE)
+            pool->spares[pool->numspares++] = job;
+        else
+            free(job.data);
+        worker->head++;
+        pthread_cond_broadcast(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+
+compresspool * compresspool_create(enum codec codec, unsigned int numthreads, const int * fds)
+{
+    if (numthreads == 0)
+        numthreads = 1;
+    compresspool * pool = calloc(1, sizeof (compresspool));
+    if (pool == NULL)
+        return NULL;
+    pool->workers = calloc(numthreads, sizeof (struct worker));
+    pool->spares = calloc(numthreads * COMPRESSPOOL_QUEUE, sizeof (struct job));
+    if (pool->workers == NULL || pool->spares == NULL)
+    {
+        free(pool->workers);
+        free(pool->spares);
+        free(pool);
+        return NULL;
+    }
+    pool->numthreads = numthreads;
+    pool->fds = fds;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    for (unsigned int t = 0 ; t < numthreads ; t++)
+    {
+        struct worker * worker = pool->workers + t;
+        worker->pool = pool;
+        pthread_cond_init(&worker->work, NULL);
+        worker->encoder = encoder_create(codec);
+        if (worker->encoder == NULL)
+        {
+            compresspool_destroy(pool);
+            return NULL;
+        }
+    }
+    for ( ; pool->started < numthreads ; pool->started++)
+    {
+        struct worker * worker = pool->workers + pool->started;
+        if (pthread_create(&worker->thread, NULL, compress_jobs, worker) != 0)
+        {
+            compresspool_destroy(pool);
+            return NULL;
+        }
+    }
+    return pool;
+}
+
+
+int compresspool_write(compresspool * pool, unsigned int output, char ** data, size_t * size, size_t len)
+{
+    struct worker * worker = pool->workers + output % pool->numthreads;
+
+    pthread_mutex_lock(&pool->lock);
+    while (worker->tail - worker->head == COMPRESSPOOL_QUEUE && pool->error == 0)
+        pthread_cond_wait(&pool->done, &pool->lock);
+    int error = pool->error;
+    if (error == 0)
+    {
+        struct job * job = worker->jobs + worker->tail % COMPRESSPOOL_QUEUE;
+        job->output = output;
+        job->data = *data;
+        job->len = len;
+        job->size = *size;
+        worker->tail++;
+        pthread_cond_signal(&worker->work);
+
+        // Hand back a buffer in its place, if we have one.
+        *data = NULL;
+        *size = 0;
+        if (pool->numspares > 0)
+        {
+            pool->numspares--;
+            *data = pool->spares[pool->numspares].data;
+            *size = pool->spares[pool->numspares].size;
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    errno = error;
+    return error != 0;
+}
+
+
+int compresspool_finish(compresspool * pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    for (unsigned int t = 0 ; t < pool->numthreads ; t++)
+        while (pool->workers[t].head != pool->workers[t].tail)
+            pthread_cond_wait(&pool->done, &pool->lock);
+    int error = pool->error;
+    pthread_mutex_unlock(&pool->lock);
+    errno = error;
+    return error != 0;
+}
+
+
+unsigned int compresspool_failed(const compresspool * pool)
+{
+    return pool->failed;
+}
+
+
+void compresspool_destroy(compresspool * pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    for (unsigned int t = 0 ; t < pool->numthreads ; t++)
+        pthread_cond_signal(&pool->workers[t].work);
+    pthread_mutex_unlock(&pool->lock);
+    for (unsigned int t = 0 ; t < pool->started ; t++)
+        pthread_join(pool->workers[t].thread, NULL);
+    for (unsigned int t = 0 ; t < pool->numthreads ; t++)
+    {
+        struct worker * worker = pool->workers + t;
+        for ( ; worker->head != worker->tail ; worker->head++)      // Only if threads never started
+            free(worker->jobs[worker->head % COMPRESSPOOL_QUEUE].data);
+        if (worker->encoder != NULL)
+            encoder_destroy(worker->encoder);
+        pthread_cond_destroy(&worker->work);
+    }
+    for (unsigned int s = 0 ; s < pool->numspares ; s++)
+        free(pool->spares[s].data);
+    pthread_cond_destroy(&pool->done);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->workers);
+    free(pool->spares);
+    free(pool);
+}
@@ -0,0 +1,53 @@
+/****************************************************************************
+ Parallel Text Processing -- Compressor Thread Pool
+
+ Copyright 2011 John Kleint
+
+ This is free software, licensed under the GNU General Public License v3,
+ available in the accompanying file LICENSE.txt.
+*****************************************************************************/
+
+#ifndef COMPRESSPOOL_H_
+#define COMPRESSPOOL_H_
+
+#include <stdlib.h>
+
+#include "codec.h"
+
+#define COMPRESSPOOL_QUEUE  (4)         // Most chunks waiting for (or being compressed by) each thread
+
+
+/* A pool of threads compressing chunks of data and writing them to outputs.  Opaque. */
+typedef struct compresspool compresspool;
+
+
+/**
+ * Set up a pool of numthreads threads compressing with codec, writing to the
+ * (open) file descriptors fds, indexed by output number.  fds must last as
+ * long as the pool.  Returns NULL on error.
+ */
+compresspool * compresspool_create(enum codec codec, unsigned int numthreads, const int * fds);
+
+/**
+ * Compress the first len bytes of *data, a malloc(3)ed buffer of *size bytes,
+ * as one gzip member or zstd frame, and append it to output number `output`.
+ * The pool takes the buffer, and hands back one it's done with in its place,
+ * or NULL (with *size 0) if none is free.  Each output's chunks are written in
+ * the order they were given, by the same thread, while other outputs' chunks
+ * are compressed at the same time.  Only waits if that thread has a full
+ * queue.  Returns nonzero (with errno set) if writing some chunk has failed;
+ * see compresspool_failed().
+ */
+int compresspool_write(compresspool * pool, unsigned int output, char ** data, size_t * size, size_t len);
+
+/** Wait for everything given to compresspool_write() to be written.  Returns nonzero on error, like it. */
+int compresspool_finish(compresspool * pool);
+
+/** Which output a write failed for, once compresspool_write() or compresspool_finish() says one did. */
+unsigned int compresspool_failed(const compresspool * pool);
+
+/** Stop the threads and free the pool, once what's been given to it is written.  Does not close the outputs. */
+void compresspool_destroy(compresspool * pool);
+
+
+#endif /* COMPRESSPOOL_H_ */
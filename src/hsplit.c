@@ -10,25 +10,115 @@
 *****************************************************************************/
 
 #define _XOPEN_SOURCE 700        // For getline(3)
+#define _GNU_SOURCE              // For getopt_long(3)
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <limits.h>
 #include <assert.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "ptp.h"
+#include "buckets.h"
+#include "codec.h"
+#include "compresspool.h"
+#include "lineindex.h"
 #include "murmurhash3.h"
+#include "xxhash.h"
 
 
 #define HASH_SEED    (0x5ca1ab1e)
+#define CHUNK_BYTES  (1024*1024)        // How much input each worker thread takes at a time
+#define LINE_BATCH   (1024)             // How many lines to find at a time
+#define LONG_LINE_BYTES (1024*1024)     // Stream longer lines through, rather than buffering them whole
 
 
-/* Holds the output FILE pointers.  */
+/* The hash functions we can split by. */
+enum hash_kind { HASH_MURMUR3_32, HASH_MURMUR3_X64_128, HASH_XXH64 };
+
+/* A hash being computed a piece at a time. */
+struct line_hash {
+    enum hash_kind kind;
+    union {
+        MurmurHash3_x86_32_state murmur3_32;
+        MurmurHash3_x64_128_state murmur3_x64_128;
+        xxh64_state xxh64;
+    } state;
+};
+
+/* A line too long to buffer, which we hash (and spool, to write out once we
+ * know its file) as we read it.  */
+struct long_line {
+    int started;
+    struct line_hash hash;
+    char last;                  // Last byte seen, not hashed yet
+    FILE * spool;               // The line so far; NULL with no output files
+    unsigned long long len;     // Bytes seen so far
+};
+
+/* A range of fields or bytes, numbered from 1; last is SIZE_MAX for "to the end". */
+struct key_range {
+    size_t first;
+    size_t last;
+};
+
+/* Which part of a line to hash, like cut(1)'s -f or -b: the selected fields
+ * (joined by the delimiter) or bytes, in order.  No ranges means the whole
+ * line.  */
+struct key_spec {
+    int bytes;                  // Ranges are of bytes, not fields
+    char delim;
+    struct key_range * ranges;  // Sorted, and not touching each other
+    unsigned int numranges;
+};
+
+/* What --stats reports; see print_stats().  The writer thread prints them on
+ * SIGUSR1, so the main thread copies its counts for the inputs to snapshot
+ * whenever it hands over a chunk.  */
+struct stats {
+    FILE * file;                        // Where to print them
+    unsigned long long started;         // When we started, by clock_ns()
+    unsigned int numinputs;
+    const char ** names;                // Name of each input
+    process_lines_stats * inputs;       // Counts for each input...
+    process_lines_stats * snapshot;     // ...as of the last chunk the main thread handed over
+    unsigned long long * lines;         // Lines that went to each output file
+    unsigned long long * bytes;         // ...and how many bytes they came to
+};
+
+/* Holds the output files' buffers.  */
 struct fileinfo {
     unsigned int numfiles;
-    FILE ** files;
+    enum hash_kind hashkind;
+    int consistent;                     // Choose files by jump consistent hash
+    unsigned int remap_old;             // With no files, print the file a line goes to
+    unsigned int remap_new;             // with remap_old files, and with remap_new (if nonzero)
+    int binary;                         // With no files, print hashcodes as raw little-endian integers
+    int with_line;                      // With no files, follow each hashcode with a tab and its line
+    struct key_spec key;
+    bucket_set * buckets;
+    struct long_line longline;
+    struct stats * stats;               // Or NULL, without --stats
+};
+
+/* A batch of lines found by next_lines(). */
+struct line_batch {
+    const char * lines[LINE_BATCH];     // Start of each line
+    size_t lens[LINE_BATCH];            // Length of each line, excluding its newline
+    const char * keys[LINE_BATCH];      // The part of each line to hash...
+    size_t keylens[LINE_BATCH];         // ...and its length
+    uint64_t hashes[LINE_BATCH];        // Hashcode of each line, from hash_lines()
+    uint32_t hashes32[LINE_BATCH];      // Scratch for 32-bit hashcodes
+    uint32_t ends[LINE_BATCH];          // Scratch for index_lines()
 };
 
 
@@ -40,163 +130,1659 @@ void printusage()
         "lines end up in the same FILE.\n\n"
 
         "Lines in any particular output FILE will have the same order they did in the\n"
-        "input.  hsplit does not add a final newline if the input lacks one.\n\n"
+        "input.  hsplit does not add a final newline if an input lacks one.  Inputs\n"
+        "that are regular files are mapped into memory rather than read.\n\n"
 
-        "With no FILE(s), print the 32-bit unsigned integer hash code for each input\n"
-        "line to standard output.\n\n"
+        "With no FILE(s), print the unsigned integer hash code for each input line to\n"
+        "standard output: 32 bits with the default hash function, else 64.\n\n"
 
         "  -h,  --help                display this help and exit\n"
         "  -a,  --append              append to FILE(s) rather than overwrite\n"
+        "  -r,  --reader=READER       buffer input with READER: 'buffer' (the default)\n"
+        "                             or 'ring' (a mirrored ring buffer; Linux only)\n"
+        "  -i,  --input=INPUT         read INPUT rather than standard input; may be given\n"
+        "                             more than once, to split several INPUTs in order\n"
+        "  -j,  --jobs=N              hash with N threads; output is the same.  The\n"
+        "                             default is 1, or one per CPU if reading a file\n"
+        "  -B,  --bucket-buffer=SIZE  buffer up to SIZE bytes of output per FILE\n"
+        "                             (default 64K); K, M, and G suffixes work\n"
+        "  -m,  --memory=SIZE         buffer up to SIZE bytes of output over all FILEs\n"
+        "                             (default 64M), writing out the fullest first\n"
+        "       --nonblock            don't let a FILE that's slow to take output (a\n"
+        "                             pipe to a busy process, say) hold up the others:\n"
+        "                             queue up to an even share of --memory for each,\n"
+        "                             and write to whichever are ready\n"
+        "  -z,  --compress=CODEC      compress FILEs with CODEC: 'gzip' (or 'zstd', if\n"
+        "                             built with it).  Each --bucket-buffer's worth is\n"
+        "                             compressed on its own, on another thread, so a\n"
+        "                             bigger one compresses better\n"
+        "       --compress-jobs=N     compress with N threads (default one per CPU)\n"
+        "       --hash=FUNCTION       hash lines with FUNCTION: 'murmur3_32' (the\n"
+        "                             default), or the faster 'murmur3_x64_128' or\n"
+        "                             'xxh64'.  Each puts lines in different FILEs\n"
+        "  -c,  --consistent          choose FILEs by jump consistent hash, so adding\n"
+        "                             or removing the last FILE of N moves only 1/N of\n"
+        "                             the lines (default: split the hash range evenly)\n"
+        "  -k,  --key=FIELDS          hash only the FIELDS of each line, a list like\n"
+        "                             cut(1)'s -f: '1', '2,4', or '3-'; lines go to\n"
+        "                             FILEs whole.  Lines with no delimiter are\n"
+        "                             hashed whole\n"
+        "  -b,  --key-bytes=BYTES     hash only the BYTES of each line, like cut -b\n"
+        "  -d,  --delimiter=DELIM     separate fields with DELIM, not TAB\n"
+        "       --binary              with no FILE(s), write each hash code as a raw\n"
+        "                             little-endian integer (4 bytes with the default\n"
+        "                             hash function, else 8) instead of in decimal\n"
+        "       --with-line           with no FILE(s), follow each hash code (or\n"
+        "                             --remap's file numbers) with a TAB and the line\n"
+        "       --remap=OLD,NEW       with no FILE(s), print which of OLD files and of\n"
+        "                             NEW files each line would go to, tab-separated,\n"
+        "                             to plan moving data when the number changes\n"
+        "       --stats[=FD]          print counts of what was read and where it went,\n"
+        "                             and how long we waited, as JSON, to FD (default\n"
+        "                             stderr) at exit and whenever we get SIGUSR1\n"
 
         "\n",
         stderr);
 }
 
 
-/* Hash a buffer of length `len` to a 32-bit integer.
- * MurmurHash3 is used because it's fast, simple, public domain, and provides a 32-bit variant.
+/** Parse a hash function name.  Returns nonzero if there's no such function. */
+int parse_hash(const char * name, enum hash_kind * kind)
+{
+    if (strcmp(name, "murmur3_32") == 0)
+        *kind = HASH_MURMUR3_32;
+    else if (strcmp(name, "murmur3_x64_128") == 0)
+        *kind = HASH_MURMUR3_X64_128;
+    else if (strcmp(name, "xxh64") == 0)
+        *kind = HASH_XXH64;
+    else
+        return 1;
+    return 0;
+}
+
+
+/** Start hashing a line in pieces. */
+void hash_init(struct line_hash * hash, enum hash_kind kind)
+{
+    hash->kind = kind;
+    switch (kind)
+    {
+    case HASH_MURMUR3_32:
+        MurmurHash3_x86_32_init(&hash->state.murmur3_32, HASH_SEED);
+        break;
+    case HASH_MURMUR3_X64_128:
+        MurmurHash3_x64_128_init(&hash->state.murmur3_x64_128, HASH_SEED);
+        break;
+    case HASH_XXH64:
+        xxh64_init(&hash->state.xxh64, HASH_SEED);
+        break;
+    }
+}
+
+
+/** Hash the next len bytes of a line. */
+void hash_update(struct line_hash * hash, const void * buf, size_t len)
+{
+    switch (hash->kind)
+    {
+    case HASH_MURMUR3_32:
+        MurmurHash3_x86_32_update(&hash->state.murmur3_32, buf, len);
+        break;
+    case HASH_MURMUR3_X64_128:
+        MurmurHash3_x64_128_update(&hash->state.murmur3_x64_128, buf, len);
+        break;
+    case HASH_XXH64:
+        xxh64_update(&hash->state.xxh64, buf, len);
+        break;
+    }
+}
+
+
+/** Get the hashcode of all the pieces of a line, the same as hash() would for the whole line. */
+uint64_t hash_final(const struct line_hash * hash)
+{
+    uint32_t hashcode32;
+    uint64_t hashcode128[2];
+
+    switch (hash->kind)
+    {
+    case HASH_MURMUR3_32:
+        MurmurHash3_x86_32_final(&hash->state.murmur3_32, &hashcode32);
+        return hashcode32;
+    case HASH_MURMUR3_X64_128:
+        MurmurHash3_x64_128_final(&hash->state.murmur3_x64_128, hashcode128);
+        return hashcode128[0];
+    case HASH_XXH64:
+        return xxh64_final(&hash->state.xxh64);
+    }
+    return 0;
+}
+
+
+/* Hash a buffer of length `len` to an integer: 32 bits for HASH_MURMUR3_32,
+ * the default, and 64 for the others (the first half of MurmurHash3_x64_128's
+ * 128).  MurmurHash3 is used because it's fast, simple, public domain, and
+ * provides a 32-bit variant; on 64-bit CPUs, the 64-bit hashes are faster.
  */
-uint32_t hash(const void * buf, size_t len)
+uint64_t hash(const void * buf, size_t len, enum hash_kind kind)
 {
-    uint32_t hashcode;
+    uint32_t hashcode32;
+    uint64_t hashcode128[2];
 
+    if (kind == HASH_XXH64)
+        return xxh64(buf, len, HASH_SEED);
     if (len > (size_t) INT_MAX)
     {
-        fprintf(stderr, "Maximum line length (%d) exceeded: %zu.\n", INT_MAX, len);
+        struct line_hash state;
+        hash_init(&state, kind);
+        hash_update(&state, buf, len);
+        return hash_final(&state);
+    }
+    if (kind == HASH_MURMUR3_X64_128)
+    {
+        MurmurHash3_x64_128(buf, (int) len, HASH_SEED, hashcode128);
+        return hashcode128[0];
+    }
+    MurmurHash3_x86_32(buf, (int) len, HASH_SEED, &hashcode32);
+    return hashcode32;
+}
+
+
+/**
+ * Parse a cut(1)-style list of ranges, like "1,3-4,6-", into spec->ranges,
+ * sorted and with overlapping or adjacent ranges merged.  Returns nonzero if
+ * it's invalid.
+ */
+int parse_key_ranges(const char * list, struct key_spec * spec)
+{
+    const char * pos = list;
+    unsigned int numranges = 1;
+
+    for (const char * c = list ; *c != '\0' ; c++)
+        numranges += (*c == ',');
+    spec->ranges = calloc(numranges, sizeof (struct key_range));
+    if (spec->ranges == NULL)
+        return 1;
+
+    spec->numranges = 0;
+    for (;;)
+    {
+        struct key_range range = { 1, SIZE_MAX };
+        int numbers = 0;
+        char * end;
+        if (*pos >= '0' && *pos <= '9')
+        {
+            range.first = range.last = strtoull(pos, &end, 10);
+            pos = end;
+            numbers++;
+        }
+        if (*pos == '-')
+        {
+            pos++;
+            range.last = SIZE_MAX;
+            if (*pos >= '0' && *pos <= '9')
+            {
+                range.last = strtoull(pos, &end, 10);
+                pos = end;
+                numbers++;
+            }
+        }
+        if (numbers == 0 || range.first == 0 || range.last < range.first)
+            return 1;
+
+        // Insert in order, merging with any ranges it touches.
+        unsigned int r = 0;
+        while (r < spec->numranges && spec->ranges[r].last != SIZE_MAX && spec->ranges[r].last + 1 < range.first)
+            r++;
+        unsigned int merged = r;
+        while (merged < spec->numranges && (range.last == SIZE_MAX || spec->ranges[merged].first <= range.last + 1))
+        {
+            if (spec->ranges[merged].first < range.first)
+                range.first = spec->ranges[merged].first;
+            if (spec->ranges[merged].last > range.last)
+                range.last = spec->ranges[merged].last;
+            merged++;
+        }
+        memmove(spec->ranges + r + 1, spec->ranges + merged, (spec->numranges - merged) * sizeof (struct key_range));
+        spec->numranges += 1 - (merged - r);
+        spec->ranges[r] = range;
+
+        if (*pos == '\0')
+            return 0;
+        if (*pos++ != ',')
+            return 1;
+    }
+}
+
+
+/** Parse --remap's "OLD,NEW" numbers of files, each at least 1.  Returns nonzero if invalid. */
+int parse_remap(const char * arg, unsigned int * old, unsigned int * new)
+{
+    char oldarg[16];
+    const char * comma = strchr(arg, ',');
+
+    if (comma == NULL || (size_t) (comma - arg) >= sizeof oldarg)
+        return 1;
+    memcpy(oldarg, arg, comma - arg);
+    oldarg[comma - arg] = '\0';
+    return parse_count(oldarg, old) != 0 || parse_count(comma + 1, new) != 0;
+}
+
+
+/* Where we are in finding a line's key: the next range, and the number and start of the next field. */
+struct key_cursor {
+    unsigned int range;
+    size_t field;
+    size_t pos;
+};
+
+
+/**
+ * Find the next piece of a line's key, going by spec: set *piece and
+ * *piecelen and return 1, or return 0 if there are no more.  A range of
+ * fields is one piece, including the delimiters inside it.  memchr(3) does
+ * the scanning; it's vectorized, so long fields go by quickly.
+ */
+int next_key_piece(const struct key_spec * spec, const char * line, size_t len, struct key_cursor * cursor,
+                   const char ** piece, size_t * piecelen)
+{
+    if (cursor->range >= spec->numranges)
+        return 0;
+    const struct key_range * range = spec->ranges + cursor->range++;
+
+    if (spec->bytes)
+    {
+        if (range->first > len)
+            return 0;
+        size_t last = range->last < len ? range->last : len;
+        *piece = line + range->first - 1;
+        *piecelen = last - range->first + 1;
+        return 1;
+    }
+
+    // Skip to the first field in the range, then to the end of the last one.
+    const char * lineend = line + len;
+    const char * pos = line + cursor->pos;
+    while (cursor->field < range->first)
+    {
+        const char * delim = memchr(pos, spec->delim, (size_t) (lineend - pos));
+        if (delim == NULL)
+            return 0;
+        pos = delim + 1;
+        cursor->field++;
+    }
+    *piece = pos;
+    while (cursor->field < range->last)
+    {
+        const char * delim = memchr(pos, spec->delim, (size_t) (lineend - pos));
+        if (delim == NULL)
+        {
+            pos = lineend;
+            break;
+        }
+        pos = delim + 1;
+        cursor->field++;
+    }
+    const char * end = memchr(pos, spec->delim, (size_t) (lineend - pos));
+    if (end == NULL)
+        end = lineend;
+    *piecelen = (size_t) (end - *piece);
+    cursor->field++;
+    cursor->pos = end < lineend ? (size_t) (end + 1 - line) : len;
+    if (end == lineend)
+        cursor->range = spec->numranges;        // No more fields
+    return 1;
+}
+
+
+/** Find a line's key, when it's a single range (or the whole line). */
+void find_key(const struct key_spec * spec, const char * line, size_t len, const char ** key, size_t * keylen)
+{
+    struct key_cursor cursor = { 0, 1, 0 };
+
+    *key = line;
+    *keylen = len;
+    if (spec->numranges == 0 || (!spec->bytes && memchr(line, spec->delim, len) == NULL))
+        return;
+    if (!next_key_piece(spec, line, len, &cursor, key, keylen))
+        *keylen = 0;
+}
+
+
+/** Hash a line's key, when it may be several pieces: the same as hashing
+ * them all joined together (by the delimiter, for fields). */
+uint64_t hash_key(const struct key_spec * spec, const char * line, size_t len, enum hash_kind kind)
+{
+    struct key_cursor cursor = { 0, 1, 0 };
+    struct line_hash state;
+    const char * piece;
+    size_t piecelen;
+
+    if (!spec->bytes && memchr(line, spec->delim, len) == NULL)
+        return hash(line, len, kind);
+    hash_init(&state, kind);
+    for (int pieces = 0 ; next_key_piece(spec, line, len, &cursor, &piece, &piecelen) ; pieces++)
+    {
+        if (pieces > 0 && !spec->bytes)
+            hash_update(&state, &spec->delim, 1);
+        hash_update(&state, piece, piecelen);
+    }
+    return hash_final(&state);
+}
+
+
+/** The length of a line from next_lines() to find its key in: unlike the
+ * whole line's hash, the key of an unterminated last line includes its last byte. */
+size_t key_line_len(const struct line_batch * batch, size_t l)
+{
+    return batch->lens[l] + (batch->lines[l][batch->lens[l]] != '\n');
+}
+
+
+/** Hash the keys of the first numlines lines of a batch into batch->hashes.
+ * Gives the same hashcodes as hash() of each key; MurmurHash3_x86_32 does
+ * several at a time.  Single-range keys are hashed in place.
+ */
+void hash_lines(struct line_batch * batch, size_t numlines, const struct fileinfo * fileinfo)
+{
+    const struct key_spec * spec = &fileinfo->key;
+    const enum hash_kind kind = fileinfo->hashkind;
+    const char * const * keys = batch->lines;
+    const size_t * keylens = batch->lens;
+
+    if (spec->numranges > 1)
+    {
+        for (size_t l = 0 ; l < numlines ; l++)
+            batch->hashes[l] = hash_key(spec, batch->lines[l], key_line_len(batch, l), kind);
+        return;
+    }
+    if (spec->numranges == 1)
+    {
+        for (size_t l = 0 ; l < numlines ; l++)
+            find_key(spec, batch->lines[l], key_line_len(batch, l), batch->keys + l, batch->keylens + l);
+        keys = batch->keys;
+        keylens = batch->keylens;
+    }
+    if (kind != HASH_MURMUR3_32)
+    {
+        for (size_t l = 0 ; l < numlines ; l++)
+            batch->hashes[l] = hash(keys[l], keylens[l], kind);
+        return;
+    }
+    MurmurHash3_x86_32_batch((const void * const *) keys, keylens, numlines, HASH_SEED, batch->hashes32);
+    for (size_t l = 0 ; l < numlines ; l++)
+        batch->hashes[l] = batch->hashes32[l];
+}
+
+
+/** Convert an integer hashcode from hash() to a file number in the range [0, numfiles).
+ * This scales the hashcode's top 32 bits by numfiles with an integer multiply
+ * and shift, which gives the same file as the floating-point
+ * floor(hashcode / 2^32 * numfiles) did, for any practical numfiles (under 2^21).
+ */
+unsigned int hash2filenum(uint64_t hashcode, enum hash_kind kind, unsigned int numfiles)
+{
+    uint32_t top = kind == HASH_MURMUR3_32 ? (uint32_t) hashcode : (uint32_t) (hashcode >> 32);
+    return (unsigned int) (((uint64_t) top * numfiles) >> 32);
+}
+
+
+/**
+ * Convert an integer hashcode to a file number in the range [0, numfiles)
+ * with Lamping and Veach's jump consistent hash.  Going from n to n + 1 files
+ * moves only the 1/(n + 1) of hashcodes that now go to file n; the rest stay
+ * put.  Takes O(log numfiles) steps.
+ */
+unsigned int jump_hash(uint64_t hashcode, unsigned int numfiles)
+{
+    int64_t b = -1;
+    int64_t j = 0;
+
+    while (j < (int64_t) numfiles)
+    {
+        b = j;
+        hashcode = hashcode * 2862933555777941757ULL + 1;
+        j = (int64_t) ((b + 1) * ((double) (1LL << 31) / (double) ((hashcode >> 33) + 1)));
+    }
+    return (unsigned int) b;
+}
+
+
+/** Which of numfiles files a line with the given hashcode goes to. */
+unsigned int choose_file(const struct fileinfo * fileinfo, uint64_t hashcode, unsigned int numfiles)
+{
+    if (fileinfo->consistent)
+        return jump_hash(hashcode, numfiles);
+    return hash2filenum(hashcode, fileinfo->hashkind, numfiles);
+}
+
+
+/** Write value in decimal to out, unterminated, and return its length (at most 20).
+ * This does two digits per division, from a table, which is several times
+ * faster than printf(3).
+ */
+size_t format_decimal(char * out, uint64_t value)
+{
+    static const char pairs[] =
+        "00010203040506070809101112131415161718192021222324"
+        "25262728293031323334353637383940414243444546474849"
+        "50515253545556575859606162636465666768697071727374"
+        "75767778798081828384858687888990919293949596979899";
+    char digits[20];
+    char * start = digits + sizeof digits;
+
+    while (value >= 100)
+    {
+        const char * pair = pairs + 2 * (value % 100);
+        value /= 100;
+        *--start = pair[1];
+        *--start = pair[0];
+    }
+    if (value >= 10)
+    {
+        *--start = pairs[2 * value + 1];
+        *--start = pairs[2 * value];
+    }
+    else
+    {
+        *--start = (char) ('0' + value);
+    }
+    size_t len = (size_t) (digits + sizeof digits - start);
+    memcpy(out, start, len);
+    return len;
+}
+
+
+/** The most bytes format_hashcode() writes for a line, with this fileinfo. */
+size_t hashcode_width(const struct fileinfo * fileinfo)
+{
+    if (fileinfo->remap_old > 0)
+        return 2 * 10 + 2;                  // Two file numbers, a tab, and a newline or tab
+    if (fileinfo->binary)
+        return fileinfo->hashkind == HASH_MURMUR3_32 ? 4 : 8;
+    return fileinfo->hashkind == HASH_MURMUR3_32 ? 11 : 21;
+}
+
+
+/** With no output files, format what to print for a line with the given
+ * hashcode into out: the hashcode itself, or its files with --remap, followed
+ * by a newline (or a tab, if the line comes next).  Returns the length, at most
+ * hashcode_width().
+ */
+size_t format_hashcode(char * out, const struct fileinfo * fileinfo, uint64_t hashcode)
+{
+    const char separator = fileinfo->with_line ? '\t' : '\n';
+    size_t len = 0;
+
+    if (fileinfo->remap_old > 0)
+    {
+        len = format_decimal(out, choose_file(fileinfo, hashcode, fileinfo->remap_old));
+        out[len++] = '\t';
+        len += format_decimal(out + len, choose_file(fileinfo, hashcode, fileinfo->remap_new));
+    }
+    else if (fileinfo->binary)
+    {
+        size_t bytes = hashcode_width(fileinfo);
+        for (size_t b = 0 ; b < bytes ; b++)
+            out[b] = (char) (hashcode >> (8 * b));
+        return bytes;
+    }
+    else
+    {
+        len = format_decimal(out, hashcode);
+    }
+    out[len++] = separator;
+    return len;
+}
+
+
+/** Buffer len bytes of data for file number filenum, exiting on error. */
+void write_to_file(const struct fileinfo * fileinfo, unsigned int filenum, const char * data, size_t len)
+{
+    if (buckets_write(fileinfo->buckets, filenum, data, len) != 0)
+    {
+        if (fileinfo->numfiles == 0)
+            fprintf(stderr, "hsplit: Error writing hashcodes");
+        else
+            fprintf(stderr, "hsplit: Error writing to file %u", fileinfo->buckets->failed);
+        perror("");
         exit(1);
     }
-    MurmurHash3_x86_32(buf, (int) len, HASH_SEED, &hashcode);
+}
+
+
+/** Count a line of len bytes (newline and all) going to file number filenum, for --stats. */
+void count_line(struct stats * stats, unsigned int filenum, size_t len)
+{
+    stats->lines[filenum]++;
+    stats->bytes[filenum] += len;
+}
+
+
+/**
+ * Print stats as one line of JSON, with the given counts for the inputs;
+ * final says whether we're done.  Must be called by whichever thread writes
+ * to the buckets.
+ */
+void print_stats(const struct fileinfo * fileinfo, const process_lines_stats * inputs, int final)
+{
+    const struct stats * stats = fileinfo->stats;
+    const bucket_set * buckets = fileinfo->buckets;
+    FILE * out = stats->file;
+    unsigned long long read_ns = 0, totallines = 0, totalbytes = 0;
+    size_t bufsize = 0;
+    unsigned int busiest = 0, idle = 0;
+
+    for (unsigned int i = 0 ; i < stats->numinputs ; i++)
+    {
+        read_ns += inputs[i].read_ns;
+        bufsize = inputs[i].bufsize > bufsize ? inputs[i].bufsize : bufsize;
+    }
+    fprintf(out, "{\"program\": \"hsplit\", \"final\": %s, \"seconds\": %.6f, \"wakeups\": %llu, \"writes\": %llu, "
+            "\"read_wait_seconds\": %.6f, \"write_wait_seconds\": %.6f, \"peak_buffer_bytes\": %zu, \"inputs\": [",
+            final ? "true" : "false", (clock_ns() - stats->started) / 1e9, buckets->wakeups, buckets->writes,
+            read_ns / 1e9, buckets->write_ns / 1e9, buckets->peak + bufsize);
+    for (unsigned int i = 0 ; i < stats->numinputs ; i++)
+    {
+        fputs(i > 0 ? ", {" : "{", out);
+        print_stats_json(out, stats->names[i], inputs + i, 1);
+        putc('}', out);
+    }
 
-    return hashcode;
+    // With no files, everything goes to "file" 0: standard output.
+    fputs("], \"buckets\": [", out);
+    for (unsigned int b = 0 ; b < buckets->numbuckets ; b++)
+    {
+        fprintf(out, "%s{\"lines\": %llu, \"bytes\": %llu}", b > 0 ? ", " : "", stats->lines[b], stats->bytes[b]);
+        totallines += stats->lines[b];
+        totalbytes += stats->bytes[b];
+        busiest = stats->bytes[b] > stats->bytes[busiest] ? b : busiest;
+        idle += stats->lines[b] == 0;
+    }
+
+    // How much more the busiest file got than its share: 1 is perfectly even.
+    double meanbytes = (double) totalbytes / buckets->numbuckets;
+    double meanlines = (double) totallines / buckets->numbuckets;
+    unsigned long long maxlines = 0;
+    for (unsigned int b = 0 ; b < buckets->numbuckets ; b++)
+        maxlines = stats->lines[b] > maxlines ? stats->lines[b] : maxlines;
+    fprintf(out, "], \"skew\": {\"busiest\": %u, \"max_over_mean_bytes\": %.4f, \"max_over_mean_lines\": %.4f, \"idle\": %u}}\n",
+            busiest, totalbytes > 0 ? stats->bytes[busiest] / meanbytes : 1.0,
+            totallines > 0 ? maxlines / meanlines : 1.0, idle);
+    fflush(out);
 }
 
 
-/** Convert a 32-bit integer hashcode to a file number in the range [0, numfiles). */
-unsigned int hash2filenum(uint32_t hashcode, unsigned int numfiles)
+/**
+ * Find up to LINE_BATCH lines in [*pos, bufend), put them in batch, and
+ * advance *pos past them.  Returns how many lines were found, 0 at bufend.
+ *
+ * If the last line doesn't end with a newline, its last byte stands in for
+ * one: we don't hash it, but we do write it.
+ */
+size_t next_lines(struct line_batch * batch, const char ** pos, const char * bufend)
 {
-    return (unsigned int) (((double) hashcode) / (UINT32_MAX + 1.0) * numfiles);
+    const char * start = *pos;
+    size_t window = (size_t) (bufend - start);
+    size_t lineoff = 0;
+
+    if (window > UINT32_MAX)
+        window = UINT32_MAX;        // index_lines() offsets are 32 bits
+    size_t numlines = index_lines(start, window, batch->ends, LINE_BATCH);
+    for (size_t l = 0 ; l < numlines ; l++)
+    {
+        batch->lines[l] = start + lineoff;
+        batch->lens[l] = batch->ends[l] - lineoff;
+        lineoff = batch->ends[l] + 1;
+    }
+    if (numlines < LINE_BATCH && lineoff < window && (numlines == 0 || start + window == bufend))
+    {
+        // The last line, without a newline, or one too long to index
+        const char * line = start + lineoff;
+        const char * newline = memchr(line, '\n', (size_t) (bufend - line));
+        if (newline == NULL)
+            newline = bufend - 1;
+        batch->lines[numlines] = line;
+        batch->lens[numlines++] = (size_t) (newline - line);
+        lineoff = (size_t) (newline + 1 - start);
+    }
+    *pos = start + lineoff;
+    return numlines;
 }
 
 
 /** Given a buffer of one or more lines, hash each line and write it to the appropriate file.
  * info is actually a struct fileinfo.  If info.numfiles == 0, write the hashcode to
- * stdout instead.  buflen is guaranteed to be at least 1, and buf will end with
+ * stdout instead (which is "file" 0), a batch at a time.  buflen is guaranteed to be at least 1, and buf will end with
  * a newline or the last byte of the file.
  */
 void split_lines_to_files(char * buf, size_t buflen, void * info)
 {
-    const char * line = buf;                // Start of current line
-    const char * newline;                   // End of current line
+    const char * line = buf;                // Start of next batch of lines
     const char * bufend = buf + buflen;     // (One past) end of buffer
     struct fileinfo fileinfo = *(struct fileinfo *) info;
+    struct line_batch batch;
+    size_t numlines;
+    char text[LINE_BATCH * 24];             // Hashcodes to print, at most 22 bytes each
 
     assert(buflen > 0);
-    while (line < bufend)
+    while ((numlines = next_lines(&batch, &line, bufend)) > 0)
     {
-        // Find end of line (or buffer), hash from line (start) to newline (end), excluding the \n
-        newline = memchr(line, '\n', (size_t) (bufend - line));
-        if (newline == NULL)
-            newline = bufend - 1;       // Usually we include the newline, but if there isn't one, we don't want to overstep
-        uint32_t hashcode = hash(line, newline - line);
+        size_t textlen = 0;
 
-        if (fileinfo.numfiles > 0)
+        hash_lines(&batch, numlines, &fileinfo);
+        for (size_t l = 0 ; l < numlines ; l++)
         {
-            unsigned int filenum = hash2filenum(hashcode, fileinfo.numfiles);
-            // fwrite(3) is faster than write(2) here because we're only writing a line at a time, so fwrite's buffering helps.
-            if (fwrite(line, 1, newline - line + 1, fileinfo.files[filenum]) < (size_t) (newline - line + 1))
+            uint64_t hashcode = batch.hashes[l];
+
+            if (fileinfo.numfiles > 0)
             {
-                fprintf(stderr, "hsplit: Error writing to file %d", filenum);
-                perror("");
-                exit(1);
+                unsigned int filenum = choose_file(&fileinfo, hashcode, fileinfo.numfiles);
+                write_to_file(&fileinfo, filenum, batch.lines[l], batch.lens[l] + 1);
+                if (fileinfo.stats != NULL)
+                    count_line(fileinfo.stats, filenum, batch.lens[l] + 1);
+            }
+            else
+            {
+                if (fileinfo.stats != NULL)
+                    count_line(fileinfo.stats, 0, batch.lens[l] + 1);
+                textlen += format_hashcode(text + textlen, &fileinfo, hashcode);
+                if (fileinfo.with_line)
+                {
+                    write_to_file(&fileinfo, 0, text, textlen);
+                    write_to_file(&fileinfo, 0, batch.lines[l], batch.lens[l] + 1);
+                    textlen = 0;
+                }
             }
         }
-        else
+        if (textlen > 0)
+            write_to_file(&fileinfo, 0, text, textlen);
+        if (stats_requested && fileinfo.stats != NULL)
+        {
+            stats_requested = 0;
+            print_stats(&fileinfo, fileinfo.stats->inputs, 0);
+        }
+    }
+}
+
+
+/** Write all of buf to fd, exiting on error. */
+void write_fully(int fd, const char * buf, size_t len, const char * what)
+{
+    while (len > 0)
+    {
+        ssize_t written = write(fd, buf, len);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written < 0)
         {
-            printf("%u\n", hashcode);
+            fprintf(stderr, "hsplit: Error writing %s", what);
+            perror("");
+            exit(1);
         }
-        line = newline + 1;
+        buf += written;
+        len -= written;
     }
 }
 
 
 /**
- * Hash lines from stdin to files given on command line.
+ * process_lines() partial-line callback: hash a piece of a long line, and
+ * spool it to a temporary file.  At the end of the line, write it (or its
+ * hashcode) out.  info is a struct fileinfo.
+ *
+ * As with shorter lines, we don't hash a line's last byte, which is its
+ * newline or, at the end of the input, the last byte of an unterminated line.
+ * So we hold back the last byte of each piece until we see the next one.
  */
-int main(int argc, char * argv[])
+void stream_long_line(char * buf, size_t buflen, int end, void * info)
 {
-    int append = 0;
-    int first_filename_arg = 1;
-    process_lines_context ctx;
-    struct fileinfo fileinfo;
+    struct fileinfo * fileinfo = info;
+    struct long_line * line = &fileinfo->longline;
 
-    if (argc >= 2 && (strcmp(argv[1], "--help") == 0 || strcmp(argv[1], "-h") == 0))
+    if (!line->started)
+    {
+        line->started = 1;
+        hash_init(&line->hash, fileinfo->hashkind);
+        line->spool = NULL;
+        line->len = 0;
+        if ((fileinfo->numfiles > 0 || fileinfo->with_line) && (line->spool = tmpfile()) == NULL)
+        {
+            perror("hsplit: Error creating temporary file");
+            exit(1);
+        }
+    }
+    else if (buflen > 0)
     {
-        printusage();
-        exit(0);
+        hash_update(&line->hash, &line->last, 1);
     }
-
-    if (argc > 1 && ((strcmp(argv[1], "-a") == 0) || (strcmp(argv[1], "--append") == 0)))
+    if (buflen > 0)
     {
-        append = 1;
-        first_filename_arg = 2;
+        hash_update(&line->hash, buf, buflen - 1);
+        line->last = buf[buflen - 1];
+        line->len += buflen;
+        if (line->spool != NULL)
+            write_fully(fileno(line->spool), buf, buflen, "temporary file");
     }
+    if (!end)
+        return;
 
-    fileinfo.numfiles = argc - first_filename_arg;
-    if (fileinfo.numfiles == 0 && append)
+    uint64_t hashcode = hash_final(&line->hash);
+    unsigned int filenum = 0;
+    line->started = 0;
+    if (fileinfo->numfiles > 0)
     {
-        fprintf(stderr, "Can only use --append with files.");
-        exit(1);
+        filenum = choose_file(fileinfo, hashcode, fileinfo->numfiles);
+    }
+    else
+    {
+        char text[32];
+        write_to_file(fileinfo, 0, text, format_hashcode(text, fileinfo, hashcode));
     }
+    if (fileinfo->stats != NULL)
+        count_line(fileinfo->stats, filenum, line->len);
+    if (line->spool == NULL)
+        return;
 
-    fileinfo.files = calloc(fileinfo.numfiles, sizeof (FILE *));
-    if (fileinfo.numfiles > 0 && fileinfo.files == NULL)
+    // Copy the line from the spool to its file.
+    int spoolfd = fileno(line->spool);
+    char * copybuf = malloc(LONG_LINE_BYTES);
+    ssize_t bytesread;
+    if (copybuf == NULL || lseek(spoolfd, 0, SEEK_SET) != 0)
     {
-        perror("hsplit: Error allocating memory");
+        perror("hsplit: Error rereading temporary file");
         exit(1);
     }
-
-    /* Open files. */
-    for (unsigned int f = 0 ; f < fileinfo.numfiles ; f++)
+    while ((bytesread = read(spoolfd, copybuf, LONG_LINE_BYTES)) != 0)
     {
-        const char * filename = argv[first_filename_arg + f];
-        fileinfo.files[f] = fopen(filename, append ? "a" : "w");
-        if (fileinfo.files[f] == NULL)
+        if (bytesread < 0 && errno == EINTR)
+            continue;
+        if (bytesread < 0)
         {
-            fprintf(stderr, "hsplit: error opening \"%s\"", filename);
-            perror("");
+            perror("hsplit: Error rereading temporary file");
             exit(1);
         }
+        write_to_file(fileinfo, filenum, copybuf, (size_t) bytesread);
     }
+    free(copybuf);
+    fclose(line->spool);
+}
 
-    if (process_lines_init(&ctx, fileno(stdin), split_lines_to_files, &fileinfo) != 0)
-    {
-        perror("hsplit");
-        exit(1);
-    }
 
-    /* Loop: read a line, hash to get file number, write. */
-    // TODO: If our hash function had an incremental interface, we could probably do this faster, without buffering.
-    int result;
-    do {
-        result = process_lines(&ctx);
-    } while (result == 0);
-    if (result > 0)
+/*
+ * Multi-threaded splitting.
+ *
+ * The main thread reads input and cuts it into chunks of whole lines (or, for
+ * mapped files, just points chunks at successive ranges of the mapping).  Worker
+ * threads take chunks in turn, hash each line, and rearrange the chunk's lines
+ * into one contiguous run per output file (keeping their order within each
+ * run).  A writer thread commits the chunks in input order, writing each run
+ * to its file, so every file gets its lines in the same order as without
+ * threads.  Chunks live in a circular array of slots, which bounds memory.
+ */
+
+enum chunk_state { CHUNK_EMPTY, CHUNK_FILLED, CHUNK_PARTITIONED };
+
+struct chunk {
+    enum chunk_state state;
+    const char * text;          // Whole lines of input: data, or part of a mapped file
+    size_t len;
+    char * data;                // Lines copied from a stream
+    size_t size;
+    char * out;                 // The same lines, grouped by file (or hashcodes, with no files)
+    size_t outsize;
+    size_t * runs;              // Run for file f is out[runs[f], runs[f+1])
+    unsigned int * filenums;    // File number of each line
+    size_t filenums_size;
+    unsigned long long * lines; // How many lines go to each file, for --stats (else NULL)
+};
+
+struct pipeline {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;     // Signaled whenever any chunk changes state
+    struct chunk * chunks;
+    unsigned int numchunks;
+    unsigned long long filling;     // Sequence number of the chunk being filled...
+    unsigned long long working;     // ...the next one for a worker to take...
+    unsigned long long committing;  // ...and the next one to write out.
+    int done;                       // No more input
+    struct fileinfo * fileinfo;
+    unsigned int numthreads;
+    pthread_t * workers;
+    pthread_t writer;
+};
+
+
+/** Make sure *buf has room for at least `needed` bytes, growing it (and *size) if not. */
+void * reserve(void * buf, size_t * size, size_t needed)
+{
+    if (*size >= needed)
+        return buf;
+    size_t newsize = *size > 0 ? *size : 1;
+    while (newsize < needed)
+        newsize *= 2;
+    buf = realloc(buf, newsize);
+    if (buf == NULL)
     {
-        perror("hsplit");
+        perror("hsplit: Error allocating memory");
         exit(1);
     }
+    *size = newsize;
+    return buf;
+}
 
-    /* Close files and clean up. */
-    process_lines_cleanup(&ctx);
+
+/** Hash each line of a chunk, and group the lines by output file (or format their hashcodes). */
+void partition_chunk(struct chunk * chunk, const struct fileinfo * fileinfo)
+{
+    const char * line = chunk->text;
+    const char * bufend = chunk->text + chunk->len;
+    const unsigned int numfiles = fileinfo->numfiles;
+    struct line_batch batch;
+    size_t batchlines;
+    size_t numlines = 0;
+
+    if (numfiles == 0)
+    {
+        // Each line takes at least 1 byte.
+        chunk->out = reserve(chunk->out, &chunk->outsize, chunk->len * (hashcode_width(fileinfo) + fileinfo->with_line));
+        char * out = chunk->out;
+        while ((batchlines = next_lines(&batch, &line, bufend)) > 0)
+        {
+            hash_lines(&batch, batchlines, fileinfo);
+            numlines += batchlines;
+            for (size_t l = 0 ; l < batchlines ; l++)
+            {
+                out += format_hashcode(out, fileinfo, batch.hashes[l]);
+                if (fileinfo->with_line)
+                {
+                    memcpy(out, batch.lines[l], batch.lens[l] + 1);
+                    out += batch.lens[l] + 1;
+                }
+            }
+        }
+        chunk->runs[0] = 0;
+        chunk->runs[1] = out - chunk->out;
+        if (chunk->lines != NULL)
+            chunk->lines[0] = numlines;
+        return;
+    }
+
+    // First pass: find each line's file, and how many bytes go to each file.
+    memset(chunk->runs, 0, (numfiles + 1) * sizeof (size_t));
+    if (chunk->lines != NULL)
+        memset(chunk->lines, 0, numfiles * sizeof (unsigned long long));
+    while ((batchlines = next_lines(&batch, &line, bufend)) > 0)
+    {
+        chunk->filenums = reserve(chunk->filenums, &chunk->filenums_size, (numlines + batchlines) * sizeof (unsigned int));
+        hash_lines(&batch, batchlines, fileinfo);
+        for (size_t l = 0 ; l < batchlines ; l++)
+        {
+            unsigned int filenum = choose_file(fileinfo, batch.hashes[l], numfiles);
+            chunk->filenums[numlines++] = filenum;
+            chunk->runs[filenum + 1] += batch.lens[l] + 1;
+            if (chunk->lines != NULL)
+                chunk->lines[filenum]++;
+        }
+    }
+
+    // Turn run lengths into offsets, then copy each line to the end of its run.
+    for (unsigned int f = 0 ; f < numfiles ; f++)
+        chunk->runs[f + 1] += chunk->runs[f];
+    chunk->out = reserve(chunk->out, &chunk->outsize, chunk->len);
+    line = chunk->text;
+    numlines = 0;
+    while ((batchlines = next_lines(&batch, &line, bufend)) > 0)
+    {
+        for (size_t l = 0 ; l < batchlines ; l++)
+        {
+            size_t * runend = chunk->runs + chunk->filenums[numlines++];
+            memcpy(chunk->out + *runend, batch.lines[l], batch.lens[l] + 1);
+            *runend += batch.lens[l] + 1;
+        }
+    }
+    // The copying moved each run's start to the next one's; shift them back.
+    memmove(chunk->runs + 1, chunk->runs, numfiles * sizeof (size_t));
+    chunk->runs[0] = 0;
+}
+
+
+/** Write a partitioned chunk's runs to their files. */
+void commit_chunk(const struct chunk * chunk, const struct fileinfo * fileinfo)
+{
+    if (fileinfo->numfiles == 0)
+    {
+        write_to_file(fileinfo, 0, chunk->out, chunk->runs[1]);
+        if (fileinfo->stats != NULL)
+        {
+            fileinfo->stats->lines[0] += chunk->lines[0];
+            fileinfo->stats->bytes[0] += chunk->len;
+        }
+        return;
+    }
+
+    for (unsigned int f = 0 ; f < fileinfo->numfiles ; f++)
+    {
+        size_t runlen = chunk->runs[f + 1] - chunk->runs[f];
+        if (runlen > 0)
+            write_to_file(fileinfo, f, chunk->out + chunk->runs[f], runlen);
+        if (fileinfo->stats != NULL)
+        {
+            fileinfo->stats->lines[f] += chunk->lines[f];
+            fileinfo->stats->bytes[f] += runlen;
+        }
+    }
+}
+
+
+/** Worker thread: partition chunks until there are no more. */
+void * partition_chunks(void * arg)
+{
+    struct pipeline * pipeline = arg;
+
+    pthread_mutex_lock(&pipeline->lock);
+    for (;;)
+    {
+        while (pipeline->working == pipeline->filling && !pipeline->done)
+            pthread_cond_wait(&pipeline->changed, &pipeline->lock);
+        if (pipeline->working == pipeline->filling)         // Done, and nothing left
+            break;
+        struct chunk * chunk = pipeline->chunks + pipeline->working++ % pipeline->numchunks;
+        pthread_mutex_unlock(&pipeline->lock);
+
+        partition_chunk(chunk, pipeline->fileinfo);
+
+        pthread_mutex_lock(&pipeline->lock);
+        chunk->state = CHUNK_PARTITIONED;
+        pthread_cond_broadcast(&pipeline->changed);
+    }
+    pthread_mutex_unlock(&pipeline->lock);
+    return NULL;
+}
+
+
+/** Copy the main thread's counts for the inputs for the writer thread to print.  Call with the pipeline locked. */
+void snapshot_stats(struct pipeline * pipeline)
+{
+    struct stats * stats = pipeline->fileinfo->stats;
+    if (stats != NULL)
+        memcpy(stats->snapshot, stats->inputs, stats->numinputs * sizeof (process_lines_stats));
+}
+
+
+/** Writer thread: print stats if we've been asked to.  Call with the pipeline locked. */
+void print_requested_stats(struct pipeline * pipeline)
+{
+    if (stats_requested && pipeline->fileinfo->stats != NULL)
+    {
+        stats_requested = 0;
+        print_stats(pipeline->fileinfo, pipeline->fileinfo->stats->snapshot, 0);
+    }
+}
+
+
+/** Writer thread: commit chunks in order until there are no more. */
+void * commit_chunks(void * arg)
+{
+    struct pipeline * pipeline = arg;
+
+    pthread_mutex_lock(&pipeline->lock);
+    for (;;)
+    {
+        struct chunk * chunk = pipeline->chunks + pipeline->committing % pipeline->numchunks;
+        while (pipeline->committing < pipeline->filling ? chunk->state != CHUNK_PARTITIONED : !pipeline->done)
+        {
+            pthread_cond_wait(&pipeline->changed, &pipeline->lock);
+            print_requested_stats(pipeline);
+        }
+        if (pipeline->committing == pipeline->filling)     // Done, and nothing left
+            break;
+        pthread_mutex_unlock(&pipeline->lock);
+
+        commit_chunk(chunk, pipeline->fileinfo);
+
+        pthread_mutex_lock(&pipeline->lock);
+        chunk->state = CHUNK_EMPTY;
+        pipeline->committing++;
+        pthread_cond_broadcast(&pipeline->changed);
+        print_requested_stats(pipeline);
+    }
+    pthread_mutex_unlock(&pipeline->lock);
+    return NULL;
+}
+
+
+/** Hand the chunk being filled to the workers, and wait for the next one to be free. */
+void publish_chunk(struct pipeline * pipeline)
+{
+    pthread_mutex_lock(&pipeline->lock);
+    snapshot_stats(pipeline);
+    pipeline->chunks[pipeline->filling++ % pipeline->numchunks].state = CHUNK_FILLED;
+    pthread_cond_broadcast(&pipeline->changed);
+    struct chunk * next = pipeline->chunks + pipeline->filling % pipeline->numchunks;
+    while (next->state != CHUNK_EMPTY)
+        pthread_cond_wait(&pipeline->changed, &pipeline->lock);
+    pthread_mutex_unlock(&pipeline->lock);
+    next->len = 0;
+}
+
+
+/** process_lines() callback: copy lines into the chunk being filled; info is a struct pipeline. */
+void queue_lines(char * buf, size_t buflen, void * info)
+{
+    struct pipeline * pipeline = info;
+    struct chunk * chunk = pipeline->chunks + pipeline->filling % pipeline->numchunks;
+
+    chunk->data = reserve(chunk->data, &chunk->size, chunk->len + buflen);
+    memcpy(chunk->data + chunk->len, buf, buflen);
+    chunk->text = chunk->data;
+    chunk->len += buflen;
+    if (chunk->len >= CHUNK_BYTES)
+        publish_chunk(pipeline);
+}
+
+
+/** Send off the chunk being filled, if there's anything in it. */
+void publish_partial_chunk(struct pipeline * pipeline)
+{
+    if (pipeline->chunks[pipeline->filling % pipeline->numchunks].len > 0)
+        publish_chunk(pipeline);
+}
+
+
+/** Publish a mapped file's lines, a chunk at a time, straight from the mapping. */
+void queue_mapping(struct pipeline * pipeline, const char * text, size_t len)
+{
+    const char * textend = text + len;
+
+    while (text < textend)
+    {
+        struct chunk * chunk = pipeline->chunks + pipeline->filling % pipeline->numchunks;
+        const char * chunkend = textend;
+
+        // End the chunk at the first newline past CHUNK_BYTES, or the end of the file.
+        if ((size_t) (textend - text) > CHUNK_BYTES)
+        {
+            chunkend = memchr(text + CHUNK_BYTES, '\n', (size_t) (textend - text) - CHUNK_BYTES);
+            chunkend = chunkend == NULL ? textend : chunkend + 1;
+        }
+        chunk->text = text;
+        chunk->len = (size_t) (chunkend - text);
+        publish_chunk(pipeline);
+        text = chunkend;
+    }
+}
+
+
+/** Wait until every published chunk has been written out. */
+void drain_pipeline(struct pipeline * pipeline)
+{
+    pthread_mutex_lock(&pipeline->lock);
+    while (pipeline->committing < pipeline->filling)
+        pthread_cond_wait(&pipeline->changed, &pipeline->lock);
+    pthread_mutex_unlock(&pipeline->lock);
+}
+
+
+/** process_lines() partial-line callback for threads: like stream_long_line(),
+ * but first let every line before this one get written out.  info is a struct pipeline. */
+void queue_long_line(char * buf, size_t buflen, int end, void * info)
+{
+    struct pipeline * pipeline = info;
+
+    if (end)
+    {
+        publish_partial_chunk(pipeline);
+        drain_pipeline(pipeline);       // The writer thread is idle after this, so we can write.
+    }
+    stream_long_line(buf, buflen, end, pipeline->fileinfo);
+}
+
+
+/** Set up the pipeline and start numthreads worker threads, plus the writer. */
+void start_pipeline(struct pipeline * pipeline, unsigned int numthreads)
+{
+    pipeline->numthreads = numthreads;
+    pipeline->numchunks = 2 * numthreads + 1;         // Enough for every worker, plus some slack on each end
+    pipeline->chunks = calloc(pipeline->numchunks, sizeof (struct chunk));
+    pipeline->workers = calloc(numthreads, sizeof (pthread_t));
+    if (pipeline->chunks == NULL || pipeline->workers == NULL)
+    {
+        perror("hsplit: Error allocating memory");
+        exit(1);
+    }
+    for (unsigned int c = 0 ; c < pipeline->numchunks ; c++)
+    {
+        pipeline->chunks[c].runs = calloc(pipeline->fileinfo->numfiles + 2, sizeof (size_t));
+        if (pipeline->fileinfo->stats != NULL)
+            pipeline->chunks[c].lines = calloc(pipeline->fileinfo->numfiles + 1, sizeof (unsigned long long));
+        if (pipeline->chunks[c].runs == NULL || (pipeline->fileinfo->stats != NULL && pipeline->chunks[c].lines == NULL))
+        {
+            perror("hsplit: Error allocating memory");
+            exit(1);
+        }
+    }
+    pthread_mutex_init(&pipeline->lock, NULL);
+    pthread_cond_init(&pipeline->changed, NULL);
+    pipeline->filling = pipeline->working = pipeline->committing = 0;
+    pipeline->done = 0;
+
+    for (unsigned int t = 0 ; t < numthreads ; t++)
+    {
+        if (pthread_create(pipeline->workers + t, NULL, partition_chunks, pipeline) != 0)
+        {
+            perror("hsplit: Error starting thread");
+            exit(1);
+        }
+    }
+    if (pthread_create(&pipeline->writer, NULL, commit_chunks, pipeline) != 0)
+    {
+        perror("hsplit: Error starting thread");
+        exit(1);
+    }
+}
+
+
+/** Send off the last (partial) chunk, wait for everything to be written, and tear down the pipeline. */
+void finish_pipeline(struct pipeline * pipeline)
+{
+    publish_partial_chunk(pipeline);
+    pthread_mutex_lock(&pipeline->lock);
+    pipeline->done = 1;
+    pthread_cond_broadcast(&pipeline->changed);
+    pthread_mutex_unlock(&pipeline->lock);
+    for (unsigned int t = 0 ; t < pipeline->numthreads ; t++)
+        pthread_join(pipeline->workers[t], NULL);
+    pthread_join(pipeline->writer, NULL);
+
+    for (unsigned int c = 0 ; c < pipeline->numchunks ; c++)
+    {
+        free(pipeline->chunks[c].data);
+        free(pipeline->chunks[c].out);
+        free(pipeline->chunks[c].runs);
+        free(pipeline->chunks[c].filenums);
+        free(pipeline->chunks[c].lines);
+    }
+    free(pipeline->chunks);
+    free(pipeline->workers);
+    pthread_cond_destroy(&pipeline->changed);
+    pthread_mutex_destroy(&pipeline->lock);
+}
+
+
+/** Print stats now that we've been asked to: ourselves, or with a pipeline, by waking up the writer thread. */
+void print_stats_now(struct fileinfo * fileinfo, struct pipeline * pipeline)
+{
+    if (pipeline == NULL)
+    {
+        stats_requested = 0;
+        print_stats(fileinfo, fileinfo->stats->inputs, 0);
+        return;
+    }
+    pthread_mutex_lock(&pipeline->lock);
+    snapshot_stats(pipeline);
+    pthread_cond_broadcast(&pipeline->changed);
+    pthread_mutex_unlock(&pipeline->lock);
+}
+
+
+/**
+ * Map the rest of the input fd (from its current offset) into memory, if it's
+ * a regular file.  Returns the mapped text and sets *len, or returns NULL if
+ * it isn't a nonempty regular file or can't be mapped; then it should be read
+ * instead.  Unmap with unmap_input().
+ */
+const char * map_input(int fd, size_t * len)
+{
+    struct stat st;
+    const long pagesize = sysconf(_SC_PAGESIZE);
+
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+        return NULL;
+    off_t offset = lseek(fd, 0, SEEK_CUR);
+    if (offset < 0 || offset >= st.st_size)
+        return NULL;
+    off_t mapstart = offset - offset % pagesize;
+    if ((uintmax_t) (st.st_size - mapstart) > SIZE_MAX)
+        return NULL;                                // Too big for our address space
+    char * map = mmap(NULL, (size_t) (st.st_size - mapstart), PROT_READ, MAP_SHARED, fd, mapstart);
+    if (map == MAP_FAILED)
+        return NULL;
+    madvise(map, (size_t) (st.st_size - mapstart), MADV_SEQUENTIAL);
+    *len = (size_t) (st.st_size - offset);
+    return map + (offset - mapstart);
+}
+
+
+/** Unmap text of length len from map_input(). */
+void unmap_input(const char * text, size_t len)
+{
+    const long pagesize = sysconf(_SC_PAGESIZE);
+    size_t skip = (uintptr_t) text % pagesize;
+    munmap((void *) (text - skip), len + skip);
+}
+
+
+/**
+ * Split the lines of input fd.  A regular file is mapped, and split straight
+ * from the mapping; anything else is read with a reader of the given kind.
+ * With a pipeline, the lines go to its worker threads; otherwise, we split
+ * them ourselves.  With --stats, count what we read in *stats.
+ */
+void split_input(int fd, enum ptp_reader reader, struct fileinfo * fileinfo, struct pipeline * pipeline, process_lines_stats * stats)
+{
+    process_lines_context ctx;
+    size_t len;
+    int result;
+
+    const char * text = map_input(fd, &len);
+    if (text != NULL)
+    {
+        if (stats != NULL)
+        {
+            stats->bytes = len;
+            stats->lines = count_newlines(text, len) + (text[len - 1] != '\n');
+        }
+        if (pipeline != NULL)
+        {
+            queue_mapping(pipeline, text, len);
+            drain_pipeline(pipeline);       // Before the chunks' text goes away
+        }
+        else
+        {
+            split_lines_to_files((char *) text, len, fileinfo);
+        }
+        unmap_input(text, len);
+        return;
+    }
+
+    if (process_lines_init_reader(&ctx, reader, fd,
+                                  pipeline != NULL ? queue_lines : split_lines_to_files,
+                                  pipeline != NULL ? (void *) pipeline : (void *) fileinfo) != 0)
+    {
+        perror("hsplit");
+        exit(1);
+    }
+    if (stats != NULL)
+        process_lines_count(&ctx, stats);
+    if (fileinfo->key.numranges == 0)       // We'd have to find keys across pieces
+        process_lines_stream_long_lines(&ctx, LONG_LINE_BYTES, pipeline != NULL ? queue_long_line : stream_long_line);
+    do {
+        result = process_lines(&ctx);
+        if (result == PTP_AGAIN && stats_requested)
+            print_stats_now(fileinfo, pipeline);
+    } while (result == 0 || result == PTP_AGAIN);
+    if (result > 0)
+    {
+        perror("hsplit");
+        exit(1);
+    }
+    if (pipeline != NULL)
+        publish_partial_chunk(pipeline);    // Before its buffer goes away
+    process_lines_cleanup(&ctx);
+}
+
+
+/**
+ * Hash lines from stdin to files given on command line.
+ */
+int main(int argc, char * argv[])
+{
+    int append = 0;
+    int nonblock = 0;
+    enum codec codec = CODEC_NONE;
+    unsigned int compressthreads = 0;       // One per CPU
+    compresspool * compress = NULL;
+    unsigned int numthreads = 0;            // Until we know what the input is
+    size_t bucketbytes = BUCKET_BUFFER_BYTES;
+    size_t memorybytes = BUCKET_MEMORY_BYTES;
+    enum ptp_reader reader = PTP_READER_BUFFER;
+    const char ** inputs = calloc(argc, sizeof (char *));
+    unsigned int numinputs = 0;
+    struct fileinfo fileinfo;
+    enum hash_kind hashkind = HASH_MURMUR3_32;
+    int consistent = 0;
+    int binary = 0, with_line = 0;
+    struct key_spec key = { 0, '\t', NULL, 0 };
+    const char * keylist = NULL;
+    unsigned int remap_old = 0, remap_new = 0;
+    bucket_set buckets;
+    struct stats stats;
+    FILE * statsfile = NULL;
+    static const struct option longopts[] = {
+        {"help",          no_argument,       NULL, 'h'},
+        {"append",        no_argument,       NULL, 'a'},
+        {"reader",        required_argument, NULL, 'r'},
+        {"jobs",          required_argument, NULL, 'j'},
+        {"bucket-buffer", required_argument, NULL, 'B'},
+        {"memory",        required_argument, NULL, 'm'},
+        {"input",         required_argument, NULL, 'i'},
+        {"hash",          required_argument, NULL, 'H'},
+        {"consistent",    no_argument,       NULL, 'c'},
+        {"remap",         required_argument, NULL, 'R'},
+        {"binary",        no_argument,       NULL, 'Y'},
+        {"nonblock",      no_argument,       NULL, 'N'},
+        {"compress",      required_argument, NULL, 'z'},
+        {"compress-jobs", required_argument, NULL, 'Z'},
+        {"with-line",     no_argument,       NULL, 'W'},
+        {"key",           required_argument, NULL, 'k'},
+        {"key-bytes",     required_argument, NULL, 'b'},
+        {"delimiter",     required_argument, NULL, 'd'},
+        {"stats",         optional_argument, NULL, 'S'},
+        {NULL, 0, NULL, 0}
+    };
+
+    if (inputs == NULL)
+    {
+        perror("hsplit: Error allocating memory");
+        exit(1);
+    }
+    int opt;
+    while ((opt = getopt_long(argc, argv, "hacr:j:B:m:i:k:b:d:z:", longopts, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 'h':
+            printusage();
+            exit(0);
+        case 'a':
+            append = 1;
+            break;
+        case 'c':
+            consistent = 1;
+            break;
+        case 'k':
+        case 'b':
+            if (keylist != NULL)
+            {
+                fprintf(stderr, "hsplit: Only one of --key and --key-bytes may be given.\n");
+                exit(1);
+            }
+            keylist = optarg;
+            key.bytes = (opt == 'b');
+            break;
+        case 'd':
+            if (strlen(optarg) != 1)
+            {
+                fprintf(stderr, "hsplit: The delimiter must be a single character.\n");
+                exit(1);
+            }
+            key.delim = optarg[0];
+            break;
+        case 'N':
+            nonblock = 1;
+            break;
+        case 'z':
+            if (parse_codec(optarg, &codec) != 0)
+            {
+                fprintf(stderr, "hsplit: Unknown compression '%s'.\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'Z':
+            if (parse_count(optarg, &compressthreads) != 0)
+            {
+                fprintf(stderr, "hsplit: Invalid number of compression jobs '%s'.\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'S':
+            statsfile = open_stats_file(optarg);
+            if (statsfile == NULL)
+            {
+                fprintf(stderr, "hsplit: Can't write stats to '%s'", optarg != NULL ? optarg : "2");
+                perror("");
+                exit(1);
+            }
+            break;
+        case 'Y':
+            binary = 1;
+            break;
+        case 'W':
+            with_line = 1;
+            break;
+        case 'R':
+            if (parse_remap(optarg, &remap_old, &remap_new) != 0)
+            {
+                fprintf(stderr, "hsplit: Invalid remapping '%s'; expected OLD,NEW numbers of files.\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'r':
+            if (parse_reader(optarg, &reader) != 0)
+            {
+                fprintf(stderr, "hsplit: Unknown reader '%s'.\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'j':
+            if (parse_count(optarg, &numthreads) != 0)
+            {
+                fprintf(stderr, "hsplit: Invalid number of jobs '%s'.\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'B':
+            if (parse_size(optarg, &bucketbytes) != 0)
+            {
+                fprintf(stderr, "hsplit: Invalid bucket buffer size '%s'.\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'm':
+            if (parse_size(optarg, &memorybytes) != 0)
+            {
+                fprintf(stderr, "hsplit: Invalid memory size '%s'.\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'i':
+            inputs[numinputs++] = optarg;
+            break;
+        case 'H':
+            if (parse_hash(optarg, &hashkind) != 0)
+            {
+                fprintf(stderr, "hsplit: Unknown hash function '%s'.\n", optarg);
+                exit(1);
+            }
+            break;
+        default:
+            printusage();
+            exit(1);
+        }
+    }
+    const int first_filename_arg = optind;
+
+    fileinfo.numfiles = argc - first_filename_arg;
+    fileinfo.hashkind = hashkind;
+    fileinfo.consistent = consistent;
+    fileinfo.remap_old = remap_old;
+    fileinfo.remap_new = remap_new;
+    fileinfo.binary = binary;
+    fileinfo.with_line = with_line;
+    if (keylist != NULL && parse_key_ranges(keylist, &key) != 0)
+    {
+        fprintf(stderr, "hsplit: Invalid %s list '%s'.\n", key.bytes ? "byte" : "field", keylist);
+        exit(1);
+    }
+    fileinfo.key = key;
+    if (fileinfo.numfiles == 0 && append)
+    {
+        fprintf(stderr, "Can only use --append with files.");
+        exit(1);
+    }
+    if (fileinfo.numfiles == 0 && nonblock)
+    {
+        fprintf(stderr, "hsplit: Can only use --nonblock with files.\n");
+        exit(1);
+    }
+    if (codec != CODEC_NONE && (fileinfo.numfiles == 0 || nonblock))
+    {
+        fprintf(stderr, "hsplit: Can only use --compress with files, and not with --nonblock.\n");
+        exit(1);
+    }
+    if (fileinfo.numfiles > 0 && (remap_old > 0 || binary || with_line))
+    {
+        fprintf(stderr, "hsplit: Can only use --remap, --binary, and --with-line without files.\n");
+        exit(1);
+    }
+    if (binary && (remap_old > 0 || with_line))
+    {
+        fprintf(stderr, "hsplit: Can't use --binary with --remap or --with-line.\n");
+        exit(1);
+    }
+
+    int * fds = calloc(fileinfo.numfiles > 0 ? fileinfo.numfiles : 1, sizeof (int));
+    if (fds == NULL)
+    {
+        perror("hsplit: Error allocating memory");
+        exit(1);
+    }
+
+    /* Open files. */
+    for (unsigned int f = 0 ; f < fileinfo.numfiles ; f++)
+    {
+        const char * filename = argv[first_filename_arg + f];
+        fds[f] = open(filename, O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC), 0666);
+        if (fds[f] < 0)
+        {
+            fprintf(stderr, "hsplit: error opening \"%s\"", filename);
+            perror("");
+            exit(1);
+        }
+    }
+    if (fileinfo.numfiles == 0)
+        fds[0] = STDOUT_FILENO;             // Where hashcodes go, buffered like a file
+    if (buckets_init(&buckets, fds, fileinfo.numfiles > 0 ? fileinfo.numfiles : 1, bucketbytes, memorybytes) != 0)
+    {
+        perror("hsplit: Error allocating memory");
+        exit(1);
+    }
+    if (nonblock && buckets_nonblocking(&buckets) != 0)
+    {
+        fprintf(stderr, "hsplit: Error making file %u nonblocking", buckets.failed);
+        perror("");
+        exit(1);
+    }
+    if (codec != CODEC_NONE)
+    {
+        if (compressthreads == 0)
+        {
+            long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+            compressthreads = cpus > 1 ? (unsigned int) cpus : 1;
+        }
+        compress = compresspool_create(codec, compressthreads, fds);
+        if (compress == NULL)
+        {
+            perror("hsplit: Error starting compression threads");
+            exit(1);
+        }
+        buckets_compress(&buckets, compress);
+    }
+    fileinfo.buckets = &buckets;
+    fileinfo.longline.started = 0;
+    fileinfo.stats = NULL;
+
+    /* Open inputs; stdin if none. */
+    int * infds = calloc(numinputs > 0 ? numinputs : 1, sizeof (int));
+    if (infds == NULL)
+    {
+        perror("hsplit: Error allocating memory");
+        exit(1);
+    }
+    infds[0] = fileno(stdin);
+    for (unsigned int i = 0 ; i < numinputs ; i++)
+    {
+        infds[i] = open(inputs[i], O_RDONLY);
+        if (infds[i] < 0)
+        {
+            fprintf(stderr, "hsplit: error opening \"%s\"", inputs[i]);
+            perror("");
+            exit(1);
+        }
+    }
+    if (numinputs == 0)
+        numinputs = 1;
+
+    if (statsfile != NULL)
+    {
+        stats.file = statsfile;
+        stats.started = clock_ns();
+        stats.numinputs = numinputs;
+        stats.names = inputs;
+        stats.inputs = calloc(numinputs, sizeof (process_lines_stats));
+        stats.snapshot = calloc(numinputs, sizeof (process_lines_stats));
+        stats.lines = calloc(buckets.numbuckets, sizeof (unsigned long long));
+        stats.bytes = calloc(buckets.numbuckets, sizeof (unsigned long long));
+        if (stats.inputs == NULL || stats.snapshot == NULL || stats.lines == NULL || stats.bytes == NULL)
+        {
+            perror("hsplit: Error allocating memory");
+            exit(1);
+        }
+        if (inputs[0] == NULL)
+            inputs[0] = "-";
+        buckets_time(&buckets);
+        fileinfo.stats = &stats;
+        catch_stats_signal(1);
+    }
+
+    // By default, use every CPU on regular files, where we don't have to read (or copy) the input.
+    if (numthreads == 0)
+    {
+        struct stat st;
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        numthreads = 1;
+        for (unsigned int i = 0 ; i < numinputs ; i++)
+            if (fstat(infds[i], &st) == 0 && S_ISREG(st.st_mode) && cpus > 1)
+                numthreads = (unsigned int) cpus;
+    }
+
+    /* Loop: read a line, hash to get file number, write. */
+    MurmurHash3_x86_32_batch_init();        // Before any hashing threads start
+    index_lines_init();
+    struct pipeline pipeline;
+    pipeline.fileinfo = &fileinfo;
+    if (numthreads > 1)
+        start_pipeline(&pipeline, numthreads);
+    for (unsigned int i = 0 ; i < numinputs ; i++)
+        split_input(infds[i], reader, &fileinfo, numthreads > 1 ? &pipeline : NULL,
+                    fileinfo.stats != NULL ? stats.inputs + i : NULL);
+    if (numthreads > 1)
+        finish_pipeline(&pipeline);
+
+    /* Close files and clean up. */
+    for (unsigned int i = 0 ; i < numinputs ; i++)
+        if (infds[i] != fileno(stdin))
+            close(infds[i]);
+    free(infds);
+    if (buckets_flush_all(&buckets) != 0)
+    {
+        fprintf(stderr, "hsplit: Error writing to file %u", buckets.failed);
+        perror("");
+        exit(1);
+    }
+    if (compress != NULL)
+        compresspool_destroy(compress);
+    if (fileinfo.stats != NULL)
+    {
+        print_stats(&fileinfo, stats.inputs, 1);
+        free(stats.inputs);
+        free(stats.snapshot);
+        free(stats.lines);
+        free(stats.bytes);
+    }
+    free(inputs);
     for (unsigned int f = 0 ; f < fileinfo.numfiles ; f++)
     {
-        if (fclose(fileinfo.files[f]) != 0)
+        if (close(fds[f]) != 0)
         {
             perror("hsplit: Error closing file");
             exit(1);
         }
     }
-    free(fileinfo.files);
+    buckets_cleanup(&buckets);
+    free(fds);
+    free(key.ranges);
 
     return 0;
 }
@@ -0,0 +1,194 @@
+/****************************************************************************
+ Parallel Text Processing -- Line Indexing
+
+ Copyright 2011 John Kleint
+
+ This is free software, licensed under the GNU General Public License v3,
+ available in the accompanying file LICENSE.txt.
+
+ See lineindex.h for documentation.
+****************************************************************************/
+
+#include <string.h>
+
+#include "lineindex.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+
+size_t index_lines_scalar(const char * buf, size_t len, uint32_t * ends, size_t maxends)
+{
+    const char * pos = buf;
+    const char * bufend = buf + len;
+    size_t numends = 0;
+
+    while (numends < maxends && pos < bufend)
+    {
+        const char * newline = memchr(pos, '\n', (size_t) (bufend - pos));
+        if (newline == NULL)
+            break;
+        ends[numends++] = (uint32_t) (newline - buf);
+        pos = newline + 1;
+    }
+    return numends;
+}
+
+
+#ifdef HAVE_X86_SIMD
+
+/* Store the offsets of the set bits of mask (newlines in the block at offset
+ * base) in ends.  Returns the new number of ends, at most maxends. */
+static inline size_t store_mask(uint64_t mask, size_t base, uint32_t * ends, size_t numends, size_t maxends)
+{
+    while (mask != 0 && numends < maxends)
+    {
+        ends[numends++] = (uint32_t) (base + __builtin_ctzll(mask));
+        mask &= mask - 1;           // Clear lowest set bit
+    }
+    return numends;
+}
+
+
+/* Each vectorized version compares a block of bytes at a time against '\n',
+ * turns the result into a bitmask, and walks the set bits.  A block with no
+ * newlines means we're in a long line, and memchr(3) is faster at finding the
+ * end of those.  The last partial block is left to the scalar version. */
+
+/* Find the end of a long line starting at pos; returns where to resume, or len
+ * if there isn't one. */
+static inline size_t skip_long_line(const char * buf, size_t pos, size_t len, uint32_t * ends, size_t * numends)
+{
+    const char * newline = memchr(buf + pos, '\n', len - pos);
+    if (newline == NULL)
+        return len;
+    ends[(*numends)++] = (uint32_t) (newline - buf);
+    return (size_t) (newline + 1 - buf);
+}
+
+__attribute__((target("sse2")))
+size_t index_lines_sse2(const char * buf, size_t len, uint32_t * ends, size_t maxends)
+{
+    const __m128i newlines = _mm_set1_epi8('\n');
+    size_t numends = 0;
+    size_t pos = 0;
+
+    while (pos + 64 <= len && numends < maxends)
+    {
+        __m128i b0 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (buf + pos)), newlines);
+        __m128i b1 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (buf + pos + 16)), newlines);
+        __m128i b2 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (buf + pos + 32)), newlines);
+        __m128i b3 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (buf + pos + 48)), newlines);
+        if (_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(b0, b1), _mm_or_si128(b2, b3))) == 0)
+        {
+            pos = skip_long_line(buf, pos + 64, len, ends, &numends);
+            continue;
+        }
+        uint64_t mask = (uint64_t) (uint16_t) _mm_movemask_epi8(b0)
+                      | (uint64_t) (uint16_t) _mm_movemask_epi8(b1) << 16
+                      | (uint64_t) (uint16_t) _mm_movemask_epi8(b2) << 32
+                      | (uint64_t) (uint16_t) _mm_movemask_epi8(b3) << 48;
+        numends = store_mask(mask, pos, ends, numends, maxends);
+        pos += 64;
+    }
+    if (numends < maxends && pos < len)
+    {
+        size_t tailends = index_lines_scalar(buf + pos, len - pos, ends + numends, maxends - numends);
+        for (size_t e = numends ; e < numends + tailends ; e++)
+            ends[e] += pos;
+        numends += tailends;
+    }
+    return numends;
+}
+
+
+__attribute__((target("avx2")))
+size_t index_lines_avx2(const char * buf, size_t len, uint32_t * ends, size_t maxends)
+{
+    const __m256i newlines = _mm256_set1_epi8('\n');
+    size_t numends = 0;
+    size_t pos = 0;
+
+    while (pos + 128 <= len && numends < maxends)
+    {
+        __m256i b0 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) (buf + pos)), newlines);
+        __m256i b1 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) (buf + pos + 32)), newlines);
+        __m256i b2 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) (buf + pos + 64)), newlines);
+        __m256i b3 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) (buf + pos + 96)), newlines);
+        __m256i any = _mm256_or_si256(_mm256_or_si256(b0, b1), _mm256_or_si256(b2, b3));
+        if (_mm256_testz_si256(any, any))
+        {
+            pos = skip_long_line(buf, pos + 128, len, ends, &numends);
+            continue;
+        }
+        uint64_t lo = (uint64_t) (uint32_t) _mm256_movemask_epi8(b0) | (uint64_t) (uint32_t) _mm256_movemask_epi8(b1) << 32;
+        uint64_t hi = (uint64_t) (uint32_t) _mm256_movemask_epi8(b2) | (uint64_t) (uint32_t) _mm256_movemask_epi8(b3) << 32;
+        numends = store_mask(lo, pos, ends, numends, maxends);
+        numends = store_mask(hi, pos + 64, ends, numends, maxends);
+        pos += 128;
+    }
+    if (numends < maxends && pos < len)
+    {
+        size_t tailends = index_lines_sse2(buf + pos, len - pos, ends + numends, maxends - numends);
+        for (size_t e = numends ; e < numends + tailends ; e++)
+            ends[e] += pos;
+        numends += tailends;
+    }
+    return numends;
+}
+
+
+int index_lines_supported(const char * name)
+{
+    if (strcmp(name, "scalar") == 0)
+        return 1;
+    __builtin_cpu_init();
+    if (strcmp(name, "sse2") == 0)
+        return __builtin_cpu_supports("sse2");
+    if (strcmp(name, "avx2") == 0)
+        return __builtin_cpu_supports("avx2");
+    return 0;
+}
+
+#else   /* !HAVE_X86_SIMD */
+
+size_t index_lines_sse2(__attribute__((unused)) const char * buf, __attribute__((unused)) size_t len,
+                        __attribute__((unused)) uint32_t * ends, __attribute__((unused)) size_t maxends)
+{
+    return 0;
+}
+
+size_t index_lines_avx2(__attribute__((unused)) const char * buf, __attribute__((unused)) size_t len,
+                        __attribute__((unused)) uint32_t * ends, __attribute__((unused)) size_t maxends)
+{
+    return 0;
+}
+
+int index_lines_supported(const char * name)
+{
+    return strcmp(name, "scalar") == 0;
+}
+
+#endif  /* HAVE_X86_SIMD */
+
+
+/* The implementation index_lines() uses: scalar until index_lines_init() picks one. */
+static size_t (*best)(const char * buf, size_t len, uint32_t * ends, size_t maxends) = index_lines_scalar;
+
+void index_lines_init(void)
+{
+    if (index_lines_supported("avx2"))
+        best = index_lines_avx2;
+    else if (index_lines_supported("sse2"))
+        best = index_lines_sse2;
+    else
+        best = index_lines_scalar;
+}
+
+
+size_t index_lines(const char * buf, size_t len, uint32_t * ends, size_t maxends)
+{
+    return best(buf, len, ends, maxends);
+}
@@ -0,0 +1,44 @@
+/****************************************************************************
+ Parallel Text Processing -- Line Indexing
+
+ Copyright 2011 John Kleint
+
+ This is free software, licensed under the GNU General Public License v3,
+ available in the accompanying file LICENSE.txt.
+*****************************************************************************/
+
+#ifndef LINEINDEX_H_
+#define LINEINDEX_H_
+
+#include <stdlib.h>
+#include <stdint.h>
+
+
+/**
+ * Find the newlines in buf[0, len): store the offset of each one, in order,
+ * in ends[], stopping after maxends of them.  Returns how many were stored;
+ * if that's maxends, there may be more after ends[maxends - 1].  len must be
+ * less than 4 GiB, so that offsets fit in 32 bits.
+ *
+ * This makes one vectorized pass over the buffer, which is much faster than
+ * calling memchr(3) once per line when lines are short, once
+ * index_lines_init() has chosen the best implementation for the CPU.
+ */
+size_t index_lines(const char * buf, size_t len, uint32_t * ends, size_t maxends);
+
+/** Choose the implementation index_lines() uses.  Call once, before any threads
+ * start calling index_lines(); until then, it uses the scalar one. */
+void index_lines_init(void);
+
+/* The implementations index_lines() chooses from, for testing and benchmarks.
+ * Only call the vectorized ones if index_lines_supported() says the CPU can
+ * run them. */
+size_t index_lines_scalar(const char * buf, size_t len, uint32_t * ends, size_t maxends);
+size_t index_lines_sse2(const char * buf, size_t len, uint32_t * ends, size_t maxends);
+size_t index_lines_avx2(const char * buf, size_t len, uint32_t * ends, size_t maxends);
+
+/** Whether the named implementation ("scalar", "sse2", or "avx2") can run here. */
+int index_lines_supported(const char * name);
+
+
+#endif /* LINEINDEX_H_ */
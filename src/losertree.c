@@ -0,0 +1,73 @@
+/****************************************************************************
+ Parallel Text Processing -- Loser Tree
+
+ Copyright 2011 John Kleint
+
+ This is free software, licensed under the GNU General Public License v3,
+ available in the accompanying file LICENSE.txt.
+
+ See losertree.h for documentation.
+****************************************************************************/
+
+#include "losertree.h"
+
+
+/*
+ * The tree is laid out like a binary heap: internal node n has children 2n
+ * and 2n + 1, and source s is the leaf at k + s.  That works for any k, not
+ * just powers of two; the leaves just end up at different depths.
+ */
+
+int loser_tree_init(loser_tree * tree, unsigned int k, int (*less)(unsigned int a, unsigned int b, void * info), void * info)
+{
+    // The second half is scratch for loser_tree_build().
+    tree->losers = calloc(k > 0 ? 2 * k : 1, sizeof (unsigned int));
+    if (tree->losers == NULL)
+        return 1;
+    tree->k = k;
+    tree->less = less;
+    tree->info = info;
+    return 0;
+}
+
+
+void loser_tree_build(loser_tree * tree)
+{
+    const unsigned int k = tree->k;
+    unsigned int * winners = tree->losers + k;      // winners[n] won the match at internal node n
+
+    tree->losers[0] = 0;
+    for (unsigned int n = k - 1 ; n > 0 && k > 1 ; n--)
+    {
+        unsigned int left = 2 * n >= k ? 2 * n - k : winners[2 * n];
+        unsigned int right = 2 * n + 1 >= k ? 2 * n + 1 - k : winners[2 * n + 1];
+        int rightwins = tree->less(right, left, tree->info);
+        winners[n] = rightwins ? right : left;
+        tree->losers[n] = rightwins ? left : right;
+    }
+    if (k > 1)
+        tree->losers[0] = winners[1];
+}
+
+
+void loser_tree_replay(loser_tree * tree, unsigned int s)
+{
+    unsigned int winner = s;
+    for (unsigned int n = (tree->k + s) / 2 ; n > 0 ; n /= 2)
+    {
+        if (tree->less(tree->losers[n], winner, tree->info))
+        {
+            unsigned int loser = winner;
+            winner = tree->losers[n];
+            tree->losers[n] = loser;
+        }
+    }
+    tree->losers[0] = winner;
+}
+
+
+void loser_tree_cleanup(loser_tree * tree)
+{
+    free(tree->losers);
+    tree->losers = NULL;
+}
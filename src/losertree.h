@@ -0,0 +1,54 @@
+/****************************************************************************
+ Parallel Text Processing -- Loser Tree
+
+ Copyright 2011 John Kleint
+
+ This is free software, licensed under the GNU General Public License v3,
+ available in the accompanying file LICENSE.txt.
+*****************************************************************************/
+
+#ifndef LOSERTREE_H_
+#define LOSERTREE_H_
+
+#include <stdlib.h>
+
+
+/*
+ * A tournament ("loser") tree over k sources, for k-way merging: it knows
+ * which source's current item is least, and when that source moves on to its
+ * next item, finds the new least with one comparison per level -- about
+ * log2(k) in all, half what a binary heap takes.
+ *
+ * Sources are numbered 0 to k - 1; the tree only ever compares them through
+ * less(a, b, info), which says whether source a's current item comes before
+ * source b's.  A source that has run out should compare greater than any
+ * other.  For a stable merge, break ties by source number.
+ */
+typedef struct {
+    unsigned int k;
+    unsigned int * losers;      // losers[n] lost the match at internal node n; losers[0] is the overall winner
+    int (*less)(unsigned int a, unsigned int b, void * info);
+    void * info;
+} loser_tree;
+
+
+/** Set up a tree over k sources.  Returns nonzero on error. */
+int loser_tree_init(loser_tree * tree, unsigned int k, int (*less)(unsigned int a, unsigned int b, void * info), void * info);
+
+/** Play every match from scratch: call once all the sources have their first items. */
+void loser_tree_build(loser_tree * tree);
+
+/** The source with the least current item. */
+static inline unsigned int loser_tree_winner(const loser_tree * tree)
+{
+    return tree->losers[0];
+}
+
+/** Source s's current item has changed (it has moved on, say): replay its matches to find the new winner. */
+void loser_tree_replay(loser_tree * tree, unsigned int s);
+
+/** Free the tree. */
+void loser_tree_cleanup(loser_tree * tree);
+
+
+#endif /* LOSERTREE_H_ */
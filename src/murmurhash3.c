@@ -9,6 +9,9 @@
 
 #include "murmurhash3.h"
 
+#include <string.h>
+#include <limits.h>
+
 //-----------------------------------------------------------------------------
 // Platform-specific functions and macros
 
@@ -52,15 +55,23 @@ inline uint64_t rotl64 ( uint64_t x, int8_t r )
 // Block read - if your platform needs to do endian-swapping or can only
 // handle aligned reads, do the conversion here
 
-FORCE_INLINE uint32_t getblock ( const uint32_t * p, int i )
+static inline FORCE_INLINE uint32_t getblock ( const uint32_t * p, int i )
 {
   return p[i];
 }
 
+static inline FORCE_INLINE uint64_t getblock64 ( const uint64_t * p, int i )
+{
+  uint64_t k;
+  memcpy(&k, p + i, sizeof k);    // Lines start anywhere, so don't assume alignment
+
+  return k;
+}
+
 //-----------------------------------------------------------------------------
 // Finalization mix - force all bits of a hash block to avalanche
 
-FORCE_INLINE uint32_t fmix ( uint32_t h )
+static inline FORCE_INLINE uint32_t fmix ( uint32_t h )
 {
   h ^= h >> 16;
   h *= 0x85ebca6b;
@@ -71,6 +82,19 @@ FORCE_INLINE uint32_t fmix ( uint32_t h )
   return h;
 }
 
+//----------
+
+static inline FORCE_INLINE uint64_t fmix64 ( uint64_t k )
+{
+  k ^= k >> 33;
+  k *= BIG_CONSTANT(0xff51afd7ed558ccd);
+  k ^= k >> 33;
+  k *= BIG_CONSTANT(0xc4ceb9fe1a85ec53);
+  k ^= k >> 33;
+
+  return k;
+}
+
 //-----------------------------------------------------------------------------
 
 void MurmurHash3_x86_32 ( const void * key, int len,
@@ -111,8 +135,8 @@ void MurmurHash3_x86_32 ( const void * key, int len,
 
   switch(len & 3)
   {
-  case 3: k1 ^= tail[2] << 16;
-  case 2: k1 ^= tail[1] << 8;
+  case 3: k1 ^= tail[2] << 16; /* fall through */
+  case 2: k1 ^= tail[1] << 8;  /* fall through */
   case 1: k1 ^= tail[0];
           k1 *= c1; k1 = ROTL32(k1,15); k1 *= c2; h1 ^= k1;
   };
@@ -126,3 +150,589 @@ void MurmurHash3_x86_32 ( const void * key, int len,
 
   *(uint32_t*)out = h1;
 } 
+
+//-----------------------------------------------------------------------------
+// Incremental MurmurHash3_x86_32 - the same steps as above, but a block may
+// straddle two calls to _update, so we carry its first bytes in the state.
+
+static inline FORCE_INLINE uint32_t mix_k1 ( uint32_t k1 )
+{
+  k1 *= 0xcc9e2d51;
+  k1 = ROTL32(k1,15);
+  k1 *= 0x1b873593;
+
+  return k1;
+}
+
+static inline FORCE_INLINE uint32_t mix_h1 ( uint32_t h1, uint32_t k1 )
+{
+  h1 ^= mix_k1(k1);
+  h1 = ROTL32(h1,13);
+  h1 = h1*5+0xe6546b64;
+
+  return h1;
+}
+
+void MurmurHash3_x86_32_init ( MurmurHash3_x86_32_state * state, uint32_t seed )
+{
+  state->h1 = seed;
+  state->tail = 0;
+  state->tail_len = 0;
+  state->total_len = 0;
+}
+
+void MurmurHash3_x86_32_update ( MurmurHash3_x86_32_state * state, const void * key, size_t len )
+{
+  const uint8_t * data = (const uint8_t*)key;
+  const uint8_t * end = data + len;
+  uint32_t h1 = state->h1;
+
+  state->total_len += len;
+
+  //----------
+  // finish the block left over from last time
+
+  while(state->tail_len > 0 && data < end)
+  {
+    state->tail |= (uint32_t)*data++ << (8 * state->tail_len);
+    if(++state->tail_len == 4)
+    {
+      h1 = mix_h1(h1, state->tail);
+      state->tail = 0;
+      state->tail_len = 0;
+    }
+  }
+
+  //----------
+  // body
+
+  for(; end - data >= 4; data += 4)
+  {
+    uint32_t k1;
+    memcpy(&k1, data, 4);
+    h1 = mix_h1(h1, k1);
+  }
+
+  //----------
+  // save the start of the next block
+
+  for(; data < end; data++)
+    state->tail |= (uint32_t)*data << (8 * state->tail_len++);
+
+  state->h1 = h1;
+}
+
+void MurmurHash3_x86_32_final ( const MurmurHash3_x86_32_state * state, void * out )
+{
+  uint32_t h1 = state->h1;
+
+  if(state->tail_len > 0)
+    h1 ^= mix_k1(state->tail);
+
+  h1 ^= (uint32_t)state->total_len;
+
+  h1 = fmix(h1);
+
+  *(uint32_t*)out = h1;
+}
+
+//-----------------------------------------------------------------------------
+
+void MurmurHash3_x64_128 ( const void * key, const int len,
+                           const uint32_t seed, void * out )
+{
+  const uint8_t * data = (const uint8_t*)key;
+  const int nblocks = len / 16;
+
+  uint64_t h1 = seed;
+  uint64_t h2 = seed;
+
+  const uint64_t c1 = BIG_CONSTANT(0x87c37b91114253d5);
+  const uint64_t c2 = BIG_CONSTANT(0x4cf5ad432745937f);
+
+  //----------
+  // body
+
+  const uint64_t * blocks = (const uint64_t *)(data);
+
+  for(int i = 0; i < nblocks; i++)
+  {
+    uint64_t k1 = getblock64(blocks,i*2+0);
+    uint64_t k2 = getblock64(blocks,i*2+1);
+
+    k1 *= c1; k1  = ROTL64(k1,31); k1 *= c2; h1 ^= k1;
+
+    h1 = ROTL64(h1,27); h1 += h2; h1 = h1*5+0x52dce729;
+
+    k2 *= c2; k2  = ROTL64(k2,33); k2 *= c1; h2 ^= k2;
+
+    h2 = ROTL64(h2,31); h2 += h1; h2 = h2*5+0x38495ab5;
+  }
+
+  //----------
+  // tail
+
+  const uint8_t * tail = (const uint8_t*)(data + nblocks*16);
+
+  uint64_t k1 = 0;
+  uint64_t k2 = 0;
+
+  switch(len & 15)
+  {
+  case 15: k2 ^= ((uint64_t)tail[14]) << 48; /* fall through */
+  case 14: k2 ^= ((uint64_t)tail[13]) << 40; /* fall through */
+  case 13: k2 ^= ((uint64_t)tail[12]) << 32; /* fall through */
+  case 12: k2 ^= ((uint64_t)tail[11]) << 24; /* fall through */
+  case 11: k2 ^= ((uint64_t)tail[10]) << 16; /* fall through */
+  case 10: k2 ^= ((uint64_t)tail[ 9]) << 8;  /* fall through */
+  case  9: k2 ^= ((uint64_t)tail[ 8]) << 0;
+           k2 *= c2; k2  = ROTL64(k2,33); k2 *= c1; h2 ^= k2; /* fall through */
+
+  case  8: k1 ^= ((uint64_t)tail[ 7]) << 56; /* fall through */
+  case  7: k1 ^= ((uint64_t)tail[ 6]) << 48; /* fall through */
+  case  6: k1 ^= ((uint64_t)tail[ 5]) << 40; /* fall through */
+  case  5: k1 ^= ((uint64_t)tail[ 4]) << 32; /* fall through */
+  case  4: k1 ^= ((uint64_t)tail[ 3]) << 24; /* fall through */
+  case  3: k1 ^= ((uint64_t)tail[ 2]) << 16; /* fall through */
+  case  2: k1 ^= ((uint64_t)tail[ 1]) << 8;  /* fall through */
+  case  1: k1 ^= ((uint64_t)tail[ 0]) << 0;
+           k1 *= c1; k1  = ROTL64(k1,31); k1 *= c2; h1 ^= k1;
+  };
+
+  //----------
+  // finalization
+
+  h1 ^= len; h2 ^= len;
+
+  h1 += h2;
+  h2 += h1;
+
+  h1 = fmix64(h1);
+  h2 = fmix64(h2);
+
+  h1 += h2;
+  h2 += h1;
+
+  ((uint64_t*)out)[0] = h1;
+  ((uint64_t*)out)[1] = h2;
+}
+
+//-----------------------------------------------------------------------------
+// Incremental MurmurHash3_x64_128 - as for x86_32, with 16-byte blocks.
+
+static inline FORCE_INLINE void mix_block128 ( uint64_t * h1, uint64_t * h2, uint64_t k1, uint64_t k2 )
+{
+  const uint64_t c1 = BIG_CONSTANT(0x87c37b91114253d5);
+  const uint64_t c2 = BIG_CONSTANT(0x4cf5ad432745937f);
+
+  k1 *= c1; k1  = ROTL64(k1,31); k1 *= c2; *h1 ^= k1;
+
+  *h1 = ROTL64(*h1,27); *h1 += *h2; *h1 = *h1*5+0x52dce729;
+
+  k2 *= c2; k2  = ROTL64(k2,33); k2 *= c1; *h2 ^= k2;
+
+  *h2 = ROTL64(*h2,31); *h2 += *h1; *h2 = *h2*5+0x38495ab5;
+}
+
+void MurmurHash3_x64_128_init ( MurmurHash3_x64_128_state * state, uint32_t seed )
+{
+  state->h1 = seed;
+  state->h2 = seed;
+  state->tail_len = 0;
+  state->total_len = 0;
+}
+
+void MurmurHash3_x64_128_update ( MurmurHash3_x64_128_state * state, const void * key, size_t len )
+{
+  const uint8_t * data = (const uint8_t*)key;
+  const uint8_t * end = data + len;
+  uint64_t h1 = state->h1;
+  uint64_t h2 = state->h2;
+
+  state->total_len += len;
+
+  //----------
+  // finish the block left over from last time
+
+  if(state->tail_len > 0)
+  {
+    size_t fill = 16 - state->tail_len;
+    if(fill > len)
+      fill = len;
+    memcpy(state->tail + state->tail_len, data, fill);
+    state->tail_len += (int)fill;
+    data += fill;
+    if(state->tail_len < 16)
+      return;
+    mix_block128(&h1, &h2, getblock64((const uint64_t *)state->tail, 0),
+                 getblock64((const uint64_t *)state->tail, 1));
+    state->tail_len = 0;
+  }
+
+  //----------
+  // body
+
+  for(; end - data >= 16; data += 16)
+    mix_block128(&h1, &h2, getblock64((const uint64_t *)data, 0),
+                 getblock64((const uint64_t *)data, 1));
+
+  //----------
+  // save the start of the next block
+
+  memcpy(state->tail, data, (size_t)(end - data));
+  state->tail_len = (int)(end - data);
+
+  state->h1 = h1;
+  state->h2 = h2;
+}
+
+void MurmurHash3_x64_128_final ( const MurmurHash3_x64_128_state * state, void * out )
+{
+  const uint64_t c1 = BIG_CONSTANT(0x87c37b91114253d5);
+  const uint64_t c2 = BIG_CONSTANT(0x4cf5ad432745937f);
+  const uint8_t * tail = state->tail;
+  uint64_t h1 = state->h1;
+  uint64_t h2 = state->h2;
+  uint64_t k1 = 0;
+  uint64_t k2 = 0;
+
+  for(int i = state->tail_len - 1; i >= 8; i--)
+    k2 = (k2 << 8) | tail[i];
+  for(int i = (state->tail_len < 8 ? state->tail_len : 8) - 1; i >= 0; i--)
+    k1 = (k1 << 8) | tail[i];
+  if(state->tail_len > 8)
+  {
+    k2 *= c2; k2  = ROTL64(k2,33); k2 *= c1; h2 ^= k2;
+  }
+  if(state->tail_len > 0)
+  {
+    k1 *= c1; k1  = ROTL64(k1,31); k1 *= c2; h1 ^= k1;
+  }
+
+  h1 ^= state->total_len; h2 ^= state->total_len;
+
+  h1 += h2;
+  h2 += h1;
+
+  h1 = fmix64(h1);
+  h2 = fmix64(h2);
+
+  h1 += h2;
+  h2 += h1;
+
+  ((uint64_t*)out)[0] = h1;
+  ((uint64_t*)out)[1] = h2;
+}
+
+//-----------------------------------------------------------------------------
+// Batched MurmurHash3_x86_32 - hash several keys at once, one per SIMD lane,
+// so their dependency chains run side by side.  Each block step gathers the
+// next 4 bytes of every key whose body isn't done yet; the other lanes are
+// masked off, so they neither read past their keys nor change their h1.
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MURMUR_SIMD 1
+#include <immintrin.h>
+#endif
+
+#define MURMUR_MAXLANES     16
+#define MURMUR_LANE_MAXLEN  256     // Longer keys would leave the other lanes idle too long
+
+#ifdef MURMUR_SIMD
+
+typedef void (*murmur_lanes_fn) ( const uint8_t * const * keys, const uint32_t * lens,
+                                  uint32_t seed, uint32_t * out );
+
+// Tails of keys shorter than a block, which we can't gather without reading
+// before the key.  Longer keys' tails are gathered as the 4 bytes ending the
+// key, shifted down past the bytes that belong to the body.
+static inline void murmur_short_tails ( const uint8_t * const * keys, const uint32_t * lens,
+                                        int lanes, uint32_t * tails )
+{
+  for(int l = 0; l < lanes; l++)
+  {
+    const uint8_t * tail = keys[l];
+    uint32_t k1 = 0;
+
+    if(lens[l] < 4)
+    {
+      switch(lens[l])
+      {
+      case 3: k1 ^= tail[2] << 16; /* fall through */
+      case 2: k1 ^= tail[1] << 8;  /* fall through */
+      case 1: k1 ^= tail[0];
+      };
+    }
+    tails[l] = k1;
+  }
+}
+
+// Gathers take 64-bit offsets from one base, so that lanes can point anywhere.
+static inline void murmur_lane_offsets ( const uint8_t * const * keys, int lanes, int64_t * offsets )
+{
+  for(int l = 0; l < lanes; l++)
+    offsets[l] = (int64_t)((uintptr_t)keys[l] - (uintptr_t)keys[0]);
+}
+
+__attribute__((target("avx2")))
+static void murmur_lanes_avx2 ( const uint8_t * const * keys, const uint32_t * lens,
+                                uint32_t seed, uint32_t * out )
+{
+  uint32_t tails[8];
+  int64_t offsets[8];
+  const int * base = (const int *)keys[0];
+
+  murmur_short_tails(keys, lens, 8, tails);
+  murmur_lane_offsets(keys, 8, offsets);
+  const __m256i lo0 = _mm256_loadu_si256((const __m256i *)offsets);
+  const __m256i hi0 = _mm256_loadu_si256((const __m256i *)(offsets + 4));
+  __m256i lo = lo0;
+  __m256i hi = hi0;
+  const __m256i vlens = _mm256_loadu_si256((const __m256i *)lens);
+  const __m256i nblocks = _mm256_srli_epi32(vlens, 2);
+  __m128i maxblocks4 = _mm_max_epu32(_mm256_castsi256_si128(nblocks), _mm256_extracti128_si256(nblocks, 1));
+  maxblocks4 = _mm_max_epu32(maxblocks4, _mm_shuffle_epi32(maxblocks4, _MM_SHUFFLE(1, 0, 3, 2)));
+  maxblocks4 = _mm_max_epu32(maxblocks4, _mm_shuffle_epi32(maxblocks4, _MM_SHUFFLE(2, 3, 0, 1)));
+  const uint32_t maxblocks = (uint32_t)_mm_cvtsi128_si32(maxblocks4);
+  const __m256i four = _mm256_set1_epi64x(4);
+  const __m256i c1 = _mm256_set1_epi32((int)0xcc9e2d51);
+  const __m256i c2 = _mm256_set1_epi32(0x1b873593);
+  __m256i h1 = _mm256_set1_epi32((int)seed);
+  __m256i k1;
+
+  //----------
+  // body
+
+  for(uint32_t i = 0; i < maxblocks; i++)
+  {
+    __m256i active = _mm256_cmpgt_epi32(nblocks, _mm256_set1_epi32((int)i));
+    __m128i klo = _mm256_mask_i64gather_epi32(_mm_setzero_si128(), base, lo, _mm256_castsi256_si128(active), 1);
+    __m128i khi = _mm256_mask_i64gather_epi32(_mm_setzero_si128(), base, hi, _mm256_extracti128_si256(active, 1), 1);
+    k1 = _mm256_inserti128_si256(_mm256_castsi128_si256(klo), khi, 1);
+
+    k1 = _mm256_mullo_epi32(k1, c1);
+    k1 = _mm256_or_si256(_mm256_slli_epi32(k1, 15), _mm256_srli_epi32(k1, 17));
+    k1 = _mm256_mullo_epi32(k1, c2);
+
+    __m256i h = _mm256_xor_si256(h1, k1);
+    h = _mm256_or_si256(_mm256_slli_epi32(h, 13), _mm256_srli_epi32(h, 19));
+    h = _mm256_add_epi32(_mm256_add_epi32(h, _mm256_slli_epi32(h, 2)), _mm256_set1_epi32((int)0xe6546b64));
+    h1 = _mm256_blendv_epi8(h1, h, active);
+
+    lo = _mm256_add_epi64(lo, four);
+    hi = _mm256_add_epi64(hi, four);
+  }
+
+  //----------
+  // tail - a lane with no tail has k1 == 0, which leaves h1 alone
+
+  {
+    const __m256i rem = _mm256_and_si256(vlens, _mm256_set1_epi32(3));
+    const __m256i gather = _mm256_andnot_si256(_mm256_cmpeq_epi32(rem, _mm256_setzero_si256()),
+                                               _mm256_cmpgt_epi32(vlens, _mm256_set1_epi32(3)));
+    const __m256i lastlo = _mm256_add_epi64(lo0, _mm256_sub_epi64(_mm256_cvtepu32_epi64(_mm256_castsi256_si128(vlens)), four));
+    const __m256i lasthi = _mm256_add_epi64(hi0, _mm256_sub_epi64(_mm256_cvtepu32_epi64(_mm256_extracti128_si256(vlens, 1)), four));
+    __m128i klo = _mm256_mask_i64gather_epi32(_mm_setzero_si128(), base, lastlo, _mm256_castsi256_si128(gather), 1);
+    __m128i khi = _mm256_mask_i64gather_epi32(_mm_setzero_si128(), base, lasthi, _mm256_extracti128_si256(gather, 1), 1);
+    k1 = _mm256_inserti128_si256(_mm256_castsi128_si256(klo), khi, 1);
+    k1 = _mm256_srlv_epi32(k1, _mm256_slli_epi32(_mm256_sub_epi32(_mm256_set1_epi32(4), rem), 3));
+    k1 = _mm256_or_si256(k1, _mm256_loadu_si256((const __m256i *)tails));
+  }
+  k1 = _mm256_mullo_epi32(k1, c1);
+  k1 = _mm256_or_si256(_mm256_slli_epi32(k1, 15), _mm256_srli_epi32(k1, 17));
+  k1 = _mm256_mullo_epi32(k1, c2);
+  h1 = _mm256_xor_si256(h1, k1);
+
+  //----------
+  // finalization
+
+  h1 = _mm256_xor_si256(h1, vlens);
+
+  h1 = _mm256_xor_si256(h1, _mm256_srli_epi32(h1, 16));
+  h1 = _mm256_mullo_epi32(h1, _mm256_set1_epi32((int)0x85ebca6b));
+  h1 = _mm256_xor_si256(h1, _mm256_srli_epi32(h1, 13));
+  h1 = _mm256_mullo_epi32(h1, _mm256_set1_epi32((int)0xc2b2ae35));
+  h1 = _mm256_xor_si256(h1, _mm256_srli_epi32(h1, 16));
+
+  _mm256_storeu_si256((__m256i *)out, h1);
+}
+
+__attribute__((target("avx512f")))
+static void murmur_lanes_avx512f ( const uint8_t * const * keys, const uint32_t * lens,
+                                   uint32_t seed, uint32_t * out )
+{
+  uint32_t tails[16];
+  int64_t offsets[16];
+  const void * base = keys[0];
+
+  murmur_short_tails(keys, lens, 16, tails);
+  murmur_lane_offsets(keys, 16, offsets);
+  const __m512i lo0 = _mm512_loadu_si512(offsets);
+  const __m512i hi0 = _mm512_loadu_si512(offsets + 8);
+  __m512i lo = lo0;
+  __m512i hi = hi0;
+  const __m512i vlens = _mm512_loadu_si512(lens);
+  const __m512i nblocks = _mm512_srli_epi32(vlens, 2);
+  const uint32_t maxblocks = _mm512_reduce_max_epu32(nblocks);
+  const __m512i four = _mm512_set1_epi64(4);
+  const __m512i c1 = _mm512_set1_epi32((int)0xcc9e2d51);
+  const __m512i c2 = _mm512_set1_epi32(0x1b873593);
+  __m512i h1 = _mm512_set1_epi32((int)seed);
+  __m512i k1;
+
+  //----------
+  // body
+
+  for(uint32_t i = 0; i < maxblocks; i++)
+  {
+    __mmask16 active = _mm512_cmpgt_epu32_mask(nblocks, _mm512_set1_epi32((int)i));
+    __m256i klo = _mm512_mask_i64gather_epi32(_mm256_setzero_si256(), (__mmask8)active, lo, base, 1);
+    __m256i khi = _mm512_mask_i64gather_epi32(_mm256_setzero_si256(), (__mmask8)(active >> 8), hi, base, 1);
+    k1 = _mm512_inserti64x4(_mm512_castsi256_si512(klo), khi, 1);
+
+    k1 = _mm512_mullo_epi32(k1, c1);
+    k1 = _mm512_rol_epi32(k1, 15);
+    k1 = _mm512_mullo_epi32(k1, c2);
+
+    __m512i h = _mm512_xor_si512(h1, k1);
+    h = _mm512_rol_epi32(h, 13);
+    h = _mm512_add_epi32(_mm512_add_epi32(h, _mm512_slli_epi32(h, 2)), _mm512_set1_epi32((int)0xe6546b64));
+    h1 = _mm512_mask_mov_epi32(h1, active, h);
+
+    lo = _mm512_add_epi64(lo, four);
+    hi = _mm512_add_epi64(hi, four);
+  }
+
+  //----------
+  // tail - a lane with no tail has k1 == 0, which leaves h1 alone
+
+  {
+    const __m512i rem = _mm512_and_si512(vlens, _mm512_set1_epi32(3));
+    const __mmask16 gather = _mm512_test_epi32_mask(rem, rem) & _mm512_cmpgt_epu32_mask(vlens, _mm512_set1_epi32(3));
+    const __m512i lastlo = _mm512_add_epi64(lo0, _mm512_sub_epi64(_mm512_cvtepu32_epi64(_mm512_castsi512_si256(vlens)), four));
+    const __m512i lasthi = _mm512_add_epi64(hi0, _mm512_sub_epi64(_mm512_cvtepu32_epi64(_mm512_extracti64x4_epi64(vlens, 1)), four));
+    __m256i klo = _mm512_mask_i64gather_epi32(_mm256_setzero_si256(), (__mmask8)gather, lastlo, base, 1);
+    __m256i khi = _mm512_mask_i64gather_epi32(_mm256_setzero_si256(), (__mmask8)(gather >> 8), lasthi, base, 1);
+    k1 = _mm512_inserti64x4(_mm512_castsi256_si512(klo), khi, 1);
+    k1 = _mm512_srlv_epi32(k1, _mm512_slli_epi32(_mm512_sub_epi32(_mm512_set1_epi32(4), rem), 3));
+    k1 = _mm512_or_si512(k1, _mm512_loadu_si512(tails));
+  }
+  k1 = _mm512_mullo_epi32(k1, c1);
+  k1 = _mm512_rol_epi32(k1, 15);
+  k1 = _mm512_mullo_epi32(k1, c2);
+  h1 = _mm512_xor_si512(h1, k1);
+
+  //----------
+  // finalization
+
+  h1 = _mm512_xor_si512(h1, vlens);
+
+  h1 = _mm512_xor_si512(h1, _mm512_srli_epi32(h1, 16));
+  h1 = _mm512_mullo_epi32(h1, _mm512_set1_epi32((int)0x85ebca6b));
+  h1 = _mm512_xor_si512(h1, _mm512_srli_epi32(h1, 13));
+  h1 = _mm512_mullo_epi32(h1, _mm512_set1_epi32((int)0xc2b2ae35));
+  h1 = _mm512_xor_si512(h1, _mm512_srli_epi32(h1, 16));
+
+  _mm512_storeu_si512(out, h1);
+}
+
+#endif // MURMUR_SIMD
+
+//-----------------------------------------------------------------------------
+
+// Hash one key of any length.
+static void hash_one ( const void * key, size_t len, uint32_t seed, uint32_t * out )
+{
+  if(len <= INT_MAX)
+  {
+    MurmurHash3_x86_32(key, (int)len, seed, out);
+  }
+  else
+  {
+    MurmurHash3_x86_32_state state;
+    MurmurHash3_x86_32_init(&state, seed);
+    MurmurHash3_x86_32_update(&state, key, len);
+    MurmurHash3_x86_32_final(&state, out);
+  }
+}
+
+// The chosen kernel and its width, or 0 lanes for scalar.  Only set before
+// any threads start hashing, so they never change under one.
+#ifdef MURMUR_SIMD
+static murmur_lanes_fn batch_kernel = NULL;
+#endif
+static int batch_lanes = 0;
+
+int MurmurHash3_x86_32_batch_use ( const char * name )
+{
+  if(strcmp(name, "scalar") == 0)
+  {
+    batch_lanes = 0;
+    return 1;
+  }
+#ifdef MURMUR_SIMD
+  __builtin_cpu_init();
+  if(strcmp(name, "avx512f") == 0 && __builtin_cpu_supports("avx512f"))
+  {
+    batch_kernel = murmur_lanes_avx512f;
+    batch_lanes = 16;
+    return 1;
+  }
+  if(strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2"))
+  {
+    batch_kernel = murmur_lanes_avx2;
+    batch_lanes = 8;
+    return 1;
+  }
+#endif
+  return 0;
+}
+
+void MurmurHash3_x86_32_batch_init ( void )
+{
+  if(!MurmurHash3_x86_32_batch_use("avx512f") && !MurmurHash3_x86_32_batch_use("avx2"))
+    MurmurHash3_x86_32_batch_use("scalar");
+}
+
+void MurmurHash3_x86_32_batch ( const void * const * keys, const size_t * lens,
+                                size_t n, uint32_t seed, uint32_t * out )
+{
+  size_t i = 0;
+
+#ifdef MURMUR_SIMD
+  const int lanes = batch_lanes;
+  if(lanes > 0)
+  {
+    const uint8_t * lanekeys[MURMUR_MAXLANES];
+    uint32_t lanelens[MURMUR_MAXLANES];
+    size_t laneout[MURMUR_MAXLANES];
+    uint32_t hashes[MURMUR_MAXLANES];
+    int l = 0;
+
+    // Fill lanes with short keys; hash long ones on their own.
+    for(; i < n; i++)
+    {
+      if(lens[i] > MURMUR_LANE_MAXLEN)
+      {
+        hash_one(keys[i], lens[i], seed, &out[i]);
+        continue;
+      }
+      lanekeys[l] = (const uint8_t *)keys[i];
+      lanelens[l] = (uint32_t)lens[i];
+      laneout[l] = i;               // Where this lane's hash goes
+      if(++l == lanes)
+      {
+        batch_kernel(lanekeys, lanelens, seed, hashes);
+        for(l = 0; l < lanes; l++) out[laneout[l]] = hashes[l];
+        l = 0;
+      }
+    }
+    for(int r = 0; r < l; r++)
+      MurmurHash3_x86_32(lanekeys[r], (int)lanelens[r], seed, &out[laneout[r]]);
+    return;
+  }
+#endif
+
+  for(; i < n; i++)
+    hash_one(keys[i], lens[i], seed, &out[i]);
+}
@@ -24,10 +24,69 @@ typedef unsigned __int64 uint64_t;
 
 #endif // !defined(_MSC_VER)
 
+#include <stddef.h>
+
 //-----------------------------------------------------------------------------
 
 void MurmurHash3_x86_32  ( const void * key, int len, uint32_t seed, void * out );
 
+// Incremental MurmurHash3_x86_32: feed a key in pieces of any size with
+// _update, and get the same hash from _final as hashing it all at once.  Keys
+// can be any length; past 2^32 - 1 bytes, the length mixed in at the end is
+// taken mod 2^32.
+
+typedef struct {
+  uint32_t h1;
+  uint32_t tail;          // Bytes of the current block seen so far...
+  int tail_len;           // ...and how many
+  uint64_t total_len;
+} MurmurHash3_x86_32_state;
+
+void MurmurHash3_x86_32_init   ( MurmurHash3_x86_32_state * state, uint32_t seed );
+void MurmurHash3_x86_32_update ( MurmurHash3_x86_32_state * state, const void * key, size_t len );
+void MurmurHash3_x86_32_final  ( const MurmurHash3_x86_32_state * state, void * out );
+
+// MurmurHash3_x64_128 writes two uint64_ts to out, and is much faster per byte
+// than the x86 versions on 64-bit CPUs.  Its incremental version works the
+// same way as MurmurHash3_x86_32's.
+
+void MurmurHash3_x64_128 ( const void * key, int len, uint32_t seed, void * out );
+
+typedef struct {
+  uint64_t h1;
+  uint64_t h2;
+  uint8_t tail[16];       // Bytes of the current block seen so far...
+  int tail_len;           // ...and how many
+  uint64_t total_len;
+} MurmurHash3_x64_128_state;
+
+void MurmurHash3_x64_128_init   ( MurmurHash3_x64_128_state * state, uint32_t seed );
+void MurmurHash3_x64_128_update ( MurmurHash3_x64_128_state * state, const void * key, size_t len );
+void MurmurHash3_x64_128_final  ( const MurmurHash3_x64_128_state * state, void * out );
+
+// Hash n keys at once: out[i] gets exactly what MurmurHash3_x86_32 would give
+// for keys[i] and lens[i] (or the incremental version, for keys too long for
+// it).  Short keys are hashed in parallel SIMD lanes (8 at a time with AVX2,
+// 16 with AVX-512), which beats one call per key when there are many of them.
+// Keys of up to 256 bytes go in the lanes, even ones shorter than a 4-byte
+// block; longer keys, and the few left over at the end, are hashed one at a
+// time.
+
+void MurmurHash3_x86_32_batch ( const void * const * keys, const size_t * lens,
+                                size_t n, uint32_t seed, uint32_t * out );
+
+// Choose the best implementation of MurmurHash3_x86_32_batch the CPU can run.
+// Call once before hashing, and before any threads start: until then, it
+// hashes one key at a time.
+
+void MurmurHash3_x86_32_batch_init ( void );
+
+// Or make it use the named implementation: "scalar", "avx2", or "avx512f".
+// Returns 0 if the CPU can't run it.  For tests and benchmarks; the same
+// rule about threads applies.
+
+int MurmurHash3_x86_32_batch_use ( const char * name );
+
 //-----------------------------------------------------------------------------
 
 #endif // _MURMURHASH3_H_
@@ -7,23 +7,135 @@
  *****************************************************************************/
 
 #define _XOPEN_SOURCE        	// For fileno(3)
-#define _GNU_SOURCE            	// For memrchr(3)
+#define _GNU_SOURCE            	// For memrchr(3), getopt_long(3)
 
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <poll.h>
+#include <errno.h>
+#include <getopt.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <assert.h>
 #include <limits.h>
+#include <time.h>
+#include <sys/uio.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
 
 #include "ptp.h"
+#include "uring.h"
+#include "readpool.h"
+#include "losertree.h"
 
 #define INFINITE_TIMEOUT (-1)
+#define MAX_EPOLL_EVENTS (1024)
+#define OUTPUT_FLUSH_BYTES (1024*1024)      // Write out held lines once we have this many bytes
+#define WEIGHT_QUANTUM_BYTES (64*1024)      // How much the heaviest input may read per round, with --weights
+#define SHARED_IDLE_BUFFERS (64)            // Most shared buffers to keep around unused, with --max-open
+#define MERGE_AHEAD_BYTES (256*1024)        // How far ahead of the merge to read each input, with --merge
 #define MAX(a,b)    ((a) > (b) ? (a) : (b))
+#define MIN(a,b)    ((a) < (b) ? (a) : (b))
+
+
+/* Event loop backends; see run_poll() and run_epoll(). */
+enum backend { BACKEND_POLL, BACKEND_EPOLL };
+
+#ifdef __linux__
+#define DEFAULT_BACKEND BACKEND_EPOLL
+#else
+#define DEFAULT_BACKEND BACKEND_POLL
+#endif
+
+
+/* Whole lines waiting to be written to stdout with a single writev(2).
+ * The iovecs point into the inputs' process_lines buffers, so we must not
+ * read from an input again until its lines have been written: such inputs
+ * are "held" until the next flush_output(). */
+struct output {
+    struct iovec iov[IOV_MAX];
+    int iovcnt;
+    size_t bytes;
+    int max_delay;              // Longest we'll hold lines before writing them, in ms
+    long long deadline;         // When we have to write held lines by, in ms (see now_ms())
+    unsigned int current;       // The input being read from
+    char * held;                // Whether each input has lines in iov
+    unsigned int * heldlist;    // Inputs with lines in iov
+    unsigned int numheld;
+    int timed;                  // Keep track of write_ns, for --stats
+    unsigned long long write_ns;    // Time spent writing
+    process_lines_context * contexts;   // To give shared buffers back once their lines are written
+    readpool * pool;            // Where the pooled inputs' buffers come from (or NULL)...
+    readpool_buffer ** poolbufs;    // ...and those with lines in iov, to give back once they're written
+    unsigned int numpoolbufs;
+    unsigned int numpoolheld;   // How many held inputs are pooled
+};
+
+
+/* For --merge: whole lines read from one input, waiting their turn. */
+struct merge_queue {
+    char * data;
+    size_t start;               // The next line starts here...
+    size_t len;                 // ...and data[start, len) is waiting
+    size_t size;
+    size_t linelen;             // The next line's length, newline and all, or 0 if there's none waiting
+    size_t keystart;            // Where its key starts, from the start of the line...
+    size_t keylen;              // ...and how long it is
+    int done;                   // No more is coming (EOF or error)
+    const struct merge * merge;
+};
+
+/* For --merge: the inputs' queues, and which of their next lines comes first. */
+struct merge {
+    struct merge_queue * queues;        // One per input
+    unsigned int keyfield;              // Compare lines by this field (numbered from 1), or 0 for the whole line
+    char delim;                         // What separates fields
+    loser_tree tree;
+};
+
+
+/* The inputs we're reading, shared by all backends.  Inputs are opened in
+ * order, up to max_open at a time, as earlier ones finish. */
+struct inputs {
+    unsigned int numfiles;              // Number of inputs
+    unsigned int numfiles_remaining;    // Number not yet at EOF or error
+    unsigned int max_open;              // Most to have open at once
+    unsigned int numopen;
+    unsigned int nextopen;              // The next one to open
+    const char ** names;                // Name of each input, as given
+    process_lines_context * contexts;   // One per input
+    int * fds;                          // One per input; -1 until it's opened, and once it's closed
+    enum ptp_reader reader;             // How to buffer each input
+    ptp_buffer_pool * buffers;          // Buffers for the contexts to share, or NULL for each its own
+    size_t maxline;                     // Longest line to buffer whole, or 0 for no limit...
+    ptp_memory_budget * budget;         // ...and how far all the buffers may grow, or NULL for no limit
+    enum ptp_long_line longlines;       // What to do with lines that won't fit
+    struct merge * merge;               // Lines waiting to be merged, with --merge (else NULL)
+    uring * ring;                       // For reading regular files through io_uring, or NULL
+    char * splicing;                    // Whether to splice_lines() each input, or NULL for none
+    uring_lines_context ** urings;      // Context for each input read through io_uring (or NULL), or NULL for none
+    char * pooled;                      // Whether each input is read by out->pool's threads, or NULL for none
+#ifdef __linux__
+    splice_scratch scratch;
+#endif
+    struct output * out;
+    int continue_on_errors;
+    long long * quantum;                // How much each input may read per round, with --weights (else NULL)...
+    long long * deficit;                // ...and how much more it may read this round
+
+    // For --stats:
+    FILE * statsfile;                   // Where to print them, or NULL for no stats
+    process_lines_stats * stats;        // Counts for each input
+    unsigned long long started;         // When we started, by clock_ns()
+    unsigned long long wakeups;         // Times poll(2) or epoll_wait(2) returned
+    unsigned long long wait_ns;         // Time spent in them
+    size_t memory;                      // Size of all inputs' own buffers (see own_memory())
+    size_t peak_memory;
+};
 
 
 void printusage()
@@ -41,149 +153,1476 @@ void printusage()
         "final newline to any file that ends without one.\n"
 
         "  -h,  --help                display this help and exit\n"
-        "  -c,  --continue-on-error   continue processing other FILEs if one has an error\n\n"
+        "  -c,  --continue-on-error   continue processing other FILEs if one has an error\n"
+        "  -b,  --backend=BACKEND     wait for input with BACKEND: 'epoll' (the default\n"
+        "                             on Linux) or 'poll'\n"
+        "  -s,  --splice              when standard output is a pipe, move lines from\n"
+        "                             pipe inputs to it with splice(2), without copying\n"
+        "  -t,  --max-delay=MS        wait up to MS milliseconds to gather lines from\n"
+        "                             more inputs into each write (default 0)\n"
+        "  -m,  --merge               merge FILEs that are each already sorted, like\n"
+        "                             'LC_ALL=C sort -m', comparing lines byte by byte;\n"
+        "                             lines that compare equal come out in FILE order\n"
+        "  -k,  --key=FIELD           with --merge, compare just FIELD of each line\n"
+        "                             (numbered from 1), like sort -k FIELD,FIELD;\n"
+        "                             lines without it have an empty key\n"
+        "  -d,  --delimiter=DELIM     separate fields with DELIM, not TAB\n"
+        "  -w,  --weights=W1,W2,...   when several FILEs have input waiting, share the\n"
+        "                             output among them in proportion to these weights\n"
+        "                             (default 1 each, an equal share)\n"
+        "  -j,  --jobs=N              read regular FILEs with N threads, several at once\n"
+        "                             (default 1: read them one read at a time, in turn\n"
+        "                             with the other FILEs)\n"
+        "  -z,  --decompress          decompress regular FILEs that are gzip (or zstd,\n"
+        "                             if built with it) on --jobs threads (default one\n"
+        "                             per CPU); other FILEs are read as they are\n"
+        "  -r,  --reader=READER       buffer input with READER: 'buffer' (the default),\n"
+        "                             'ring' (a mirrored ring buffer; Linux only), or\n"
+        "                             'uring' (read regular files with several large\n"
+        "                             reads in flight at once via io_uring; Linux only)\n"
+        "       --max-open=N          keep at most N FILEs open at once, opening the\n"
+        "                             rest in order as earlier ones finish, and share\n"
+        "                             a few read buffers among them\n"
+        "       --max-line=SIZE       don't buffer lines longer than SIZE bytes whole;\n"
+        "                             K, M, and G suffixes work.  Buffers that grow to\n"
+        "                             hold a long line shrink back afterwards anyway\n"
+        "       --line-memory=SIZE    let all FILEs' buffers grow by at most SIZE bytes\n"
+        "                             in all, to hold long lines and big reads\n"
+        "       --on-long-line=ACTION with --max-line or --line-memory, what to do with\n"
+        "                             a line that won't fit: 'stream' it through in\n"
+        "                             pieces, still never mixed with other lines (the\n"
+        "                             default); 'truncate' it to what fits; or treat\n"
+        "                             it as an 'error'\n"
+        "       --stats[=FD]          print counts of what was read and how long we\n"
+        "                             waited, as JSON, to FD (default stderr) at exit\n"
+        "                             and whenever we get SIGUSR1\n\n"
 
         "With no FILE, or when FILE is -, read standard input (like cat(1)).\n\n",
         stderr);
 }
 
 
-/** write() buf to stdout. */
-void writelines(char * buf, size_t buflen, __attribute__ ((unused)) void * info)
+/** The time in milliseconds, from some arbitrary starting point. */
+long long now_ms()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+
+/** writev() all held lines to stdout, and release the inputs they came from. */
+void flush_output(struct output * out)
+{
+    struct iovec * iov = out->iov;
+    int iovcnt = out->iovcnt;
+
+    debug(2, "writing %zu bytes in %d iovecs\n", out->bytes, iovcnt);
+    while (iovcnt > 0)
+    {
+        unsigned long long start = out->timed ? clock_ns() : 0;
+        ssize_t written = writev(fileno(stdout), iov, MIN(iovcnt, IOV_MAX));
+        if (out->timed)
+            out->write_ns += clock_ns() - start;
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+        {
+            perror("pcat: writev()");
+            exit(1);
+        }
+        // Skip what got written, in case it wasn't everything.
+        while (iovcnt > 0 && (size_t) written >= iov->iov_len)
+        {
+            written -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (char *) iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+
+    for (unsigned int h = 0 ; h < out->numheld ; h++)
+    {
+        out->held[out->heldlist[h]] = 0;
+        process_lines_release(out->contexts + out->heldlist[h]);
+    }
+    for (unsigned int b = 0 ; b < out->numpoolbufs ; b++)
+        readpool_release(out->pool, out->poolbufs[b]);
+    out->numheld = out->numpoolheld = out->numpoolbufs = 0;
+    out->iovcnt = 0;
+    out->bytes = 0;
+}
+
+
+/** Queue buf to be written to stdout; info is a struct output. */
+void writelines(char * buf, size_t buflen, void * info)
 {
+    struct output * out = info;
     assert(buflen > 0);
     assert(buflen < SSIZE_MAX);
-    if (write(fileno(stdout), buf, buflen) < (ssize_t) buflen)
+
+    if (out->iovcnt + 2 > IOV_MAX)
+        flush_output(out);
+    if (out->iovcnt == 0 && out->max_delay > 0)
+        out->deadline = now_ms() + out->max_delay;
+    if (!out->held[out->current])
     {
-        perror("pcat: write()");
-        exit(1);
+        out->held[out->current] = 1;
+        out->heldlist[out->numheld++] = out->current;
     }
 
+    out->iov[out->iovcnt].iov_base = buf;
+    out->iov[out->iovcnt++].iov_len = buflen;
+    out->bytes += buflen;
+
     // If last line has no newline, write one.
-    if (buf[buflen - 1] != '\n' && write(fileno(stdout), "\n", 1) < 1)
+    if (buf[buflen - 1] != '\n')
     {
-        perror("pcat: write()");
-        exit(1);
+        out->iov[out->iovcnt].iov_base = "\n";
+        out->iov[out->iovcnt++].iov_len = 1;
+        out->bytes += 1;
     }
 }
 
 
-/* Basic idea: open each given file for reading, then loop poll()ing,
- * writing each file's lines to stdout.  Since we may not get a complete
- * line at a time, we have to buffer each file until we see a newline.  */
-int main(int argc, char * argv[])
+/**
+ * process_lines() partial-line callback: write a piece of a line too long to
+ * buffer (see --max-line) straight to stdout, after the lines held so far.
+ * service_input() sees that nothing else is written until the line ends.
+ * info is a struct output.
+ */
+void write_long_line(char * buf, size_t buflen, int end, void * info)
 {
-    int continue_on_errors = 0;
-    unsigned int first_filename_arg = 1;
+    struct output * out = info;
 
-    if (argc == 2 && (strcmp(argv[1], "--help") == 0 || strcmp(argv[1], "-h") == 0))
+    flush_output(out);
+    if (buflen > 0)
     {
-        printusage();
-        exit(0);
+        out->iov[out->iovcnt].iov_base = buf;
+        out->iov[out->iovcnt++].iov_len = buflen;
     }
+    if (end && (buflen == 0 || buf[buflen - 1] != '\n'))
+    {
+        out->iov[out->iovcnt].iov_base = "\n";
+        out->iov[out->iovcnt++].iov_len = 1;
+    }
+    flush_output(out);
+}
 
-    if (argc > 1 && strcmp(argv[1], "-c") == 0)
+
+/** How long we can wait for input before we have to write held lines, as a poll(2) timeout. */
+int output_timeout(struct output * out)
+{
+    if (out->iovcnt == 0)
+        return INFINITE_TIMEOUT;
+    long long remaining = out->deadline - now_ms();
+    return remaining > 0 ? (int) remaining : 0;
+}
+
+
+/** Write out held lines if it's time: we've got a lot, we've waited long enough,
+ * or there's nothing left to read that isn't held. */
+void maybe_flush_output(struct inputs * in)
+{
+    struct output * out = in->out;
+    if (out->iovcnt > 0 && (out->max_delay == 0
+                            || out->bytes >= OUTPUT_FLUSH_BYTES
+                            || out->numheld >= in->numfiles_remaining
+                            || now_ms() >= out->deadline))
+        flush_output(out);
+}
+
+
+/** Read from input f and write any whole lines.  Returns the same as process_lines(). */
+int read_input(struct inputs * in, unsigned int f)
+{
+    int result;
+    in->out->current = f;
+#ifdef __linux__
+    if (in->splicing != NULL && in->splicing[f])
     {
-        continue_on_errors = 1;
-        first_filename_arg = 2;
+        result = splice_lines(in->contexts + f, fileno(stdout), &in->scratch);
+        if (result == PTP_ERR_WRITE)
+        {
+            perror("pcat: splice()");
+            exit(1);
+        }
+        return result;
     }
+#endif
+    if (in->urings != NULL && in->urings[f] != NULL)
+        return uring_lines_process(in->urings[f]);
+    result = process_lines(in->contexts + f);
+    return result;
+}
 
-    unsigned int numfiles = MAX(argc - first_filename_arg, 1);          // If no filenames given, still have stdin
-    process_lines_context contexts[numfiles];                           // C99 variable-length arrays -- ooh-la-la!
-    struct pollfd pollfds[numfiles];
 
-    /* Open files; set up poll structs and buffers. */
-    debug(1, "opening %d file(s)\n", numfiles);
-    for (unsigned int f = 0 ; f < numfiles; f++)
+/**
+ * Deficit round robin, for --weights: each time round, an input that's ready
+ * may read its quantum, in proportion to its weight; the heaviest may read
+ * WEIGHT_QUANTUM_BYTES (about what a pipe holds, so its writer never has to
+ * wait for us).  Reads are no bigger than that, but io_uring reads and the
+ * lightest inputs' smallest reads can be, so an input that reads more goes
+ * into debt, and sits out rounds until it's paid off; meanwhile, the others
+ * get their turns.  Inputs with nothing to read can't save up their turns
+ * for later.
+ *
+ * Returns whether input f may read this round.
+ */
+int take_turn(struct inputs * in, unsigned int f)
+{
+    if (in->quantum == NULL)
+        return 1;
+    in->deficit[f] = MIN(in->deficit[f] + in->quantum[f], in->quantum[f]);
+    return in->deficit[f] > 0;
+}
+
+
+/** Charge input f for what it just read, for --weights. */
+void charge_turn(struct inputs * in, unsigned int f)
+{
+    if (in->quantum == NULL)
+        return;
+    if (in->urings != NULL && in->urings[f] != NULL)
+        in->deficit[f] -= in->urings[f]->lastread;
+    else
+        in->deficit[f] -= in->contexts[f].lastread;
+}
+
+
+/** Parse --weights, a comma-separated list of at most numfiles positive numbers
+ * (the rest default to 1), into each input's quantum.  Returns nonzero if invalid. */
+int parse_weights(const char * list, long long * quantum, unsigned int numfiles)
+{
+    double * weights = calloc(numfiles, sizeof (double));
+    double heaviest = 0;
+    int invalid = 0;
+
+    if (weights == NULL)
+        return 1;
+    for (unsigned int f = 0 ; f < numfiles ; f++)
+        weights[f] = 1;
+    for (unsigned int f = 0 ; *list != '\0' && !invalid ; f++)
     {
-        const char * filename = argc > 1 ? argv[first_filename_arg + f] : "-";
-        if (strcmp(filename, "-") == 0)
-            pollfds[f].fd = fileno(stdin);
-        else
-            pollfds[f].fd = open(filename, O_RDONLY);
-        debug(1, "open(\"%s\") as fd %d\n", filename, pollfds[f].fd);
-        pollfds[f].events = POLLIN;
-        if (pollfds[f].fd < 0)
+        char * end;
+        double weight = strtod(list, &end);
+        invalid = f == numfiles || end == list || !(weight > 0 && weight < 1e9) || (*end != ',' && *end != '\0');
+        weights[f] = weight;
+        list = *end == ',' ? end + 1 : end;
+    }
+    for (unsigned int f = 0 ; f < numfiles ; f++)
+        heaviest = MAX(heaviest, weights[f]);
+    for (unsigned int f = 0 ; f < numfiles ; f++)
+        quantum[f] = MAX((long long) (WEIGHT_QUANTUM_BYTES * weights[f] / heaviest), 1);
+    free(weights);
+    return invalid;
+}
+
+
+/** The size of input f's own buffer, for --stats.  Shared buffers are counted in in->buffers. */
+size_t own_memory(struct inputs * in, unsigned int f)
+{
+    return in->contexts[f].pool != NULL ? 0 : in->stats[f].bufsize;
+}
+
+
+/** Note how much memory all the inputs' buffers take now, for --stats. */
+void note_memory(struct inputs * in)
+{
+    in->peak_memory = MAX(in->peak_memory, in->memory + (in->buffers != NULL ? in->buffers->allocated : 0));
+}
+
+
+/**
+ * Input f has started streaming a long line to stdout (see write_long_line()):
+ * read the rest of it before anything else, waiting for it if need be, so no
+ * other input's lines end up in the middle of it.  result is what the last
+ * read returned; returns what the last one returns.
+ */
+int finish_long_line(struct inputs * in, unsigned int f, int result)
+{
+    struct pollfd pollfd;
+
+    pollfd.fd = in->fds[f];
+    pollfd.events = POLLIN;
+    while ((result == 0 || result == PTP_AGAIN) && in->contexts[f].streaming)
+    {
+        if (result == PTP_AGAIN && poll(&pollfd, 1, INFINITE_TIMEOUT) < 0 && errno != EINTR)
         {
-            fprintf(stderr, "pcat: Error opening '%s'", filename);
-            perror("");
+            perror("pcat: poll()");
             exit(1);
         }
+        result = read_input(in, f);
+    }
+    return result;
+}
+
+
+/** read_input(), charging for it with --weights, and keeping track of the inputs' buffer memory, with --stats. */
+int service_input(struct inputs * in, unsigned int f)
+{
+    int result;
+
+    if (in->statsfile == NULL)
+    {
+        result = read_input(in, f);
+    }
+    else
+    {
+        size_t bufsize = own_memory(in, f);
+        result = read_input(in, f);
+        in->memory += own_memory(in, f) - bufsize;
+        note_memory(in);
+    }
+    if (in->contexts[f].streaming)
+        result = finish_long_line(in, f, result);
+    charge_turn(in, f);
+    return result;
+}
+
+
+/** Print stats as one line of JSON; final says whether we're done. */
+void print_stats(struct inputs * in, int final)
+{
+    FILE * out = in->statsfile;
+    unsigned long long read_ns = in->wait_ns;
+
+    for (unsigned int f = 0 ; f < in->numfiles ; f++)
+        read_ns += in->stats[f].read_ns;
+    fprintf(out, "{\"program\": \"pcat\", \"final\": %s, \"seconds\": %.6f, \"wakeups\": %llu, "
+            "\"read_wait_seconds\": %.6f, \"write_wait_seconds\": %.6f, \"peak_buffer_bytes\": %zu, \"inputs\": [",
+            final ? "true" : "false", (clock_ns() - in->started) / 1e9, in->wakeups,
+            read_ns / 1e9, in->out->write_ns / 1e9, in->peak_memory);
+    for (unsigned int f = 0 ; f < in->numfiles ; f++)
+    {
+        fputs(f > 0 ? ", {" : "{", out);
+        print_stats_json(out, in->names[f], in->stats + f, in->splicing == NULL || !in->splicing[f]);
+        putc('}', out);
+    }
+    fputs("]}\n", out);
+    fflush(out);
+}
+
+
+/** Print stats if we've been asked to (by SIGUSR1). */
+void maybe_print_stats(struct inputs * in)
+{
+    if (stats_requested && in->statsfile != NULL)
+    {
+        stats_requested = 0;
+        print_stats(in, 0);
+    }
+}
+
+
+/** Free the buffers for input f. */
+void cleanup_input(struct inputs * in, unsigned int f)
+{
+    if (in->pooled != NULL && in->pooled[f])
+        return;                     // The pool's buffers aren't any one input's
+    if (in->urings != NULL && in->urings[f] != NULL)
+    {
+        uring_lines_cleanup(in->urings[f]);
+        free(in->urings[f]);
+        in->urings[f] = NULL;
+    }
+    else
+        process_lines_cleanup(in->contexts + f);
+}
 
-        if (process_lines_init(contexts + f, pollfds[f].fd, writelines, NULL) != 0)
+
+/** Find where the next line in q is, and its key. */
+void next_line(struct merge_queue * q)
+{
+    const struct merge * merge = q->merge;
+    char * line = q->data + q->start;
+
+    if (q->start == q->len)
+    {
+        q->linelen = 0;
+        return;
+    }
+    q->linelen = (char *) memchr(line, '\n', q->len - q->start) - line + 1;      // The queue only has whole lines
+    q->keystart = 0;
+    q->keylen = q->linelen - 1;
+    for (unsigned int field = 1 ; field < merge->keyfield ; field++)
+    {
+        char * delim = memchr(line + q->keystart, merge->delim, q->keylen);
+        if (delim == NULL)
+        {
+            q->keystart += q->keylen;       // No such field: empty
+            q->keylen = 0;
+            break;
+        }
+        q->keylen -= delim + 1 - (line + q->keystart);
+        q->keystart = delim + 1 - line;
+    }
+    if (merge->keyfield > 0 && q->keylen > 0)
+    {
+        char * delim = memchr(line + q->keystart, merge->delim, q->keylen);
+        if (delim != NULL)
+            q->keylen = delim - (line + q->keystart);
+    }
+}
+
+
+/** Add whole lines read from an input to its merge queue; info is the struct merge_queue. */
+void queue_lines(char * buf, size_t buflen, void * info)
+{
+    struct merge_queue * q = info;
+    int terminated = buf[buflen - 1] == '\n';
+    size_t needed = buflen + !terminated;       // Add a final newline, like writelines()
+
+    if (q->len + needed > q->size && q->start > 0)
+    {
+        memmove(q->data, q->data + q->start, q->len - q->start);
+        q->len -= q->start;
+        q->start = 0;
+    }
+    if (q->len + needed > q->size)
+    {
+        size_t newsize = q->size > 0 ? q->size : MERGE_AHEAD_BYTES;
+        while (newsize < q->len + needed)
+            newsize *= 2;
+        char * newdata = realloc(q->data, newsize);
+        if (newdata == NULL)
+        {
+            perror("pcat: Error allocating memory");
+            exit(1);
+        }
+        q->data = newdata;
+        q->size = newsize;
+    }
+    memcpy(q->data + q->len, buf, buflen);
+    q->len += buflen;
+    if (!terminated)
+        q->data[q->len++] = '\n';
+    if (q->linelen == 0)
+        next_line(q);
+}
+
+
+/** Loser tree comparison: whether input a's next line comes before input b's.
+ * Inputs that have run out come last; ties go to the earlier input. */
+int merge_less(unsigned int a, unsigned int b, void * info)
+{
+    const struct merge * merge = info;
+    const struct merge_queue * qa = merge->queues + a;
+    const struct merge_queue * qb = merge->queues + b;
+
+    if (qa->linelen == 0 || qb->linelen == 0)
+        return qb->linelen == 0 && (qa->linelen != 0 || a < b);
+    int cmp = memcmp(qa->data + qa->start + qa->keystart, qb->data + qb->start + qb->keystart, MIN(qa->keylen, qb->keylen));
+    if (cmp == 0)
+        cmp = (qa->keylen > qb->keylen) - (qa->keylen < qb->keylen);
+    return cmp < 0 || (cmp == 0 && a < b);
+}
+
+
+/** Queue a merged line for output.  Runs of lines from one input are
+ * contiguous in its queue, so they go out in one iovec. */
+void merge_line(struct output * out, char * line, size_t len)
+{
+    struct iovec * last = out->iovcnt > 0 ? out->iov + out->iovcnt - 1 : NULL;
+    if (last != NULL && (char *) last->iov_base + last->iov_len == line)
+    {
+        last->iov_len += len;
+        out->bytes += len;
+    }
+    else
+        writelines(line, len, out);
+    if (out->bytes >= OUTPUT_FLUSH_BYTES)
+        flush_output(out);
+}
+
+
+/** Open input f and set up its buffers. */
+void open_input(struct inputs * in, unsigned int f)
+{
+    const char * filename = in->names[f];
+    struct output * out = in->out;
+    struct stat filestat;
+    int * fds = in->fds;
+    // Lines go straight to the output, or wait in a queue to be merged.
+    void (*process)(char * buf, size_t buflen, void * info) = in->merge != NULL ? queue_lines : writelines;
+    void * info = in->merge != NULL ? (void *) (in->merge->queues + f) : (void *) out;
+
+    if (strcmp(filename, "-") == 0)
+        fds[f] = fileno(stdin);
+    else
+        fds[f] = open(filename, O_RDONLY);
+    debug(1, "open(\"%s\") as fd %d\n", filename, fds[f]);
+    if (fds[f] < 0)
+    {
+        fprintf(stderr, "pcat: Error opening '%s'", filename);
+        perror("");
+        exit(1);
+    }
+    in->numopen++;
+
+#ifdef __linux__
+    if (in->splicing != NULL)
+        in->splicing[f] = fstat(fds[f], &filestat) == 0 && S_ISFIFO(filestat.st_mode);
+#endif
+    if (out->pool != NULL && fstat(fds[f], &filestat) == 0 && S_ISREG(filestat.st_mode))
+    {
+        if (readpool_add(out->pool, f, fds[f]) != 0)
+        {
+            perror("pcat: Error initializing processing context");
+            exit(1);
+        }
+        in->pooled[f] = 1;
+        return;
+    }
+    if (in->ring != NULL && fstat(fds[f], &filestat) == 0 && S_ISREG(filestat.st_mode))
+    {
+        in->urings[f] = malloc(sizeof (uring_lines_context));
+        if (in->urings[f] == NULL || uring_lines_init(in->urings[f], in->ring, fds[f], process, info) != 0)
         {
             perror("pcat: Error initializing processing context");
             exit(1);
         }
+        if (in->statsfile != NULL)
+        {
+            uring_lines_count(in->urings[f], in->stats + f);
+            in->memory += own_memory(in, f);
+            note_memory(in);
+        }
+        return;
     }
 
-    /* Loop polling files, writing data to stdout, until we've finished reading them all. */
-    unsigned int numfiles_remaining = numfiles;
-    while (numfiles_remaining > 0)
+    // splice_lines() keeps its partial lines in an ordinary buffer of its own.
+    int splicing = in->splicing != NULL && in->splicing[f];
+    int result;
+    if (in->buffers != NULL && in->reader == PTP_READER_BUFFER && !splicing)
+        result = process_lines_init_shared(in->contexts + f, in->buffers, fds[f], process, info);
+    else
+        result = process_lines_init_reader(in->contexts + f, splicing ? PTP_READER_BUFFER : in->reader, fds[f], process, info);
+    if (result != 0)
     {
-        debug(2, "polling %d file(s)\n", numfiles_remaining);
-        int numready = poll(pollfds, numfiles, INFINITE_TIMEOUT);
-        debug(2, "poll gave %d ready file(s)\n", numready);
+        perror("pcat: Error initializing processing context");
+        exit(1);
+    }
+    // Trickles get small reads, firehoses big ones -- but no bigger than their turn, with --weights.
+    size_t maxread = in->quantum != NULL ? (size_t) MAX(in->quantum[f], READ_SIZE_MIN_BYTES) : READ_SIZE_MAX_BYTES;
+    if (in->contexts[f].pool != NULL)
+        maxread = MIN(maxread, in->buffers->bufsize);
+    process_lines_adapt(in->contexts + f, READ_SIZE_MIN_BYTES, maxread);
+    if (in->maxline > 0 || in->budget != NULL)
+    {
+        if (in->longlines == PTP_LONG_LINE_STREAM)
+            process_lines_stream_long_lines(in->contexts + f, in->maxline, write_long_line);
+        process_lines_limit(in->contexts + f, in->maxline, in->longlines, in->budget);
+    }
+    if (in->statsfile != NULL)
+    {
+        process_lines_count(in->contexts + f, in->stats + f);
+        in->memory += own_memory(in, f);
+        note_memory(in);
+    }
+}
+
+
+/** Open more inputs, as long as there are more, and room for them. */
+void open_inputs(struct inputs * in)
+{
+    while (in->numopen < in->max_open && in->nextopen < in->numfiles)
+        open_input(in, in->nextopen++);
+}
 
-        if (numready == 0)
+
+/** We're done with input f, either because of EOF or an error (result > 0, with errno saying why):
+ * clean up and close it, and open the next, if there is one.  Errors stop us unless -c. */
+void finish_input(struct inputs * in, unsigned int f, int result)
+{
+    int error = errno;
+    in->numfiles_remaining--;
+    if (in->out->held[f])           // Its buffer is about to go away
+        flush_output(in->out);
+    debug(2, "cleaning up fd %d: got %d from process_lines\n", in->fds[f], result);
+    cleanup_input(in, f);
+    if (in->statsfile != NULL)
+        in->memory -= own_memory(in, f);
+    if (result > 0)             // Error
+    {
+        // Say which file, and why: with --decompress, it may be corrupt rather than unreadable.
+        if (result == PTP_ERR_LONG_LINE)
+            fprintf(stderr, "pcat: Line too long in '%s'.\n", in->names[f]);
+        else
+            fprintf(stderr, "pcat: Error reading '%s': %s.\n", in->names[f], strerror(error));
+        if (!in->continue_on_errors)
         {
-            fprintf(stderr, "pcat: poll timed out.\n");
+            flush_output(in->out);
             exit(1);
         }
-        else if (numready < 0)
+    }
+    debug(2, "closing fd %d\n", in->fds[f]);
+    if (in->fds[f] != fileno(stdin) && close(in->fds[f]) != 0)     // Leave stdin for any later '-' to find at EOF
+    {
+        perror("pcat: close()");
+        if (!in->continue_on_errors)
+            exit(1);
+    }
+    in->fds[f] = -1;
+    in->numopen--;
+    open_inputs(in);
+}
+
+
+/** Write the lines from whatever buffers the pool's threads have read, and
+ * finish inputs they've read to the end. */
+void take_pool_buffers(struct inputs * in)
+{
+    struct output * out = in->out;
+    readpool_buffer * bufs[MAX_EPOLL_EVENTS];
+    unsigned int numbufs;
+
+    do
+    {
+        numbufs = readpool_take(out->pool, bufs, MAX_EPOLL_EVENTS);
+        debug(2, "took %u buffer(s) from the reader pool\n", numbufs);
+        for (unsigned int b = 0 ; b < numbufs ; b++)
+        {
+            readpool_buffer * buf = bufs[b];
+            unsigned int f = buf->input;
+            if (in->statsfile != NULL)
+            {
+                in->stats[f].reads += buf->counts.reads;
+                in->stats[f].bytes += buf->counts.bytes;
+                in->stats[f].lines += buf->counts.lines;
+                in->stats[f].grows += buf->counts.grows;
+                in->stats[f].read_ns += buf->counts.read_ns;
+            }
+            if (buf->len > 0)
+            {
+                if (!out->held[f])
+                    out->numpoolheld++;
+                out->current = f;
+                writelines(buf->data, buf->len, out);
+                out->poolbufs[out->numpoolbufs++] = buf;
+            }
+            else
+                readpool_release(out->pool, buf);
+            if (buf->end && buf->error != 0)
+            {
+                errno = buf->error;
+                finish_input(in, f, PTP_ERR_READ);
+            }
+            else if (buf->end)
+                finish_input(in, f, PTP_EOF);
+        }
+    } while (numbufs == MAX_EPOLL_EVENTS);
+}
+
+
+/* Merge sorted inputs (--merge).  We can only write a line once every input
+ * has a line waiting to compare it to (or has finished), so we read ahead on
+ * each input, up to MERGE_AHEAD_BYTES, whenever it's ready, and merge until
+ * some input's queue runs dry; only then do we wait for input.  The queues'
+ * lines are only moved when they're read into, so we write out what we've
+ * merged before reading any more. */
+void run_merge(struct inputs * in)
+{
+    struct merge * merge = in->merge;
+    int built = 0;                      // Whether we've started merging
+    int stalled = -1;                   // The input whose queue ran dry, to wait for
+
+    struct pollfd * pollfds = calloc(in->numfiles, sizeof (struct pollfd));
+    unsigned int * polled = calloc(in->numfiles, sizeof (unsigned int));        // Which input each pollfd is for
+    if (pollfds == NULL || polled == NULL)
+    {
+        perror("pcat: Error allocating memory");
+        exit(1);
+    }
+
+    for (;;)
+    {
+        flush_output(in->out);
+
+        // Wait for input only if we can't merge without it.
+        nfds_t numpolled = 0;
+        int waiting = stalled >= 0;
+        for (unsigned int f = 0 ; f < in->numfiles ; f++)
+        {
+            struct merge_queue * q = merge->queues + f;
+            if (q->done)
+                continue;
+            if (!built && q->linelen == 0)
+                waiting = 1;
+            if (q->len - q->start < MERGE_AHEAD_BYTES)
+            {
+                pollfds[numpolled].fd = in->fds[f];
+                pollfds[numpolled].events = POLLIN;
+                polled[numpolled++] = f;
+            }
+        }
+        if (numpolled > 0)
+        {
+            maybe_print_stats(in);
+            unsigned long long start = in->statsfile != NULL ? clock_ns() : 0;
+            int numready = poll(pollfds, numpolled, waiting ? INFINITE_TIMEOUT : 0);
+            if (in->statsfile != NULL)
+            {
+                in->wait_ns += clock_ns() - start;
+                in->wakeups++;
+            }
+            if (numready < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                perror("pcat: poll");
+                exit(1);
+            }
+            for (nfds_t p = 0 ; p < numpolled ; p++)
+            {
+                unsigned int f = polled[p];
+                int result = 0;
+                if (pollfds[p].revents & (POLLERR | POLLNVAL))
+                {
+                    fprintf(stderr, "pcat: %s%spolling fd %d.\n",
+                            pollfds[p].revents & POLLERR ? "POLLERR " : "",
+                            pollfds[p].revents & POLLNVAL ? "POLLNVAL " : "",
+                            pollfds[p].fd);
+                    if (!in->continue_on_errors)
+                        exit(1);
+                    result = PTP_EOF;       // Already reported
+                }
+                else if (pollfds[p].revents & (POLLIN | POLLHUP))
+                    result = service_input(in, f);
+                if (result != 0 && result != PTP_AGAIN)        // EOF or error
+                {
+                    merge->queues[f].done = 1;
+                    finish_input(in, f, result);
+                }
+            }
+        }
+
+        if (!built)
+        {
+            unsigned int f = 0;
+            while (f < in->numfiles && (merge->queues[f].linelen > 0 || merge->queues[f].done))
+                f++;
+            if (f < in->numfiles)           // Still waiting for its first line
+                continue;
+            loser_tree_build(&merge->tree);
+            built = 1;
+        }
+        if (stalled >= 0)
+        {
+            if (merge->queues[stalled].linelen == 0 && !merge->queues[stalled].done)
+                continue;
+            loser_tree_replay(&merge->tree, stalled);
+            stalled = -1;
+        }
+
+        // Merge until some input runs dry, or they all have.
+        for (;;)
+        {
+            unsigned int f = loser_tree_winner(&merge->tree);
+            struct merge_queue * q = merge->queues + f;
+            if (q->linelen == 0)            // Only if they've all finished
+            {
+                flush_output(in->out);
+                free(polled);
+                free(pollfds);
+                return;
+            }
+            in->out->current = f;
+            merge_line(in->out, q->data + q->start, q->linelen);
+            q->start += q->linelen;
+            next_line(q);
+            if (q->linelen == 0 && !q->done)
+            {
+                stalled = f;
+                break;
+            }
+            loser_tree_replay(&merge->tree, f);
+        }
+    }
+}
+
+
+/* Wait for input with poll(2).  Each wakeup scans the whole pollfd array,
+ * so this is O(open inputs) per wakeup, but it works everywhere.  We start the
+ * scan one input further along each time, so no input always goes first. */
+void run_poll(struct inputs * in)
+{
+    unsigned int first = 0;
+    unsigned int numpolled = 0, numseen = 0;    // Inputs in polled[], and how many have been opened so far
+
+    // One for each input that can be open at once, plus one for the reader pool, if there is one.
+    struct pollfd * pollfds = calloc(in->max_open + 1, sizeof (struct pollfd));
+    unsigned int * polled = calloc(in->max_open, sizeof (unsigned int));      // Which input each pollfd is for
+    if (pollfds == NULL || polled == NULL)
+    {
+        perror("pcat: Error allocating memory");
+        exit(1);
+    }
+
+    /* Loop polling files, writing data to stdout, until we've finished reading them all. */
+    while (in->numfiles_remaining > 0)
+    {
+        // Forget inputs that have been closed, and add ones that have been opened since.
+        unsigned int kept = 0;
+        for (unsigned int p = 0 ; p < numpolled ; p++)
+            if (in->fds[polled[p]] >= 0)
+                polled[kept++] = polled[p];
+        numpolled = kept;
+        for ( ; numseen < in->nextopen ; numseen++)
+            if (in->pooled == NULL || !in->pooled[numseen])
+                polled[numpolled++] = numseen;
+        // Don't poll inputs whose lines are waiting to be written (poll ignores negative fds).
+        for (unsigned int p = 0 ; p < numpolled ; p++)
+        {
+            pollfds[p].fd = in->out->held[polled[p]] ? -1 : in->fds[polled[p]];
+            pollfds[p].events = POLLIN;
+        }
+        if (in->out->pool != NULL)
+        {
+            pollfds[numpolled].fd = readpool_fd(in->out->pool);
+            pollfds[numpolled].events = POLLIN;
+        }
+
+        maybe_print_stats(in);
+        debug(2, "polling %d file(s)\n", numpolled);
+        unsigned long long start = in->statsfile != NULL ? clock_ns() : 0;
+        int numready = poll(pollfds, numpolled + (in->out->pool != NULL), output_timeout(in->out));
+        debug(2, "poll gave %d ready file(s)\n", numready);
+        if (in->statsfile != NULL)
+        {
+            in->wait_ns += clock_ns() - start;
+            in->wakeups++;
+        }
+
+        if (numready < 0)
         {
+            if (errno == EINTR)
+                continue;
             perror("pcat: poll");
             exit(1);
         }
+        if (in->out->pool != NULL && pollfds[numpolled].revents != 0)
+            take_pool_buffers(in);
 
         // Loop reading ready files, writing input to stdout.
-        for (unsigned int f = 0 ; f < numfiles ; f++)
+        for (unsigned int n = 0 ; n < numpolled ; n++)
         {
-            if (!pollfds[f].events)        // If we're not listening for this file, skip it.
-                continue;
-            if (pollfds[f].revents & (POLLERR | POLLNVAL))        // Error
+            unsigned int p = (first + n) % numpolled;
+            unsigned int f = polled[p];
+            if (pollfds[p].revents & (POLLERR | POLLNVAL))        // Error
             {
-                pollfds[f].events = 0;
-                numfiles_remaining--;
                 fprintf(stderr, "pcat: %s%s%spolling fd %d.\n",
-                		pollfds[f].revents & POLLERR ? "POLLERR " : "",
-                		pollfds[f].revents & POLLHUP ? "POLLHUP " : "",
-                		pollfds[f].revents & POLLNVAL ? "POLLNVAL " : "",
-            			pollfds[f].fd);
-                process_lines_cleanup(contexts + f);
-                if (!continue_on_errors)
+                		pollfds[p].revents & POLLERR ? "POLLERR " : "",
+                		pollfds[p].revents & POLLHUP ? "POLLHUP " : "",
+                		pollfds[p].revents & POLLNVAL ? "POLLNVAL " : "",
+            			pollfds[p].fd);
+                if (!in->continue_on_errors)
                     exit(1);
+                finish_input(in, f, PTP_EOF);       // Already reported
             }
             // On Linux and Solaris, pipes give POLLHUP instead of POLLIN on EOF, so we have to check for both.
-            else if (pollfds[f].revents & (POLLIN | POLLHUP))        // Data or EOF available
+            else if (pollfds[p].revents & (POLLIN | POLLHUP))        // Data or EOF available
             {
-                debug(3, "processing data from fd %d\n", pollfds[f].fd);
-                int result = process_lines(contexts + f);
-                if (result != 0)        	// EOF or Error
+                if (!take_turn(in, f))
+                    continue;
+                debug(3, "processing data from fd %d\n", pollfds[p].fd);
+                int result = service_input(in, f);
+                if (result != 0 && result != PTP_AGAIN)        	// EOF or Error
+                    finish_input(in, f, result);
+            }
+            else if (pollfds[p].revents != 0)
+            {
+                fprintf(stderr, "pcat: Unknown result from poll on fd %d: %d\n", pollfds[p].fd, pollfds[p].revents);
+                exit(1);
+            }
+        }
+        first = numpolled > 0 ? (first + 1) % numpolled : 0;
+        maybe_flush_output(in);
+    }
+
+    free(polled);
+    free(pollfds);
+}
+
+
+#ifdef __linux__
+/* The inputs run_epoll() has made non-blocking, and their original fcntl()
+ * flags (-1 once restored), so that every exit puts them back: stdin may be
+ * shared with the shell or another program, which won't expect O_NONBLOCK. */
+static const int * nonblocking_fds;
+static int * nonblocking_flags;
+static unsigned int num_nonblocking;
+
+/* Restore the flags of inputs we've made non-blocking.  Called at exit. */
+static void restore_blocking(void)
+{
+    for (unsigned int f = 0 ; f < num_nonblocking ; f++)
+        if (nonblocking_flags[f] >= 0 && nonblocking_fds[f] >= 0)
+            fcntl(nonblocking_fds[f], F_SETFL, nonblocking_flags[f]);
+    num_nonblocking = 0;
+}
+
+
+/* Wait for input with edge-triggered epoll(7).  We only ever look at inputs
+ * that are ready, so the cost of a wakeup doesn't depend on how many inputs
+ * are idle.
+ *
+ * Since epoll is edge-triggered, an input stays ready until a read on it
+ * returns EAGAIN; we keep such inputs on a FIFO "ready" queue and service each
+ * one with a single read per round, so a busy input can't starve the others.
+ * Inputs are made non-blocking so that read() can tell us when they're dry.
+ * Regular files can't be added to an epoll set (they're always "ready"),
+ * so they simply stay on the ready queue until EOF.  Finished inputs are
+ * removed from the interest set when they're closed.  An fd given twice (as
+ * in 'pcat - -') is read only the first time, like cat(1) would: the second
+ * finds it at EOF. */
+void run_epoll(struct inputs * in)
+{
+    const unsigned int numfiles = in->numfiles;
+    const unsigned int queuesize = in->max_open;                         // Only open inputs are ever queued
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    unsigned int * ready = calloc(queuesize, sizeof (unsigned int));     // Circular queue of ready input numbers
+    char * queued = calloc(numfiles, 1);                                 // Whether each input is in ready[]
+    int * origflags = malloc(numfiles * sizeof (int));                   // fcntl() flags to restore on close
+    unsigned int readyhead = 0, numqueued = 0;
+    unsigned int numseen = 0;                                            // Inputs opened (and added) so far
+
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0)
+    {
+        perror("pcat: epoll_create1");
+        exit(1);
+    }
+    if (ready == NULL || queued == NULL || origflags == NULL)
+    {
+        perror("pcat: Error allocating memory");
+        exit(1);
+    }
+    for (unsigned int f = 0 ; f < numfiles ; f++)
+        origflags[f] = -1;
+    nonblocking_fds = in->fds;
+    nonblocking_flags = origflags;
+    num_nonblocking = numfiles;
+    atexit(restore_blocking);
+
+    if (in->out->pool != NULL)
+    {
+        // Level-triggered: readpool_take() clears it.
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof ev);
+        ev.events = EPOLLIN;
+        ev.data.u32 = numfiles;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, readpool_fd(in->out->pool), &ev) < 0)
+        {
+            perror("pcat: epoll_ctl");
+            exit(1);
+        }
+    }
+
+    while (in->numfiles_remaining > 0)
+    {
+        // Add inputs that have been opened since last time.
+        for ( ; numseen < in->nextopen ; numseen++)
+        {
+            unsigned int f = numseen;
+            struct epoll_event ev;
+            if (in->pooled != NULL && in->pooled[f])
+                continue;
+            memset(&ev, 0, sizeof ev);
+            ev.events = EPOLLIN | EPOLLET;
+            ev.data.u32 = f;
+            if (epoll_ctl(epfd, EPOLL_CTL_ADD, in->fds[f], &ev) < 0 && errno != EPERM)
+            {
+                if (errno == EEXIST)        // Another input's fd: finish with a copy, leaving it open
                 {
-                    pollfds[f].events = 0;
-                    numfiles_remaining--;
-                    debug(2, "cleaning up fd %d: got %d from process_lines\n", pollfds[f].fd, result);
-                    process_lines_cleanup(contexts + f);
-                    if (result > 0)        	// Error
-                    {
-                        fprintf(stderr, "pcat: Error reading from fd %d.\n", pollfds[f].fd);
-                    }
-                    debug(2, "closing fd %d\n", pollfds[f].fd);
-                    if (close(pollfds[f].fd) != 0)
-                    {
-                        perror("pcat: close()");
-                        if (!continue_on_errors)
-                            exit(1);
-                    }
+                    in->fds[f] = dup(in->fds[f]);
+                    finish_input(in, f, in->fds[f] < 0 ? PTP_ERR_READ : PTP_EOF);
+                    continue;
                 }
+                perror("pcat: epoll_ctl");
+                exit(1);
             }
-            else if (pollfds[f].revents != 0)
+            int flags = fcntl(in->fds[f], F_GETFL);
+            if (flags < 0 || fcntl(in->fds[f], F_SETFL, flags | O_NONBLOCK) < 0)
             {
-                fprintf(stderr, "pcat: Unknown result from poll on fd %d: %d\n", f, pollfds[f].revents);
+                perror("pcat: fcntl");
                 exit(1);
             }
+            origflags[f] = flags;
+            // Regular files (EPERM) are always ready; pipes may have been written to before we registered them.
+            ready[(readyhead + numqueued++) % queuesize] = f;
+            queued[f] = 1;
+        }
+
+        // Don't block if we already have work to do; just pick up any newly-ready inputs.
+        // Held inputs are always queued (unless pooled), but can't be read until their lines are written.
+        int timeout = numqueued > in->out->numheld - in->out->numpoolheld ? 0 : output_timeout(in->out);
+        maybe_print_stats(in);
+        debug(2, "epoll_wait with %u queued, %u remaining\n", numqueued, in->numfiles_remaining);
+        unsigned long long start = in->statsfile != NULL ? clock_ns() : 0;
+        int numready = epoll_wait(epfd, events, MAX_EPOLL_EVENTS, timeout);
+        if (in->statsfile != NULL)
+        {
+            in->wait_ns += clock_ns() - start;
+            in->wakeups++;
+        }
+        if (numready < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("pcat: epoll_wait");
+            exit(1);
+        }
+        debug(2, "epoll gave %d ready file(s)\n", numready);
+        for (int e = 0 ; e < numready ; e++)
+        {
+            unsigned int f = events[e].data.u32;
+            if (f == numfiles)
+                take_pool_buffers(in);
+            else if (!queued[f])
+            {
+                ready[(readyhead + numqueued++) % queuesize] = f;
+                queued[f] = 1;
+            }
         }
+
+        // Service each input that was queued at the start of this round exactly once.
+        for (unsigned int n = numqueued ; n > 0 ; n--)
+        {
+            unsigned int f = ready[readyhead];
+            readyhead = (readyhead + 1) % queuesize;
+            numqueued--;
+            if (in->out->held[f] || !take_turn(in, f))
+            {
+                ready[(readyhead + numqueued++) % queuesize] = f;
+                continue;
+            }
+
+            debug(3, "processing data from fd %d\n", in->fds[f]);
+            int result = service_input(in, f);
+            if (result == 0)                // Maybe more where that came from
+            {
+                ready[(readyhead + numqueued++) % queuesize] = f;
+            }
+            else if (result == PTP_AGAIN)   // Dry; wait for the next edge
+            {
+                queued[f] = 0;
+            }
+            else                            // EOF or error
+            {
+                int error = errno;
+                queued[f] = 0;
+                epoll_ctl(epfd, EPOLL_CTL_DEL, in->fds[f], NULL);      // Fails harmlessly for regular files
+                fcntl(in->fds[f], F_SETFL, origflags[f]);
+                origflags[f] = -1;
+                errno = error;
+                finish_input(in, f, result);
+            }
+        }
+        maybe_flush_output(in);
+    }
+
+    close(epfd);
+    num_nonblocking = 0;
+    free(origflags);
+    free(queued);
+    free(ready);
+}
+#endif
+
+
+/* Basic idea: open each given file for reading, then loop poll()ing,
+ * writing each file's lines to stdout.  Since we may not get a complete
+ * line at a time, we have to buffer each file until we see a newline.  */
+int main(int argc, char * argv[])
+{
+    int continue_on_errors = 0;
+    int use_splice = 0;
+    int max_delay = 0;
+    unsigned int delay;
+    enum ptp_reader reader = PTP_READER_BUFFER;
+    int use_uring = 0;
+    enum backend backend = DEFAULT_BACKEND;
+    FILE * statsfile = NULL;
+    const char * weightlist = NULL;
+    unsigned int numthreads = 1;
+    int jobsgiven = 0;
+    int decompress = 0;
+    unsigned int max_open = 0;
+    int merge = 0;
+    unsigned int keyfield = 0;
+    char delim = '\t';
+    size_t maxline = 0;
+    size_t linememory = 0;
+    enum ptp_long_line longlines = PTP_LONG_LINE_STREAM;
+    const char * longlinearg = NULL;
+    static const struct option longopts[] = {
+        {"help",              no_argument,       NULL, 'h'},
+        {"continue-on-error", no_argument,       NULL, 'c'},
+        {"backend",           required_argument, NULL, 'b'},
+        {"splice",            no_argument,       NULL, 's'},
+        {"max-delay",         required_argument, NULL, 't'},
+        {"reader",            required_argument, NULL, 'r'},
+        {"weights",           required_argument, NULL, 'w'},
+        {"jobs",              required_argument, NULL, 'j'},
+        {"decompress",        no_argument,       NULL, 'z'},
+        {"stats",             optional_argument, NULL, 'S'},
+        {"max-open",          required_argument, NULL, 'M'},
+        {"merge",             no_argument,       NULL, 'm'},
+        {"key",               required_argument, NULL, 'k'},
+        {"delimiter",         required_argument, NULL, 'd'},
+        {"max-line",          required_argument, NULL, 'L'},
+        {"line-memory",       required_argument, NULL, 'G'},
+        {"on-long-line",      required_argument, NULL, 'O'},
+        {NULL, 0, NULL, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "hcb:st:r:w:j:zmk:d:", longopts, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 'h':
+            printusage();
+            exit(0);
+        case 'c':
+            continue_on_errors = 1;
+            break;
+        case 'b':
+            if (strcmp(optarg, "poll") == 0)
+                backend = BACKEND_POLL;
+#ifdef __linux__
+            else if (strcmp(optarg, "epoll") == 0)
+                backend = BACKEND_EPOLL;
+#endif
+            else
+            {
+                fprintf(stderr, "pcat: Unknown backend '%s'.\n", optarg);
+                exit(1);
+            }
+            break;
+        case 's':
+            use_splice = 1;
+            break;
+        case 't':
+            if (parse_number(optarg, &delay) != 0 || delay > INT_MAX)
+            {
+                fprintf(stderr, "pcat: Invalid delay '%s'.\n", optarg);
+                exit(1);
+            }
+            max_delay = (int) delay;
+            break;
+        case 'r':
+            if (strcmp(optarg, "uring") == 0)
+                use_uring = 1;
+            else if (parse_reader(optarg, &reader) != 0)
+            {
+                fprintf(stderr, "pcat: Unknown reader '%s'.\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'w':
+            weightlist = optarg;
+            break;
+        case 'j':
+            if (parse_count(optarg, &numthreads) != 0)
+            {
+                fprintf(stderr, "pcat: Invalid number of jobs '%s'.\n", optarg);
+                exit(1);
+            }
+            jobsgiven = 1;
+            break;
+        case 'z':
+            decompress = 1;
+            break;
+        case 'm':
+            merge = 1;
+            break;
+        case 'k':
+            if (parse_count(optarg, &keyfield) != 0)
+            {
+                fprintf(stderr, "pcat: Invalid key field '%s'.\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'd':
+            if (strlen(optarg) != 1)
+            {
+                fprintf(stderr, "pcat: The delimiter must be a single character.\n");
+                exit(1);
+            }
+            delim = optarg[0];
+            break;
+        case 'M':
+            if (parse_count(optarg, &max_open) != 0)
+            {
+                fprintf(stderr, "pcat: Invalid number of files '%s'.\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'L':
+            if (parse_size(optarg, &maxline) != 0)
+            {
+                fprintf(stderr, "pcat: Invalid line length '%s'.\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'G':
+            if (parse_size(optarg, &linememory) != 0)
+            {
+                fprintf(stderr, "pcat: Invalid memory size '%s'.\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'O':
+            if (parse_long_line(optarg, &longlines) != 0)
+            {
+                fprintf(stderr, "pcat: Unknown long line action '%s'.\n", optarg);
+                exit(1);
+            }
+            longlinearg = optarg;
+            break;
+        case 'S':
+            statsfile = open_stats_file(optarg);
+            if (statsfile == NULL)
+            {
+                fprintf(stderr, "pcat: Can't write stats to '%s'", optarg != NULL ? optarg : "2");
+                perror("");
+                exit(1);
+            }
+            break;
+        default:
+            printusage();
+            exit(1);
+        }
+    }
+    const int first_filename_arg = optind;
+
+    if (max_open > 0 && (numthreads > 1 || decompress))
+    {
+        fputs("pcat: --max-open can't be used with --jobs or --decompress.\n", stderr);
+        exit(1);
+    }
+    if (merge && (numthreads > 1 || decompress || max_open > 0 || weightlist != NULL || use_splice))
+    {
+        fputs("pcat: --merge can't be used with --jobs, --decompress, --max-open, --weights, or --splice.\n", stderr);
+        exit(1);
+    }
+    if ((maxline > 0 || linememory > 0) && (numthreads > 1 || decompress || use_splice || use_uring))
+    {
+        fputs("pcat: --max-line and --line-memory can't be used with --jobs, --decompress, --splice, or --reader=uring.\n", stderr);
+        exit(1);
+    }
+    if (longlinearg != NULL && maxline == 0 && linememory == 0)
+    {
+        fputs("pcat: --on-long-line needs --max-line or --line-memory.\n", stderr);
+        exit(1);
+    }
+    if (merge && (maxline > 0 || linememory > 0) && longlines == PTP_LONG_LINE_STREAM)
+    {
+        fputs("pcat: --merge can't stream long lines; use --on-long-line=truncate or error.\n", stderr);
+        exit(1);
+    }
+
+    // With thousands of inputs, these are too big for the stack.
+    unsigned int numfiles = MAX(argc - first_filename_arg, 1);          // If no filenames given, still have stdin
+    static struct output out;
+    struct inputs in;
+    memset(&in, 0, sizeof in);
+    in.numfiles = in.numfiles_remaining = numfiles;
+    in.max_open = max_open > 0 ? MIN(max_open, numfiles) : numfiles;
+    in.names = calloc(numfiles, sizeof (const char *));
+    in.contexts = calloc(numfiles, sizeof (process_lines_context));
+    in.fds = calloc(numfiles, sizeof (int));
+    out.held = calloc(numfiles, 1);
+    out.heldlist = calloc(numfiles, sizeof (unsigned int));
+    if (in.names == NULL || in.contexts == NULL || in.fds == NULL || out.held == NULL || out.heldlist == NULL)
+    {
+        perror("pcat: Error allocating memory");
+        exit(1);
+    }
+    for (unsigned int f = 0 ; f < numfiles ; f++)
+    {
+        in.names[f] = argc > first_filename_arg ? argv[first_filename_arg + f] : "-";
+        in.fds[f] = -1;
+    }
+    in.out = &out;
+    in.reader = reader;
+    ptp_memory_budget budget = { 0, linememory };
+    in.maxline = maxline;
+    in.budget = linememory > 0 ? &budget : NULL;
+    in.longlines = longlines;
+    struct merge merging;
+    if (merge)
+    {
+        merging.keyfield = keyfield;
+        merging.delim = delim;
+        merging.queues = calloc(numfiles, sizeof (struct merge_queue));
+        if (merging.queues == NULL || loser_tree_init(&merging.tree, numfiles, merge_less, &merging) != 0)
+        {
+            perror("pcat: Error allocating memory");
+            exit(1);
+        }
+        for (unsigned int f = 0 ; f < numfiles ; f++)
+            merging.queues[f].merge = &merging;
+        in.merge = &merging;
+    }
+    if (weightlist != NULL)
+    {
+        in.quantum = calloc(numfiles, sizeof (long long));
+        in.deficit = calloc(numfiles, sizeof (long long));
+        if (in.quantum == NULL || in.deficit == NULL)
+        {
+            perror("pcat: Error allocating memory");
+            exit(1);
+        }
+        if (parse_weights(weightlist, in.quantum, numfiles) != 0)
+        {
+            fprintf(stderr, "pcat: Invalid weights '%s'; expected up to %u positive numbers.\n", weightlist, numfiles);
+            exit(1);
+        }
+    }
+    in.statsfile = statsfile;
+    if (statsfile != NULL)
+    {
+        in.stats = calloc(numfiles, sizeof (process_lines_stats));
+        if (in.stats == NULL)
+        {
+            perror("pcat: Error allocating memory");
+            exit(1);
+        }
+        in.started = clock_ns();
+        out.timed = 1;
+        catch_stats_signal(0);
+    }
+
+    // Inputs that are mostly idle needn't each tie up a buffer.
+    ptp_buffer_pool buffers;
+    if (max_open > 0)
+    {
+        if (ptp_buffer_pool_init(&buffers, READ_SIZE_BYTES, SHARED_IDLE_BUFFERS) != 0)
+        {
+            perror("pcat: Error allocating memory");
+            exit(1);
+        }
+        in.buffers = &buffers;
+    }
+    if (use_uring)
+    {
+        in.ring = uring_create();
+        if (in.ring == NULL)
+            perror("pcat: io_uring not available; reading files normally");
+        else if ((in.urings = calloc(numfiles, sizeof (uring_lines_context *))) == NULL)
+        {
+            perror("pcat: Error allocating memory");
+            exit(1);
+        }
+    }
+    /* Regular files are always ready, so poll(2) can't overlap reading them; threads can.
+     * Decompressing takes more CPU than reading, so it gets the threads whether asked for or not. */
+    if (decompress && !jobsgiven)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        numthreads = cpus > 1 ? (unsigned int) cpus : 1;
+    }
+    if (numthreads > 1 || decompress)
+    {
+        out.pool = readpool_create(numthreads, statsfile != NULL);
+        out.poolbufs = calloc(numthreads * READPOOL_BUFFERS, sizeof (readpool_buffer *));
+        in.pooled = calloc(numfiles, 1);
+        if (out.pool == NULL || out.poolbufs == NULL || in.pooled == NULL
+                || (decompress && readpool_decompress(out.pool) != 0))
+        {
+            perror("pcat: Error setting up reader threads");
+            exit(1);
+        }
+    }
+    out.max_delay = max_delay;
+    out.contexts = in.contexts;
+    in.continue_on_errors = continue_on_errors;
+
+#ifdef __linux__
+    /* splice(2) needs a pipe on one end; we only bother when both ends are pipes. */
+    struct stat statbuf;
+    if (use_splice && fstat(fileno(stdout), &statbuf) == 0 && S_ISFIFO(statbuf.st_mode))
+    {
+        in.splicing = calloc(numfiles, 1);
+        if (in.splicing == NULL || splice_scratch_init(&in.scratch) != 0)
+        {
+            perror("pcat: Error setting up splice");
+            exit(1);
+        }
+    }
+#else
+    (void) use_splice;
+#endif
+
+    /* Open files; set up buffers. */
+    debug(1, "opening %d of %d file(s)\n", in.max_open, numfiles);
+    open_inputs(&in);
+    if (out.pool != NULL)
+    {
+        if (statsfile != NULL)
+        {
+            in.memory += numthreads * READPOOL_BUFFERS * READPOOL_BUFFER_BYTES;
+            note_memory(&in);
+        }
+        if (readpool_start(out.pool) != 0)
+        {
+            perror("pcat: Error starting reader threads");
+            exit(1);
+        }
+    }
+
+    /* Loop waiting for input, writing data to stdout, until we've finished reading all files. */
+    if (in.merge != NULL)
+        run_merge(&in);
+    else switch (backend)
+    {
+#ifdef __linux__
+    case BACKEND_EPOLL:
+        run_epoll(&in);
+        break;
+#endif
+    default:
+        run_poll(&in);
+        break;
+    }
+
+#ifdef __linux__
+    if (in.splicing != NULL)
+        splice_scratch_cleanup(&in.scratch);
+#endif
+    if (in.ring != NULL)
+        uring_destroy(in.ring);
+    if (out.pool != NULL)
+        readpool_destroy(out.pool);
+    if (statsfile != NULL)
+        print_stats(&in, 1);
+    if (in.buffers != NULL)
+        ptp_buffer_pool_cleanup(in.buffers);
+    free(out.poolbufs);
+    free(out.held);
+    free(out.heldlist);
+    free(in.splicing);
+    free(in.urings);
+    free(in.pooled);
+    free(in.stats);
+    free(in.names);
+    free(in.contexts);
+    free(in.fds);
+    free(in.quantum);
+    free(in.deficit);
+    if (in.merge != NULL)
+    {
+        for (unsigned int f = 0 ; f < numfiles ; f++)
+            free(merging.queues[f].data);
+        free(merging.queues);
+        loser_tree_cleanup(&merging.tree);
     }
 
     debug(1, "Success.\n");
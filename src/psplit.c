@@ -0,0 +1,467 @@
+/****************************************************************************
+ psplit - Pipe Split
+
+ Copyright 2011 John Kleint
+ This is free software, licensed under the GNU General Public License v3,
+ available in the accompanying file LICENSE.txt.
+
+ Deal lines from stdin out to multiple files (usually pipes to worker
+ processes), giving each batch to whichever is ready to take it.
+*****************************************************************************/
+
+#define _GNU_SOURCE              // For getopt_long(3), memrchr(3)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "ptp.h"
+
+
+#define BATCH_BYTES  (64*1024)          // Most to write to an output at once
+
+
+/* Where lines go, and how it's been taking them.  */
+struct output {
+    int fd;
+    const char * name;
+    int ready;                          // Might take more without blocking
+    char * queue;                       // The rest of a line it took only part of
+    size_t queuestart;
+    size_t queuelen;
+    size_t queuesize;
+    unsigned long long lines;           // Lines it's been given...
+    unsigned long long bytes;           // ...and how many bytes they came to
+    unsigned long long writes;          // write(2) calls
+    unsigned long long full;            // Times it wouldn't take any more
+};
+
+/* Lines read but not yet handed out: the last lines process_lines() gave us,
+ * valid until we call it again.  */
+struct pending {
+    const char * lines;
+    size_t len;
+};
+
+/* Everything --stats needs.  */
+struct stats {
+    FILE * file;                        // Or NULL, without --stats
+    unsigned long long started;         // When we started, by clock_ns()
+    unsigned long long wakeups;         // Times poll(2) returned
+    process_lines_stats input;
+};
+
+
+void printusage()
+{
+    fputs(
+        "Usage: psplit [OPTION]... FILE...\n"
+        "Deal lines of standard input out among FILE(s), a batch at a time, giving each\n"
+        "batch to whichever FILE is ready to take it.\n\n"
+
+        "FILE(s) are usually named pipes to worker processes: a busy worker's pipe fills\n"
+        "up, so it gets fewer lines, and the idle ones more, rather than each getting\n"
+        "an equal share and the slowest holding up the rest.  Lines are never split\n"
+        "between FILEs, but which FILE a line goes to isn't predictable; use hsplit\n"
+        "for that.  Lines in any particular FILE keep their input order.\n\n"
+
+        "  -h,  --help                display this help and exit\n"
+        "  -a,  --append              append to FILE(s) rather than overwrite\n"
+        "  -r,  --reader=READER       buffer input with READER: 'buffer' (the default)\n"
+        "                             or 'ring' (a mirrored ring buffer; Linux only)\n"
+        "  -b,  --batch=SIZE          write up to SIZE bytes of whole lines to a FILE\n"
+        "                             at a time (default 64K); K, M, and G suffixes\n"
+        "                             work.  Smaller batches balance the load more\n"
+        "                             finely, larger ones take fewer system calls\n"
+        "       --stats[=FD]          print how many lines and bytes each FILE took,\n"
+        "                             and how fast, as JSON, to FD (default stderr) at\n"
+        "                             exit and whenever we get SIGUSR1\n"
+
+        "\n",
+        stderr);
+}
+
+
+/** process_lines() callback: hold on to the lines until they've all been handed out.  info is a struct pending. */
+void take_lines(char * buf, size_t buflen, void * info)
+{
+    struct pending * pending = info;
+
+    pending->lines = buf;
+    pending->len = buflen;
+}
+
+
+/**
+ * How much of the len bytes of lines at buf to hand out in one batch: as
+ * many whole lines as fit in batch bytes, or the first line, if it alone is
+ * bigger.
+ */
+size_t batch_len(const char * buf, size_t len, size_t batch)
+{
+    if (len <= batch)
+        return len;
+    const char * newline = memrchr(buf, '\n', batch);
+    if (newline == NULL)
+        newline = memchr(buf + batch, '\n', len - batch);
+    return newline != NULL ? (size_t) (newline - buf) + 1 : len;
+}
+
+
+/** Note that out has taken the len bytes of lines at buf, for --stats. */
+void count_lines(struct output * out, const char * buf, size_t len, int counting)
+{
+    out->bytes += len;
+    if (counting)
+        out->lines += count_newlines(buf, len) + (buf[len - 1] != '\n');
+}
+
+
+/** Die of an error writing to out. */
+void write_error(const struct output * out)
+{
+    fprintf(stderr, "psplit: Error writing to \"%s\"", out->name);
+    perror("");
+    exit(1);
+}
+
+
+/**
+ * Try to write a batch of len bytes of whole lines to out, which must have
+ * nothing queued.  If it takes part of a line, queue the rest of that line
+ * for it, and mark it not ready.  Returns how many bytes of the batch out
+ * took (queued and all); the rest are still to be handed out.
+ */
+size_t write_batch(struct output * out, const char * buf, size_t len)
+{
+    ssize_t written = write(out->fd, buf, len);
+
+    out->writes++;
+    if (written < 0)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            out->ready = 0;
+            out->full++;
+        }
+        else if (errno != EINTR)
+            write_error(out);
+        return 0;
+    }
+    if ((size_t) written == len)
+        return len;
+
+    // A pipe takes what it has room for, which needn't end at a line.
+    out->ready = 0;
+    out->full++;
+    if (written == 0 || buf[written - 1] == '\n')
+        return written;
+    const char * newline = memchr(buf + written, '\n', len - written);
+    size_t took = newline != NULL ? (size_t) (newline - buf) + 1 : len;
+    size_t rest = took - written;
+    if (rest > out->queuesize)
+    {
+        char * queue = realloc(out->queue, rest);
+        if (queue == NULL)
+        {
+            perror("psplit: Error allocating memory");
+            exit(1);
+        }
+        out->queue = queue;
+        out->queuesize = rest;
+    }
+    memcpy(out->queue, buf + written, rest);
+    out->queuestart = 0;
+    out->queuelen = rest;
+    return took;
+}
+
+
+/** Write as much of out's queue as it will take now. */
+void drain_queue(struct output * out)
+{
+    ssize_t written = write(out->fd, out->queue + out->queuestart, out->queuelen);
+
+    out->writes++;
+    if (written < 0)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            out->ready = 0;
+            out->full++;
+        }
+        else if (errno != EINTR)
+            write_error(out);
+        return;
+    }
+    out->queuestart += written;
+    out->queuelen -= written;
+    out->ready = (out->queuelen == 0);
+}
+
+
+/**
+ * Hand out pending lines, a batch at a time, to outputs that are ready and
+ * have nothing queued, taking turns from *next.  Returns once they've all
+ * been handed out, or no output is ready.
+ */
+void deal_lines(struct pending * pending, struct output * outputs, unsigned int numoutputs, unsigned int * next,
+                size_t batch, int counting)
+{
+    while (pending->len > 0)
+    {
+        unsigned int o = 0, n;
+        for (n = 0 ; n < numoutputs ; n++)
+        {
+            o = (*next + n) % numoutputs;
+            if (outputs[o].ready && outputs[o].queuelen == 0)
+                break;
+        }
+        if (n == numoutputs)
+            return;
+        *next = (o + 1) % numoutputs;
+
+        size_t len = batch_len(pending->lines, pending->len, batch);
+        size_t took = write_batch(outputs + o, pending->lines, len);
+        if (took > 0)
+            count_lines(outputs + o, pending->lines, took, counting);
+        pending->lines += took;
+        pending->len -= took;
+    }
+}
+
+
+/** Print stats as one line of JSON; final says whether we're done. */
+void print_stats(const struct stats * stats, const struct output * outputs, unsigned int numoutputs, int final)
+{
+    FILE * out = stats->file;
+    double seconds = (clock_ns() - stats->started) / 1e9;
+
+    fprintf(out, "{\"program\": \"psplit\", \"final\": %s, \"seconds\": %.6f, \"wakeups\": %llu, \"input\": {",
+            final ? "true" : "false", seconds, stats->wakeups);
+    print_stats_json(out, "-", &stats->input, 1);
+    fputs("}, \"outputs\": [", out);
+    for (unsigned int o = 0 ; o < numoutputs ; o++)
+    {
+        fputs(o > 0 ? ", {\"name\": " : "{\"name\": ", out);
+        print_json_string(out, outputs[o].name);
+        fprintf(out, ", \"lines\": %llu, \"bytes\": %llu, \"writes\": %llu, \"full\": %llu, \"bytes_per_second\": %.0f}",
+                outputs[o].lines, outputs[o].bytes, outputs[o].writes, outputs[o].full,
+                seconds > 0 ? outputs[o].bytes / seconds : 0.0);
+    }
+    fputs("]}\n", out);
+    fflush(out);
+}
+
+
+/**
+ * Deal lines from the input out among the outputs until it runs out, waiting
+ * in poll(2) for more input, or for an output to take more, when there's
+ * nothing else to do.
+ */
+void split_input(process_lines_context * ctx, struct pending * pending, struct output * outputs, unsigned int numoutputs,
+                 size_t batch, struct stats * stats)
+{
+    struct pollfd * fds = calloc(numoutputs + 1, sizeof (struct pollfd));
+    unsigned int * polled = calloc(numoutputs + 1, sizeof (unsigned int));      // Which output each fds[] entry is
+    unsigned int next = 0;
+    int eof = 0;
+
+    if (fds == NULL || polled == NULL)
+    {
+        perror("psplit: Error allocating memory");
+        exit(1);
+    }
+    for (;;)
+    {
+        if (stats_requested && stats->file != NULL)
+        {
+            stats_requested = 0;
+            print_stats(stats, outputs, numoutputs, 0);
+        }
+        deal_lines(pending, outputs, numoutputs, &next, batch, stats->file != NULL);
+
+        // Wait for input once we've handed out all we have, and for outputs
+        // that have a partial line to finish or have been full.
+        unsigned int numfds = 0, queued = 0;
+        if (pending->len == 0 && !eof)
+        {
+            fds[numfds].fd = ctx->fd;
+            fds[numfds].events = POLLIN;
+            polled[numfds++] = numoutputs;
+        }
+        for (unsigned int o = 0 ; o < numoutputs ; o++)
+        {
+            queued += (outputs[o].queuelen > 0);
+            if (outputs[o].queuelen > 0 || !outputs[o].ready)
+            {
+                fds[numfds].fd = outputs[o].fd;
+                fds[numfds].events = POLLOUT;
+                polled[numfds++] = o;
+            }
+        }
+        if (eof && pending->len == 0 && queued == 0)
+            break;
+
+        if (poll(fds, numfds, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("psplit: Error waiting for input or output");
+            exit(1);
+        }
+        stats->wakeups++;
+        for (unsigned int i = 0 ; i < numfds ; i++)
+        {
+            if (fds[i].revents == 0)
+                continue;
+            if (polled[i] == numoutputs)
+            {
+                int result = process_lines(ctx);
+                if (result == PTP_EOF)
+                    eof = 1;
+                else if (result > 0)
+                {
+                    perror("psplit: Error reading input");
+                    exit(1);
+                }
+                continue;
+            }
+            struct output * out = outputs + polled[i];
+            out->ready = 1;
+            if (out->queuelen > 0)
+                drain_queue(out);
+        }
+    }
+    free(polled);
+    free(fds);
+}
+
+
+/**
+ * Deal lines from stdin out among the files given on the command line.
+ */
+int main(int argc, char * argv[])
+{
+    int append = 0;
+    size_t batch = BATCH_BYTES;
+    enum ptp_reader reader = PTP_READER_BUFFER;
+    struct stats stats;
+    static const struct option longopts[] = {
+        {"help",          no_argument,       NULL, 'h'},
+        {"append",        no_argument,       NULL, 'a'},
+        {"reader",        required_argument, NULL, 'r'},
+        {"batch",         required_argument, NULL, 'b'},
+        {"stats",         optional_argument, NULL, 'S'},
+        {NULL, 0, NULL, 0}
+    };
+
+    memset(&stats, 0, sizeof stats);
+    int opt;
+    while ((opt = getopt_long(argc, argv, "har:b:", longopts, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 'h':
+            printusage();
+            exit(0);
+        case 'a':
+            append = 1;
+            break;
+        case 'r':
+            if (parse_reader(optarg, &reader) != 0)
+            {
+                fprintf(stderr, "psplit: Unknown reader '%s'.\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'b':
+            if (parse_size(optarg, &batch) != 0)
+            {
+                fprintf(stderr, "psplit: Invalid batch size '%s'.\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'S':
+            stats.file = open_stats_file(optarg);
+            if (stats.file == NULL)
+            {
+                fprintf(stderr, "psplit: Can't write stats to '%s'", optarg != NULL ? optarg : "2");
+                perror("");
+                exit(1);
+            }
+            break;
+        default:
+            printusage();
+            exit(1);
+        }
+    }
+    const unsigned int numoutputs = argc - optind;
+    if (numoutputs == 0)
+    {
+        printusage();
+        exit(1);
+    }
+
+    /* Open files, nonblocking, so a full one doesn't hold up the rest. */
+    struct output * outputs = calloc(numoutputs, sizeof (struct output));
+    if (outputs == NULL)
+    {
+        perror("psplit: Error allocating memory");
+        exit(1);
+    }
+    for (unsigned int o = 0 ; o < numoutputs ; o++)
+    {
+        outputs[o].name = argv[optind + o];
+        outputs[o].fd = open(outputs[o].name, O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC), 0666);
+        if (outputs[o].fd < 0)
+        {
+            fprintf(stderr, "psplit: error opening \"%s\"", outputs[o].name);
+            perror("");
+            exit(1);
+        }
+        int flags = fcntl(outputs[o].fd, F_GETFL);
+        if (flags < 0 || fcntl(outputs[o].fd, F_SETFL, flags | O_NONBLOCK) < 0)
+        {
+            fprintf(stderr, "psplit: Error making \"%s\" nonblocking", outputs[o].name);
+            perror("");
+            exit(1);
+        }
+        outputs[o].ready = 1;
+    }
+
+    /* Input is read only once poll(2) says it's readable, so it can block. */
+    process_lines_context ctx;
+    struct pending pending = { NULL, 0 };
+    if (process_lines_init_reader(&ctx, reader, fileno(stdin), take_lines, &pending) != 0)
+    {
+        perror("psplit");
+        exit(1);
+    }
+    if (stats.file != NULL)
+    {
+        stats.started = clock_ns();
+        process_lines_count(&ctx, &stats.input);
+        catch_stats_signal(1);
+    }
+
+    split_input(&ctx, &pending, outputs, numoutputs, batch, &stats);
+
+    /* Close files and clean up. */
+    process_lines_cleanup(&ctx);
+    if (stats.file != NULL)
+        print_stats(&stats, outputs, numoutputs, 1);
+    for (unsigned int o = 0 ; o < numoutputs ; o++)
+    {
+        if (close(outputs[o].fd) != 0)
+            write_error(outputs + o);
+        free(outputs[o].queue);
+    }
+    free(outputs);
+    return 0;
+}
@@ -9,31 +9,701 @@
  See ptp.h for documentation.
 ****************************************************************************/
 
-#define _GNU_SOURCE             // For memrchr(3)
+#define _GNU_SOURCE             // For memrchr(3), splice(2), tee(2)
 
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
 #include <stdarg.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <limits.h>
+#include <stdint.h>
+#include <signal.h>
+#include <time.h>
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
 
 #include "ptp.h"
 
 
+/* Set up everything but ctx's buffer. */
+static void init_context(process_lines_context * ctx, enum ptp_reader reader, int fd, void (*process)(char * buf, size_t buflen, void * info), void * info)
+{
+    ctx->reader = reader;
+    ctx->readsize = READ_SIZE_BYTES;
+    ctx->bufstart = ctx->bufpos = 0;
+    ctx->process = process;
+    ctx->fd = fd;
+    ctx->info = info;
+    ctx->partial = NULL;
+    ctx->maxline = 0;
+    ctx->longlines = PTP_LONG_LINE_STREAM;
+    ctx->streaming = ctx->truncating = 0;
+    ctx->budget = NULL;
+    ctx->stats = NULL;
+    ctx->minread = ctx->maxread = ctx->lastread = 0;
+    ctx->pool = NULL;
+}
+
+
 int process_lines_init(process_lines_context * ctx, int fd, void (*process)(char * buf, size_t buflen, void * info), void * info)
 {
-    ctx->bufsize = ctx->readsize = READ_SIZE_BYTES;
+    init_context(ctx, PTP_READER_BUFFER, fd, process, info);
+    ctx->bufsize = ctx->basesize = READ_SIZE_BYTES;
     ctx->buf = calloc(ctx->bufsize, 1);
     if (ctx->buf == NULL)
         return PTP_ERR_ALLOC;
-    ctx->bufpos = 0;
-    ctx->process = process;
-    ctx->fd = fd;
-    ctx->info = info;
     return 0;
 }
 
 
+int ptp_buffer_pool_init(ptp_buffer_pool * pool, size_t bufsize, size_t maxidle)
+{
+    pool->idle = calloc(maxidle > 0 ? maxidle : 1, sizeof (char *));
+    if (pool->idle == NULL)
+        return PTP_ERR_ALLOC;
+    pool->numidle = 0;
+    pool->maxidle = maxidle;
+    pool->bufsize = bufsize;
+    pool->allocated = 0;
+    return 0;
+}
+
+
+void ptp_buffer_pool_cleanup(ptp_buffer_pool * pool)
+{
+    while (pool->numidle > 0)
+        free(pool->idle[--pool->numidle]);
+    free(pool->idle);
+    pool->idle = NULL;
+    pool->allocated = 0;
+}
+
+
+int process_lines_init_shared(process_lines_context * ctx, ptp_buffer_pool * pool, int fd, void (*process)(char * buf, size_t buflen, void * info), void * info)
+{
+    init_context(ctx, PTP_READER_BUFFER, fd, process, info);
+    ctx->readsize = READ_SIZE_BYTES < pool->bufsize ? READ_SIZE_BYTES : pool->bufsize;
+    ctx->buf = NULL;
+    ctx->bufsize = 0;
+    ctx->basesize = pool->bufsize;
+    ctx->pool = pool;
+    return 0;
+}
+
+
+/* Whether ctx's budget has room for its buffer to grow to bufsize bytes. */
+static int budget_allows(const process_lines_context * ctx, size_t bufsize)
+{
+    const ptp_memory_budget * budget = ctx->budget;
+    size_t extra = ctx->bufsize > ctx->basesize ? ctx->bufsize - ctx->basesize : 0;
+    return budget == NULL || bufsize <= ctx->basesize || bufsize - ctx->basesize - extra <= budget->max - budget->used;
+}
+
+
+/* Charge ctx's budget for its buffer changing size to bufsize bytes, or refund it. */
+static void charge_budget(process_lines_context * ctx, size_t bufsize)
+{
+    if (ctx->budget == NULL)
+        return;
+    ctx->budget->used -= ctx->bufsize > ctx->basesize ? ctx->bufsize - ctx->basesize : 0;
+    ctx->budget->used += bufsize > ctx->basesize ? bufsize - ctx->basesize : 0;
+}
+
+
+/* Borrow a buffer for ctx from its pool. */
+static int borrow_buffer(process_lines_context * ctx)
+{
+    ptp_buffer_pool * pool = ctx->pool;
+    if (pool->numidle > 0)
+    {
+        ctx->buf = pool->idle[--pool->numidle];
+    }
+    else
+    {
+        ctx->buf = malloc(pool->bufsize);
+        if (ctx->buf == NULL)
+            return PTP_ERR_ALLOC;
+        pool->allocated += pool->bufsize;
+    }
+    ctx->bufsize = pool->bufsize;
+    ctx->bufstart = 0;
+    if (ctx->stats != NULL && ctx->stats->bufsize < ctx->bufsize)
+        ctx->stats->bufsize = ctx->bufsize;
+    return 0;
+}
+
+
+/* Give ctx's buffer back to its pool, whatever's in it.  One that grew to
+ * hold a long line is freed instead, as is one the pool has no room for.
+ * (pool->allocated only counts buffers at the pool's size.) */
+static void return_buffer(process_lines_context * ctx)
+{
+    ptp_buffer_pool * pool = ctx->pool;
+    if (ctx->bufsize == pool->bufsize && pool->numidle < pool->maxidle)
+    {
+        pool->idle[pool->numidle++] = ctx->buf;
+    }
+    else
+    {
+        free(ctx->buf);
+        pool->allocated -= pool->bufsize;
+    }
+    charge_budget(ctx, 0);
+    ctx->buf = NULL;
+    ctx->bufsize = ctx->bufstart = 0;
+}
+
+
+void process_lines_release(process_lines_context * ctx)
+{
+    if (ctx->pool != NULL && ctx->buf != NULL && ctx->bufpos == 0)
+        return_buffer(ctx);
+}
+
+
+#ifdef __linux__
+/* Map a mirrored ring buffer of size bytes: the same pages twice in a row.
+ * Returns NULL on error. */
+static char * map_ring(size_t size)
+{
+    int memfd = memfd_create("ptp-ring", MFD_CLOEXEC);
+    if (memfd < 0)
+        return NULL;
+    char * ring = MAP_FAILED;
+    if (ftruncate(memfd, size) == 0)
+    {
+        // Reserve the address space for both copies, then map the pages into each half.
+        ring = mmap(NULL, 2 * size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ring != MAP_FAILED
+                && (mmap(ring, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, memfd, 0) == MAP_FAILED
+                    || mmap(ring + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, memfd, 0) == MAP_FAILED))
+        {
+            munmap(ring, 2 * size);
+            ring = MAP_FAILED;
+        }
+    }
+    close(memfd);                   // The mappings keep the pages around
+    return ring == MAP_FAILED ? NULL : ring;
+}
+#endif
+
+
+int process_lines_init_ring(process_lines_context * ctx, int fd, void (*process)(char * buf, size_t buflen, void * info), void * info)
+{
+#ifdef __linux__
+    ctx->buf = map_ring(RING_SIZE_BYTES);
+    if (ctx->buf == NULL)
+        return PTP_ERR_ALLOC;
+    init_context(ctx, PTP_READER_RING, fd, process, info);
+    ctx->bufsize = ctx->basesize = RING_SIZE_BYTES;
+    return 0;
+#else
+    (void) ctx; (void) fd; (void) process; (void) info;
+    errno = ENOSYS;
+    return PTP_ERR_ALLOC;
+#endif
+}
+
+
+int process_lines_init_reader(process_lines_context * ctx, enum ptp_reader reader, int fd, void (*process)(char * buf, size_t buflen, void * info), void * info)
+{
+    if (reader == PTP_READER_RING)
+        return process_lines_init_ring(ctx, fd, process, info);
+    return process_lines_init(ctx, fd, process, info);
+}
+
+
+int parse_reader(const char * name, enum ptp_reader * reader)
+{
+    if (strcmp(name, "buffer") == 0)
+        *reader = PTP_READER_BUFFER;
+    else if (strcmp(name, "ring") == 0)
+        *reader = PTP_READER_RING;
+    else
+        return 1;
+    return 0;
+}
+
+
+void process_lines_stream_long_lines(process_lines_context * ctx, size_t maxline, void (*partial)(char * buf, size_t buflen, int end, void * info))
+{
+    ctx->maxline = maxline;
+    ctx->partial = partial;
+}
+
+
+void process_lines_limit(process_lines_context * ctx, size_t maxline, enum ptp_long_line policy, ptp_memory_budget * budget)
+{
+    ctx->maxline = maxline;
+    ctx->longlines = policy;
+    ctx->budget = budget;
+}
+
+
+int parse_long_line(const char * name, enum ptp_long_line * policy)
+{
+    if (strcmp(name, "stream") == 0)
+        *policy = PTP_LONG_LINE_STREAM;
+    else if (strcmp(name, "truncate") == 0)
+        *policy = PTP_LONG_LINE_TRUNCATE;
+    else if (strcmp(name, "error") == 0)
+        *policy = PTP_LONG_LINE_ERROR;
+    else
+        return 1;
+    return 0;
+}
+
+
+void process_lines_adapt(process_lines_context * ctx, size_t minread, size_t maxread)
+{
+    ctx->minread = minread;
+    ctx->maxread = maxread;
+    while (ctx->readsize > maxread && ctx->readsize / 2 >= minread)
+        ctx->readsize /= 2;
+}
+
+
+/* How much the next read should ask for, given room for `room` bytes. */
+static size_t read_length(const process_lines_context * ctx, size_t room)
+{
+    return ctx->maxread > 0 && ctx->readsize < room ? ctx->readsize : room;
+}
+
+
+/* Having asked for `requested` bytes and gotten bytesread, adapt the read size
+ * (see process_lines_adapt()). */
+static void adapt_readsize(process_lines_context * ctx, size_t requested, ssize_t bytesread)
+{
+    ctx->lastread = bytesread > 0 ? (size_t) bytesread : 0;
+    if (ctx->maxread == 0 || bytesread < 0)
+        return;
+    if ((size_t) bytesread == requested && ctx->readsize < ctx->maxread)
+        ctx->readsize = 2 * ctx->readsize < ctx->maxread ? 2 * ctx->readsize : ctx->maxread;
+    else if ((size_t) bytesread < ctx->readsize / 4 && ctx->readsize / 2 >= ctx->minread)
+        ctx->readsize /= 2;
+}
+
+
+void process_lines_count(process_lines_context * ctx, process_lines_stats * stats)
+{
+    ctx->stats = stats;
+    if (stats->bufsize < ctx->bufsize)
+        stats->bufsize = ctx->bufsize;
+}
+
+
+int parse_size(const char * arg, size_t * size)
+{
+    char * end;
+    unsigned long long value = strtoull(arg, &end, 10);
+    unsigned int shift = 0;
+
+    if (end == arg || arg[0] == '-')
+        return 1;
+    switch (*end)
+    {
+    case 'K': case 'k': shift = 10; end++; break;
+    case 'M': case 'm': shift = 20; end++; break;
+    case 'G': case 'g': shift = 30; end++; break;
+    }
+    if (*end != '\0' || value == 0 || value > (SIZE_MAX >> shift))
+        return 1;
+    *size = (size_t) value << shift;
+    return 0;
+}
+
+
+int parse_number(const char * arg, unsigned int * value)
+{
+    char * end;
+    unsigned long number = strtoul(arg, &end, 10);
+
+    if (end == arg || arg[0] == '-' || *end != '\0' || number > UINT_MAX)
+        return 1;
+    *value = (unsigned int) number;
+    return 0;
+}
+
+
+int parse_count(const char * arg, unsigned int * count)
+{
+    unsigned int value;
+
+    if (parse_number(arg, &value) != 0 || value == 0)
+        return 1;
+    *count = value;
+    return 0;
+}
+
+
+unsigned long long count_newlines(const char * buf, size_t len)
+{
+    const char * end = buf + len;
+    unsigned long long newlines = 0;
+
+    for (const char * newline ; (newline = memchr(buf, '\n', (size_t) (end - buf))) != NULL ; buf = newline + 1)
+        newlines++;
+    return newlines;
+}
+
+
+unsigned long long clock_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+
+volatile sig_atomic_t stats_requested = 0;
+
+
+/* SIGUSR1 handler. */
+static void request_stats(__attribute__((unused)) int signum)
+{
+    stats_requested = 1;
+}
+
+
+void catch_stats_signal(int interrupt)
+{
+    struct sigaction action;
+    memset(&action, 0, sizeof action);
+    action.sa_handler = request_stats;
+    action.sa_flags = interrupt ? 0 : SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGUSR1, &action, NULL);
+}
+
+
+FILE * open_stats_file(const char * fdarg)
+{
+    char * end;
+    long fd = STDERR_FILENO;
+
+    if (fdarg != NULL)
+    {
+        fd = strtol(fdarg, &end, 10);
+        if (end == fdarg || *end != '\0' || fd < 0 || fd > INT_MAX)
+        {
+            errno = EBADF;
+            return NULL;
+        }
+    }
+    int flags = fcntl((int) fd, F_GETFL);
+    if (flags < 0 || (flags & O_ACCMODE) == O_RDONLY)
+    {
+        errno = EBADF;
+        return NULL;
+    }
+    return fdopen((int) fd, "w");
+}
+
+
+/* Note that the buffer grew, if we're keeping count. */
+static void count_growth(process_lines_context * ctx)
+{
+    if (ctx->stats != NULL)
+    {
+        ctx->stats->grows++;
+        if (ctx->stats->bufsize < ctx->bufsize)
+            ctx->stats->bufsize = ctx->bufsize;
+    }
+}
+
+
+/* read(2) up to len bytes into buf, counting the call if ctx keeps stats. */
+static ssize_t read_input(process_lines_context * ctx, char * buf, size_t len)
+{
+    if (ctx->stats == NULL)
+        return read(ctx->fd, buf, len);
+
+    unsigned long long start = clock_ns();
+    ssize_t bytesread = read(ctx->fd, buf, len);
+    ctx->stats->read_ns += clock_ns() - start;
+    ctx->stats->reads++;
+    if (bytesread > 0)
+    {
+        ctx->stats->bytes += bytesread;
+        ctx->stats->lines += count_newlines(buf, bytesread);    // finish_lines() counts an unterminated last line
+    }
+    return bytesread;
+}
+
+
+/* Move the saved partial line to the start of ctx->buf. */
+static void compact_buffer(process_lines_context * ctx)
+{
+    if (ctx->bufstart > 0)
+    {
+        memmove(ctx->buf, ctx->buf + ctx->bufstart, ctx->bufpos);
+        ctx->bufstart = 0;
+    }
+}
+
+
+/* Double the size of ctx->buf until it has room for at least `needed` bytes
+ * past bufpos -- but no more than that past ctx->maxline, which the partial
+ * line never gets longer than, and no more than ctx's budget has left.
+ * Returns nonzero if we're out of memory, or PTP_ERR_LONG_LINE if the budget
+ * is (ctx is unchanged). */
+static int grow_buffer(process_lines_context * ctx, size_t needed)
+{
+    size_t bufsize = ctx->bufsize;
+    while (bufsize - ctx->bufpos < needed)
+        bufsize *= 2;
+    if (ctx->maxline > 0 && bufsize > ctx->maxline + needed && ctx->bufpos <= ctx->maxline)
+        bufsize = ctx->maxline + needed > ctx->bufsize ? ctx->maxline + needed : ctx->bufsize;
+    if (!budget_allows(ctx, bufsize))
+    {
+        size_t left = ctx->budget->max - ctx->budget->used;
+        if (left == 0 || ctx->bufsize < ctx->basesize)
+            return PTP_ERR_LONG_LINE;
+        bufsize = ctx->bufsize + left;
+    }
+
+    char * buf = realloc(ctx->buf, bufsize);
+    if (buf == NULL)
+        return PTP_ERR_ALLOC;
+    charge_budget(ctx, bufsize);
+    ctx->buf = buf;
+    ctx->bufsize = bufsize;
+    count_growth(ctx);
+    return 0;
+}
+
+
+/* The smallest ctx's buffer can be and still hold its partial line and a
+ * read: basesize, doubled as often as it takes.  When reads adapt, that's
+ * the biggest read, or the buffer would shrink and grow again every time
+ * readsize went down and back up. */
+static size_t needed_size(const process_lines_context * ctx)
+{
+    size_t readsize = ctx->maxread > ctx->readsize ? ctx->maxread : ctx->readsize;
+    size_t size = ctx->basesize;
+    while (size < ctx->bufpos + readsize)
+        size *= 2;
+    return size;
+}
+
+
+/* Once a long line is done with, shrink ctx->buf back to what it needs (if
+ * that's at most half of what it has), so one long line doesn't pin its
+ * memory down for the rest of the input.  If realloc(3) won't, keep it. */
+static void shrink_buffer(process_lines_context * ctx)
+{
+    size_t bufsize = needed_size(ctx);
+    if (bufsize > ctx->bufsize / 2)
+        return;
+    compact_buffer(ctx);
+    char * buf = realloc(ctx->buf, bufsize);
+    if (buf == NULL)
+        return;
+    charge_budget(ctx, bufsize);
+    ctx->buf = buf;
+    ctx->bufsize = bufsize;
+}
+
+
+/*
+ * The partial line is too long to buffer any more of: hand what we have of
+ * it to partial() and stream the rest, cut it short at keep bytes (and skip
+ * the rest), or give up, as ctx->longlines says.  Returns nonzero if we give
+ * up.
+ */
+static int long_line(process_lines_context * ctx, size_t keep)
+{
+    if (ctx->stats != NULL)
+        ctx->stats->long_lines++;
+    if (ctx->longlines == PTP_LONG_LINE_STREAM && ctx->partial != NULL)
+    {
+        ctx->partial(ctx->buf + ctx->bufstart, ctx->bufpos, 0, ctx->info);
+        ctx->streaming = 1;
+        ctx->bufpos = 0;
+        return 0;
+    }
+    if (ctx->longlines == PTP_LONG_LINE_TRUNCATE)
+    {
+        ctx->bufpos = keep;
+        ctx->truncating = 1;
+        return 0;
+    }
+    return PTP_ERR_LONG_LINE;
+}
+
+
+/* The buffer can't grow, because ctx's budget has run out: read what fits
+ * after the partial line, or if nothing does, it's too long. */
+static int over_budget(process_lines_context * ctx)
+{
+    if (ctx->bufpos < ctx->bufsize)
+        return 0;
+    return long_line(ctx, ctx->bufpos - (ctx->readsize < ctx->bufpos / 2 ? ctx->readsize : ctx->bufpos / 2));
+}
+
+
+/*
+ * Having read bytesread bytes just after the partial line (which starts at buf
+ * and is bufpos bytes long), find the last newline, process() everything up to
+ * and including it, and remember where the new partial line starts (in
+ * bufstart) and how long it is (in bufpos).  If there's no newline, the
+ * partial line just got longer.  We don't move the partial line until the
+ * next call, so the buffer we gave process() stays intact until then.
+ *
+ * Lines that get longer than ctx->maxline are handled by long_line(): they
+ * go to ctx->partial() instead, as we read them, and we're then "streaming"
+ * until we see the end of the line; or we keep their first maxline bytes,
+ * and are "truncating" -- throwing away what we read -- until then.  Returns
+ * nonzero if we give up on a line instead.
+ */
+static int take_lines(process_lines_context * ctx, char * buf, size_t bufpos, size_t bytesread)
+{
+    char * end = buf + bufpos + bytesread;
+
+    if (ctx->truncating)                    // bufpos is what we're keeping of the line
+    {
+        char * newline = memchr(buf + bufpos, '\n', bytesread);
+        if (newline == NULL)
+            return 0;
+        ctx->truncating = 0;
+        bytesread = end - newline;
+        memmove(buf + bufpos, newline, bytesread);
+        end = buf + bufpos + bytesread;
+    }
+    if (ctx->streaming)                     // bufpos is 0
+    {
+        char * newline = memchr(buf, '\n', bytesread);
+        ctx->partial(buf, (newline == NULL ? end : newline + 1) - buf, newline != NULL, ctx->info);
+        if (newline == NULL)
+            return 0;
+        ctx->streaming = 0;
+        buf = newline + 1;
+        if (buf == end)
+        {
+            ctx->bufstart = 0;
+            return 0;
+        }
+        ctx->bufstart = (buf - ctx->buf) % ctx->bufsize;
+    }
+
+    char * last_newline = memrchr(buf + bufpos, '\n', (size_t) (end - (buf + bufpos)));
+    if (last_newline != NULL)
+    {
+        char * partial_line = last_newline + 1;
+        ctx->process(buf, partial_line - buf, ctx->info);
+        ctx->bufpos = end - partial_line;
+        ctx->bufstart = ctx->bufpos > 0 ? (size_t) (partial_line - ctx->buf) % ctx->bufsize : 0;
+    }
+    else        // No newline found
+    {
+        ctx->bufpos = end - buf;
+    }
+
+    if (ctx->maxline > 0 && ctx->bufpos > ctx->maxline)
+        return long_line(ctx, ctx->maxline);
+    return 0;
+}
+
+
+/* At EOF, hand over the final partial line, if any (it has no newline). */
+static void finish_lines(process_lines_context * ctx, char * buf, size_t bufpos)
+{
+    if (ctx->stats != NULL && (ctx->streaming || bufpos > 0))
+        ctx->stats->lines++;
+    ctx->truncating = 0;
+    if (ctx->streaming)
+    {
+        ctx->partial(buf, 0, 1, ctx->info);
+        ctx->streaming = 0;
+    }
+    else if (bufpos > 0)
+    {
+        ctx->process(buf, bufpos, ctx->info);
+    }
+}
+
+
+#ifdef __linux__
+/* Replace ctx's ring with one of ringsize bytes, copying the partial line over. */
+static int resize_ring(process_lines_context * ctx, size_t ringsize)
+{
+    char * ring = map_ring(ringsize);
+    if (ring == NULL)
+        return PTP_ERR_ALLOC;
+    memcpy(ring, ctx->buf + ctx->bufstart, ctx->bufpos);
+    munmap(ctx->buf, 2 * ctx->bufsize);
+    charge_budget(ctx, ringsize);
+    ctx->buf = ring;
+    ctx->bufsize = ringsize;
+    ctx->bufstart = 0;
+    return 0;
+}
+
+
+/* Double the size of a ring until it has room for readsize more bytes.
+ * Returns PTP_ERR_LONG_LINE if ctx's budget won't allow it. */
+static int grow_ring(process_lines_context * ctx)
+{
+    size_t ringsize = ctx->bufsize;
+    while (ringsize - ctx->bufpos < ctx->readsize)
+        ringsize *= 2;
+    if (!budget_allows(ctx, ringsize))
+        return PTP_ERR_LONG_LINE;
+    if (resize_ring(ctx, ringsize) != 0)
+        return PTP_ERR_ALLOC;
+    count_growth(ctx);
+    return 0;
+}
+
+
+/*
+ * process_lines() for a mirrored ring buffer.  The partial line starts at
+ * offset bufstart (always less than bufsize) and is bufpos bytes long; the
+ * rest of the ring is free.  Because the ring is mapped twice in a row, the
+ * free space after the partial line is contiguous, even if it wraps around,
+ * and so are the lines we process.  So we never have to move anything.
+ */
+static int process_lines_ring(process_lines_context * ctx)
+{
+    if (ctx->bufsize > ctx->basesize && needed_size(ctx) <= ctx->bufsize / 2)
+        resize_ring(ctx, needed_size(ctx));         // Shrink back; if we can't, keep the big one
+    if (ctx->bufsize - ctx->bufpos < ctx->readsize)
+    {
+        int result = grow_ring(ctx);
+        if (result == PTP_ERR_LONG_LINE)
+            result = over_budget(ctx);
+        if (result != 0)
+            return result;
+    }
+
+    char * buf = ctx->buf + ctx->bufstart;
+    size_t bufpos = ctx->bufpos;
+    size_t requested = read_length(ctx, ctx->bufsize - bufpos);
+    ssize_t bytesread = read_input(ctx, buf + bufpos, requested);
+    debug(1, "read on fd %d returned %d\n", ctx->fd, bytesread);
+    adapt_readsize(ctx, requested, bytesread);
+    if (bytesread < 0)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return PTP_AGAIN;
+        return PTP_ERR_READ;
+    }
+    else if (bytesread == 0)
+    {
+        finish_lines(ctx, buf, bufpos);
+        return PTP_EOF;
+    }
+
+    return take_lines(ctx, buf, bufpos, (size_t) bytesread);
+}
+#endif
+
+
 /*
  * We want to process only whole lines.  Lines can be arbitrarily long,
  * and we may not get a whole line in one read().  So, we have to manage a
@@ -43,88 +713,334 @@ int process_lines_init(process_lines_context * ctx, int fd, void (*process)(char
  * lines, and save any trailing partial line in a buffer.  If we don't yet
  * have a whole line, we don't call process() and the data is buffered.
  *
- * buf will always hold the last partial line read (at offset 0).
- * The last partial line is bufpos bytes long (it can be zero, i.e., no
- * partial line).  We try to read readsize bytes into buf starting at bufpos;
- * if it won't fit, we double the size of buf until it does.  Once we've read
- * in the data, we scan it in reverse, looking for the last newline.  We
- * process() everything up to and including the last newline.  We then copy
- * any trailing partial line to the beginning of the buffer.
+ * buf will always hold the last partial line read, starting at offset
+ * bufstart.  The last partial line is bufpos bytes long (it can be zero, i.e.,
+ * no partial line).  We try to read readsize bytes into buf just after it;
+ * if there isn't room, we first copy the partial line to the beginning of the
+ * buffer, and if it still won't fit, we double the size of buf until it does.
+ * (Once there's room again, we shrink it back.)
+ * Once we've read in the data, we scan it in reverse, looking for the last
+ * newline.  We process() everything from the start of the partial line up to
+ * and including the last newline, and remember where the new partial line
+ * starts.  We don't move it until the next call, so the buffer we gave
+ * process() stays intact until then.
  */
 int process_lines(process_lines_context * ctx)
 {
+#ifdef __linux__
+    if (ctx->reader == PTP_READER_RING)
+        return process_lines_ring(ctx);
+#endif
+
     // We copy these into local vars for readability
-    char * buf = ctx->buf;
-    size_t bufsize = ctx->bufsize;
-    size_t bufpos = ctx->bufpos;
     const size_t readsize = ctx->readsize;
 
-    assert(bufsize > 0);
-    assert(bufpos <= bufsize);
-    /* Ensure buf has space for readsize more bytes. */
-    if (bufsize - bufpos < readsize)
+    if (ctx->buf == NULL && borrow_buffer(ctx) != 0)
+        return PTP_ERR_ALLOC;
+    assert(ctx->bufsize > 0);
+    assert(ctx->bufstart + ctx->bufpos <= ctx->bufsize);
+    if (ctx->bufsize > ctx->basesize)
+        shrink_buffer(ctx);
+    /* Ensure buf has space for readsize more bytes after the partial line. */
+    if (ctx->bufsize - ctx->bufstart - ctx->bufpos < readsize)
     {
-        while (bufsize - bufpos < readsize)
-            bufsize *= 2;
-
-        buf = realloc(buf, bufsize);
-        if (buf == NULL)
+        compact_buffer(ctx);
+        if (ctx->bufsize - ctx->bufpos < readsize)
         {
-            return PTP_ERR_ALLOC;
+            int result = grow_buffer(ctx, readsize);
+            if (result == PTP_ERR_LONG_LINE)
+                result = over_budget(ctx);
+            if (result != 0)
+                return result;
         }
-        ctx->buf = buf;                 // We update ctx here because this function has several exit points
-        ctx->bufsize = bufsize;
     }
+    char * buf = ctx->buf + ctx->bufstart;          // Start of partial line
+    size_t bufsize = ctx->bufsize - ctx->bufstart;  // Space from there on
+    size_t bufpos = ctx->bufpos;
 
 
     /* Read; if EOF, call final process and return -1. */
-    ssize_t bytesread = read(ctx->fd, buf + bufpos, bufsize - bufpos);
+    size_t requested = read_length(ctx, bufsize - bufpos);
+    ssize_t bytesread = read_input(ctx, buf + bufpos, requested);
     debug(1, "read on fd %d returned %d\n", ctx->fd, bytesread);
+    adapt_readsize(ctx, requested, bytesread);
     if (bytesread < 0)              // Error
     {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+        {
+            process_lines_release(ctx);     // Nothing pending, and nothing handed to process() this time
+            return PTP_AGAIN;
+        }
         return PTP_ERR_READ;
     }
     else if (bytesread == 0)       // EOF
     {
-        if (bufpos > 0)
+        finish_lines(ctx, buf, bufpos);
+        return PTP_EOF;
+    }
+
+    return take_lines(ctx, buf, bufpos, (size_t) bytesread);
+}
+
+
+int process_lines_cleanup(process_lines_context * ctx)
+{
+    if (ctx->buf != NULL && ctx->pool == NULL)
+        charge_budget(ctx, 0);
+#ifdef __linux__
+    if (ctx->reader == PTP_READER_RING)
+    {
+        if (ctx->buf != NULL)
+            munmap(ctx->buf, 2 * ctx->bufsize);
+    }
+    else
+#endif
+    if (ctx->pool != NULL)
+    {
+        if (ctx->buf != NULL)
+            return_buffer(ctx);
+    }
+    else
+        free(ctx->buf);
+    ctx->buf = NULL;
+    ctx->bufsize = ctx->bufstart = ctx->bufpos = 0;
+    ctx->readsize = 0;
+    ctx->process = NULL;
+    ctx->fd = -1;
+    ctx->info = NULL;
+    return 0;
+}
+
+
+#ifdef __linux__
+
+int splice_scratch_init(splice_scratch * scratch)
+{
+    scratch->buf = malloc(SPLICE_SCAN_BYTES);
+    if (scratch->buf == NULL)
+        return PTP_ERR_ALLOC;
+    if (pipe(scratch->pipe) != 0)
+    {
+        free(scratch->buf);
+        return PTP_ERR_READ;
+    }
+    scratch->devnull = open("/dev/null", O_WRONLY);
+    if (scratch->devnull < 0)
+    {
+        splice_scratch_cleanup(scratch);
+        return PTP_ERR_READ;
+    }
+    return 0;
+}
+
+
+void splice_scratch_cleanup(splice_scratch * scratch)
+{
+    close(scratch->pipe[0]);
+    close(scratch->pipe[1]);
+    if (scratch->devnull >= 0)
+        close(scratch->devnull);
+    free(scratch->buf);
+    scratch->buf = NULL;
+}
+
+
+/* read(2) exactly len bytes that we know are already waiting in fd. */
+static int read_exactly(int fd, char * buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t bytesread = read(fd, buf, len);
+        if (bytesread < 0 && errno == EINTR)
+            continue;
+        if (bytesread <= 0)
+            return PTP_ERR_READ;
+        buf += bytesread;
+        len -= bytesread;
+    }
+    return 0;
+}
+
+
+/* Move len bytes that we know are waiting in pipe infd to outfd (or discard
+ * them, if outfd is /dev/null).  The kernel treats the whole splice as
+ * non-blocking if infd is, so we may have to wait for room in outfd. */
+static int splice_exactly(int infd, int outfd, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t moved = splice(infd, NULL, outfd, NULL, len, SPLICE_F_MOVE);
+        if (moved < 0 && errno == EAGAIN)
         {
-            ctx->process(buf, bufpos, ctx->info);
+            struct pollfd pollout = {outfd, POLLOUT, 0};
+            if (poll(&pollout, 1, -1) < 0 && errno != EINTR)
+                return PTP_ERR_WRITE;
+            continue;
         }
-        return PTP_EOF;
+        if (moved < 0 && errno == EINTR)
+            continue;
+        if (moved <= 0)
+            return PTP_ERR_WRITE;
+        len -= moved;
     }
+    return 0;
+}
+
 
-    /* bytesread > 0
-    Find last newline, call process; copy any trailing partial line to start of buf.
-    If no newline, just update bufpos. */
-    char * last_newline = memrchr(buf + bufpos, '\n', (size_t) bytesread);
+/*
+ * Find the length of the whole lines in the first len bytes of the scratch
+ * pipe, which were just tee'd from ctx->fd, and empty the scratch pipe.
+ * Returns 0 if there's no newline.
+ *
+ * Usually lines are short, so the last newline is near the end: we throw away
+ * all but the last SPLICE_SCAN_BYTES without looking at them and scan only
+ * those.  If there's no newline there, we tee the input again (it's still
+ * sitting in ctx->fd) and scan all of it.
+ */
+static ssize_t find_whole_lines(process_lines_context * ctx, splice_scratch * scratch, size_t len)
+{
+    size_t skipped = len > SPLICE_SCAN_BYTES ? len - SPLICE_SCAN_BYTES : 0;
+    char * last_newline;
+
+    if (splice_exactly(scratch->pipe[0], scratch->devnull, skipped) != 0
+            || read_exactly(scratch->pipe[0], scratch->buf, len - skipped) != 0)
+        return -1;
+    last_newline = memrchr(scratch->buf, '\n', len - skipped);
     if (last_newline != NULL)
+        return skipped + (last_newline - scratch->buf) + 1;
+    if (skipped == 0)
+        return 0;
+
+    // Long line: look at what we skipped.  If tee gives us less than that,
+    // we may miss a newline, which only means we save more as a partial line.
+    ssize_t teed = tee(ctx->fd, scratch->pipe[1], skipped, SPLICE_F_NONBLOCK);
+    if (teed < 0)
+        return -1;
+    ssize_t wholelen = 0;
+    for (size_t scanned = 0 ; scanned < (size_t) teed ; )
     {
-        char * partial_line = last_newline + 1;
-        ctx->process(buf, partial_line - buf, ctx->info);
-        size_t bytes_remaining = (buf + bufpos + bytesread) - partial_line;
-        memmove(buf, partial_line, bytes_remaining);
-        bufpos = bytes_remaining;
+        size_t chunk = teed - scanned < SPLICE_SCAN_BYTES ? teed - scanned : SPLICE_SCAN_BYTES;
+        if (read_exactly(scratch->pipe[0], scratch->buf, chunk) != 0)
+            return -1;
+        last_newline = memrchr(scratch->buf, '\n', chunk);
+        if (last_newline != NULL)
+            wholelen = scanned + (last_newline - scratch->buf) + 1;
+        scanned += chunk;
     }
-    else        // No newline found
+    return wholelen;
+}
+
+
+/*
+ * ctx->buf holds the partial line we've already consumed from the pipe (at
+ * offset 0, bufpos bytes long), just as in process_lines().  Everything else
+ * stays in the kernel: tee(2) lets us peek at the pipe's contents without
+ * consuming them, and splice(2) moves the whole lines on to outfd.
+ */
+int splice_lines(process_lines_context * ctx, int outfd, splice_scratch * scratch)
+{
+    assert(ctx->reader == PTP_READER_BUFFER);
+    compact_buffer(ctx);
+    unsigned long long start = ctx->stats != NULL ? clock_ns() : 0;
+    size_t requested = ctx->readsize;
+    ssize_t teed = tee(ctx->fd, scratch->pipe[1], requested, SPLICE_F_NONBLOCK);
+    debug(1, "tee on fd %d returned %d\n", ctx->fd, teed);
+    adapt_readsize(ctx, requested, teed);
+    if (ctx->stats != NULL)
+    {
+        ctx->stats->read_ns += clock_ns() - start;
+        ctx->stats->reads++;
+        if (teed > 0)
+            ctx->stats->bytes += teed;
+    }
+    if (teed < 0)
+    {
+        if (errno == EAGAIN)
+            return PTP_AGAIN;
+        return PTP_ERR_READ;
+    }
+    else if (teed == 0)             // EOF
     {
-        bufpos += bytesread;
+        if (ctx->bufpos > 0)
+        {
+            ctx->process(ctx->buf, ctx->bufpos, ctx->info);
+        }
+        return PTP_EOF;
     }
 
-    ctx->bufpos = bufpos;
+    ssize_t wholelen = find_whole_lines(ctx, scratch, (size_t) teed);
+    if (wholelen < 0)
+        return PTP_ERR_READ;
+    if (wholelen > 0)
+    {
+        // Finish off the partial line we already have, then the rest of the whole lines.
+        if (ctx->bufpos > 0)
+        {
+            const char * partial = ctx->buf;
+            size_t remaining = ctx->bufpos;
+            while (remaining > 0)
+            {
+                ssize_t written = write(outfd, partial, remaining);
+                if (written <= 0)
+                    return PTP_ERR_WRITE;
+                partial += written;
+                remaining -= written;
+            }
+            ctx->bufpos = 0;
+        }
+        if (splice_exactly(ctx->fd, outfd, (size_t) wholelen) != 0)
+            return PTP_ERR_WRITE;
+    }
+
+    // Save any trailing partial line.
+    size_t partial_len = (size_t) teed - wholelen;
+    if (partial_len > 0)
+    {
+        if (ctx->bufsize - ctx->bufpos < partial_len)
+        {
+            int result = grow_buffer(ctx, partial_len);
+            if (result == 0 && ctx->bufsize - ctx->bufpos < partial_len)
+                result = PTP_ERR_LONG_LINE;         // The budget ran out
+            if (result != 0)
+                return result;
+        }
+        if (read_exactly(ctx->fd, ctx->buf + ctx->bufpos, partial_len) != 0)
+            return PTP_ERR_READ;
+        ctx->bufpos += partial_len;
+    }
     return 0;
 }
 
+#endif /* __linux__ */
 
-int process_lines_cleanup(process_lines_context * ctx)
+
+void print_json_string(FILE * out, const char * s)
 {
-    free(ctx->buf);
-    ctx->buf = NULL;
-    ctx->bufsize = 0;
-    ctx->readsize = 0;
-    ctx->process = NULL;
-    ctx->fd = -1;
-    ctx->info = NULL;
-    return 0;
+    putc('"', out);
+    for ( ; *s != '\0' ; s++)
+    {
+        if (*s == '"' || *s == '\\')
+            fprintf(out, "\\%c", *s);
+        else if ((unsigned char) *s < 0x20)
+            fprintf(out, "\\u%04x", (unsigned int) *s);
+        else
+            putc(*s, out);
+    }
+    putc('"', out);
+}
+
+
+void print_stats_json(FILE * out, const char * name, const process_lines_stats * stats, int lines_known)
+{
+    fputs("\"name\": ", out);
+    print_json_string(out, name);
+    fprintf(out, ", \"bytes\": %llu, ", stats->bytes);
+    if (lines_known)
+        fprintf(out, "\"lines\": %llu, ", stats->lines);
+    else
+        fputs("\"lines\": null, ", out);
+    fprintf(out, "\"reads\": %llu, \"grows\": %llu, \"long_lines\": %llu, \"read_seconds\": %.6f, \"buffer_bytes\": %zu",
+            stats->reads, stats->grows, stats->long_lines, stats->read_ns / 1e9, stats->bufsize);
 }
 
 
@@ -10,22 +10,78 @@
 #ifndef PTP_H_
 #define PTP_H_
 
+#include <signal.h>
+#include <stdio.h>
 #include <stdlib.h>
 
 #define READ_SIZE_BYTES (64*1024)
+#define READ_SIZE_MIN_BYTES (4*1024)            // Smallest and largest adaptive reads; see process_lines_adapt()
+#define READ_SIZE_MAX_BYTES (1024*1024)
+#define RING_SIZE_BYTES (4*READ_SIZE_BYTES)     // Must be a multiple of the page size
 #define PTP_EOF         (-1)
+#define PTP_AGAIN       (-2)
 #define PTP_ERR_ALLOC   (1)
 #define PTP_ERR_READ    (2)
+#define PTP_ERR_WRITE   (3)
+#define PTP_ERR_LONG_LINE (4)
 
 
+/* How a process_lines_context buffers its input; see process_lines_init_ring(). */
+enum ptp_reader { PTP_READER_BUFFER, PTP_READER_RING };
+
+/* What to do with a line too long to buffer whole; see process_lines_limit(). */
+enum ptp_long_line { PTP_LONG_LINE_STREAM, PTP_LONG_LINE_TRUNCATE, PTP_LONG_LINE_ERROR };
+
+/* What reading an input has cost so far, if asked for; see process_lines_count(). */
+typedef struct {
+    unsigned long long reads;       // read(2) calls (or tee(2), or io_uring reads)
+    unsigned long long bytes;
+    unsigned long long lines;       // Not counted by splice_lines(), which doesn't look at most of them
+    unsigned long long grows;       // Times the buffer had to grow to hold a long line
+    unsigned long long long_lines;  // Lines too long to buffer whole (see process_lines_limit())
+    unsigned long long read_ns;     // Time spent in read(2) (or waiting for io_uring reads)
+    size_t bufsize;                 // Largest the buffer has been
+} process_lines_stats;
+
+/* A stock of bufsize-byte buffers that contexts borrow only while they need
+ * one; see process_lines_init_shared(). */
+typedef struct {
+    char ** idle;               // Buffers nobody's using...
+    size_t numidle;
+    size_t maxidle;             // ...and how many to keep; the rest are freed
+    size_t bufsize;
+    size_t allocated;           // Bytes in buffers, lent out or idle
+} ptp_buffer_pool;
+
+/* A cap on how far several contexts' buffers may grow past their usual size,
+ * all together; see process_lines_limit(). */
+typedef struct {
+    size_t used;
+    size_t max;
+} ptp_memory_budget;
+
 typedef struct {
+    enum ptp_reader reader;
     char * buf;
     size_t bufsize;
+    size_t bufstart;
     size_t bufpos;
     size_t readsize;
     void (*process)(char * buf, size_t buflen, void * info);
     void * info;
     int fd;
+    void (*partial)(char * buf, size_t buflen, int end, void * info);
+    size_t maxline;             // Longest line to buffer whole, or 0 for no limit
+    enum ptp_long_line longlines;   // What to do with longer ones
+    int streaming;              // In the middle of handing a long line to partial()
+    int truncating;             // In the middle of skipping the rest of a long line
+    size_t basesize;            // What buf shrinks back to once a long line is done with
+    ptp_memory_budget * budget; // What buf may grow past basesize by, shared with other contexts; or NULL
+    process_lines_stats * stats;    // Or NULL
+    size_t minread;             // Bounds for readsize, if it adapts; else 0
+    size_t maxread;
+    size_t lastread;            // Bytes the last call read
+    ptp_buffer_pool * pool;     // Where buf comes from, if shared; else NULL
 } process_lines_context;
 
 /**
@@ -35,6 +91,138 @@ typedef struct {
  */
 int process_lines_init(process_lines_context * ctx, int fd, void (*process)(char * buf, size_t buflen, void * info), void * info);
 
+/**
+ * Like process_lines_init(), but buffer input in a "mirrored" ring buffer:
+ * the same physical pages mapped twice, back to back, so that any run of
+ * bytes in the ring is contiguous in memory.  process_lines() then never has
+ * to move a partial line to make room for the next read, and only copies
+ * data when a single line outgrows the ring.  Calling process_lines() and
+ * process_lines_cleanup() work the same either way.  Linux only; returns
+ * nonzero on error, or if not supported.
+ */
+int process_lines_init_ring(process_lines_context * ctx, int fd, void (*process)(char * buf, size_t buflen, void * info), void * info);
+
+/**
+ * Set up a pool of bufsize-byte buffers for process_lines_init_shared(),
+ * keeping up to maxidle of them around when they're given back.  Returns
+ * nonzero on error.
+ */
+int ptp_buffer_pool_init(ptp_buffer_pool * pool, size_t bufsize, size_t maxidle);
+
+/** Free a pool's idle buffers.  Contexts using it must be cleaned up first. */
+void ptp_buffer_pool_cleanup(ptp_buffer_pool * pool);
+
+/**
+ * Like process_lines_init(), but don't allocate a buffer: borrow one from pool
+ * each time process_lines() needs one, and give it back whenever ctx has no
+ * partial line pending -- when a read finds nothing, or on
+ * process_lines_release().  So many inputs that are mostly idle share a few
+ * buffers between them.  Reads are no bigger than the pool's buffers.
+ */
+int process_lines_init_shared(process_lines_context * ctx, ptp_buffer_pool * pool, int fd, void (*process)(char * buf, size_t buflen, void * info), void * info);
+
+/**
+ * Give ctx's buffer back to its pool, if it has one and no partial line is
+ * pending in it.  Call once you're done with the lines last passed to
+ * process() (which are in that buffer).  Does nothing for unshared contexts.
+ */
+void process_lines_release(process_lines_context * ctx);
+
+/** Initialize ctx with the given kind of buffer (see above). */
+int process_lines_init_reader(process_lines_context * ctx, enum ptp_reader reader, int fd, void (*process)(char * buf, size_t buflen, void * info), void * info);
+
+/** Parse the name of a kind of reader ("buffer" or "ring").  Returns nonzero if unknown. */
+int parse_reader(const char * name, enum ptp_reader * reader);
+
+/**
+ * Don't buffer lines longer than maxline bytes: hand them to partial() a piece
+ * at a time instead, as they're read, so they take no more memory than a
+ * shorter line would.  end is nonzero for a line's last piece, which includes
+ * its newline (if it has one); at EOF, that piece may be empty.  process()
+ * never sees these lines.  Call after initializing ctx.
+ */
+void process_lines_stream_long_lines(process_lines_context * ctx, size_t maxline, void (*partial)(char * buf, size_t buflen, int end, void * info));
+
+/**
+ * Cap how much memory ctx takes to hold long lines.  Lines longer than
+ * maxline bytes (0 for no limit) aren't buffered whole, and neither is a line
+ * that would need ctx's buffer to grow past *budget (NULL for no budget).
+ * Instead, according to policy:
+ *
+ *   PTP_LONG_LINE_STREAM    hand the line to partial() a piece at a time;
+ *                           call process_lines_stream_long_lines() first
+ *   PTP_LONG_LINE_TRUNCATE  hand just its first maxline bytes (fewer, if the
+ *                           budget ran out first) and its newline to process()
+ *   PTP_LONG_LINE_ERROR     return PTP_ERR_LONG_LINE from process_lines()
+ *
+ * Either way, the buffer shrinks back once a long line is done with, as it
+ * does without a limit.  Call after initializing ctx.
+ */
+void process_lines_limit(process_lines_context * ctx, size_t maxline, enum ptp_long_line policy, ptp_memory_budget * budget);
+
+/** Parse what to do with long lines: "stream", "truncate", or "error".  Returns nonzero if unknown. */
+int parse_long_line(const char * name, enum ptp_long_line * policy);
+
+/**
+ * Adapt ctx->readsize to how fast input arrives, between minread and maxread:
+ * double it each time a read fills it, and halve it each time a read gets
+ * less than a quarter of it.  Each read then asks for just readsize bytes
+ * (rather than all the room in the buffer), so a trickle is read in small
+ * pieces and a firehose in big ones.  Call after initializing ctx.
+ */
+void process_lines_adapt(process_lines_context * ctx, size_t minread, size_t maxread);
+
+/**
+ * Keep count of what process_lines() (or splice_lines()) does with ctx in
+ * *stats, which should start out zeroed.  Costs a clock_gettime(2) per read,
+ * and a pass over the data to count lines, so contexts don't by default.
+ * Call after initializing ctx.
+ */
+void process_lines_count(process_lines_context * ctx, process_lines_stats * stats);
+
+/** Parse a size in bytes, with an optional K, M, or G suffix.  Returns nonzero if invalid. */
+int parse_size(const char * arg, size_t * size);
+
+/** Parse a whole number, all digits (so "3x" and "abc" are invalid).  Returns nonzero if invalid. */
+int parse_number(const char * arg, unsigned int * value);
+
+/** Like parse_number(), but it must be at least 1. */
+int parse_count(const char * arg, unsigned int * count);
+
+/** The number of newlines in buf. */
+unsigned long long count_newlines(const char * buf, size_t len);
+
+/**
+ * Print stats as the members of a JSON object (without the braces), with
+ * name as a "name" member.  lines may be given as unknown (null).
+ */
+void print_stats_json(FILE * out, const char * name, const process_lines_stats * stats, int lines_known);
+
+/** Print s to out as a JSON string, quotes and all. */
+void print_json_string(FILE * out, const char * s);
+
+/** A monotonic clock, in nanoseconds from some arbitrary starting point. */
+unsigned long long clock_ns(void);
+
+/**
+ * Open where --stats[=FD] output goes: file descriptor fdarg, or stderr if
+ * fdarg is NULL.  Returns NULL (with errno set) if it isn't a file descriptor
+ * open for writing.
+ */
+FILE * open_stats_file(const char * fdarg);
+
+/* Set by SIGUSR1, once catch_stats_signal() has been called: time to print
+ * stats, as well as at exit.  Whoever prints them clears it. */
+extern volatile sig_atomic_t stats_requested;
+
+/**
+ * Set stats_requested on SIGUSR1 (rather than exit).  If interrupt is set,
+ * a blocking call like read(2) fails with EINTR (and process_lines() returns
+ * PTP_AGAIN), so a program waiting for input can print them right away;
+ * otherwise, it's restarted.
+ */
+void catch_stats_signal(int interrupt);
+
 
 /**
  * Generic, efficient line-oriented file processing.
@@ -46,19 +234,31 @@ int process_lines_init(process_lines_context * ctx, int fd, void (*process)(char
  * It gets passed a buffer containing one or more whole lines (including newlines)
  * and the buffer's length. The buffer is guaranteed to contain at least one byte,
  * and will either end with a newline or the last byte of the file.  info can be a
- * pointer to anything an instance of your function needs.
+ * pointer to anything an instance of your function needs.  The buffer stays valid
+ * until the next call to process_lines() or process_lines_cleanup() on the same
+ * context, so process() may hang on to it until then (e.g., to writev(2) buffers
+ * from several contexts at once).
 
  * Then, call process_lines_init() with the (open) file descriptor you'd like to
  * read from, your line processing function, and a pointer to any information
  * your function may need.
  *
  * Loop calling process_lines() with the context struct until it returns nonzero.
- * -1 means EOF and positive means error (see the PTP_ERR_* codes).
+ * -1 means EOF and positive means error (see the PTP_ERR_* codes; errno says
+ * more about all but PTP_ERR_LONG_LINE).  If the file descriptor is
+ * non-blocking, PTP_AGAIN (-2) means no data is available right now; call
+ * process_lines() again once the descriptor is readable.  It also means
+ * read(2) was interrupted by a signal; just call process_lines() again.
+ *
+ * A line longer than the usual buffer grows the buffer to fit it; once it's
+ * been processed, the buffer shrinks back.  See process_lines_limit() to cap
+ * how big it gets.
  *
  * Each call to process_lines() results in exactly one call to read(2); this
  * makes it useful in conjunction with poll(2), select(2), and the like.  If
  * any newlines were read, it will call your process() function exactly once;
- * otherwise, process() will not be called.
+ * otherwise, process() will not be called.  (With process_lines_stream_long_lines(),
+ * there may also be up to two calls to partial().)
  *
  * Finally, call process_lines_cleanup() (note that this does not close the file
  * descriptor).
@@ -73,6 +273,46 @@ int process_lines(process_lines_context * ctx);
 int process_lines_cleanup(process_lines_context * ctx);
 
 
+#ifdef __linux__
+
+/* How many bytes at the end of each spliced run to inspect for the last newline. */
+#define SPLICE_SCAN_BYTES (4*1024)
+
+/* Shared by all splice_lines() calls: a pipe to tee(2) input into so we can
+ * look at it, somewhere to throw away what we don't need to look at, and a
+ * buffer to look with. */
+typedef struct {
+    int pipe[2];
+    int devnull;
+    char * buf;
+} splice_scratch;
+
+/** Set up a splice_scratch.  Returns nonzero on error. */
+int splice_scratch_init(splice_scratch * scratch);
+
+/** Close the scratch pipe and free the buffer. */
+void splice_scratch_cleanup(splice_scratch * scratch);
+
+/**
+ * Like process_lines(), but for a context whose fd is a pipe: move whole lines
+ * from it straight to outfd with splice(2), without copying them through user
+ * space.
+ *
+ * Each call tee(2)s up to ctx->readsize bytes of available input, finds the
+ * last newline among them, and splices everything up to and including it to
+ * outfd.  A trailing partial line is read into ctx's buffer and written to
+ * outfd just ahead of the rest of its line, so only complete lines are ever
+ * written.  At EOF, any final unterminated line is passed to ctx->process();
+ * process() is not called otherwise.
+ *
+ * ctx must have been set up with process_lines_init().  Returns the same
+ * values as process_lines(), plus PTP_ERR_WRITE if writing to outfd fails.
+ */
+int splice_lines(process_lines_context * ctx, int outfd, splice_scratch * scratch);
+
+#endif /* __linux__ */
+
+
 // There may be a more clever way to do this.
 #define debug(level, ...) _DEBUG##level(level, __VA_ARGS__)
 
@@ -0,0 +1,445 @@
+/****************************************************************************
+ Parallel Text Processing -- Reader Thread Pool
+
+ Copyright 2011 John Kleint
+
+ This is free software, licensed under the GNU General Public License v3,
+ available in the accompanying file LICENSE.txt.
+
+ See readpool.h for documentation.
+****************************************************************************/
+
+#define _GNU_SOURCE             // For memrchr(3)
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "codec.h"
+#include "readpool.h"
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+/* Buffers go between the threads and the caller through single-producer,
+ * single-consumer rings: each thread has one to hand full buffers to the
+ * caller, and one to get them back.  head and tail only ever increase;
+ * the producer owns tail, the consumer head.  A thread only has
+ * READPOOL_BUFFERS, so neither ring can overflow. */
+struct ring {
+    readpool_buffer * slots[READPOOL_BUFFERS];
+    unsigned int head;
+    unsigned int tail;
+};
+
+/* Something to wait on with poll(2): an eventfd where we have them, else a pipe. */
+struct wakeup {
+    int readfd;
+    int writefd;
+};
+
+struct reader {
+    pthread_t thread;
+    struct ring full;           // To the caller
+    struct ring free;           // Back from the caller
+    struct wakeup wake;         // Signaled when a buffer is freed
+    readpool_buffer buffers[READPOOL_BUFFERS];
+    char * carry;               // The partial line at the end of the last buffer
+    size_t carrylen;
+    size_t carrysize;
+    decoder * decoder;          // If decompressing
+    readpool * pool;
+};
+
+struct readpool {
+    struct reader * readers;
+    unsigned int numthreads;
+    unsigned int started;       // Threads running
+    int * fds;                  // Indexed by input number; -1 for ones not to read
+    unsigned int numinputs;
+    unsigned int nextinput;     // Next to be taken by a thread
+    unsigned int nexttake;      // Which thread's buffers to take first next time
+    int counting;
+    int stop;
+    struct wakeup ready;        // Signaled when a buffer is full
+};
+
+
+static int wakeup_init(struct wakeup * wake, int nonblocking)
+{
+#ifdef __linux__
+    wake->readfd = wake->writefd = eventfd(0, nonblocking ? EFD_NONBLOCK : 0);
+    return wake->readfd < 0;
+#else
+    int fds[2];
+    if (pipe(fds) != 0)
+        return 1;
+    wake->readfd = fds[0];
+    wake->writefd = fds[1];
+    // The writing end never blocks, so a full pipe just means a wakeup is already pending.
+    fcntl(wake->writefd, F_SETFL, fcntl(wake->writefd, F_GETFL) | O_NONBLOCK);
+    if (nonblocking)
+        fcntl(wake->readfd, F_SETFL, fcntl(wake->readfd, F_GETFL) | O_NONBLOCK);
+    return 0;
+#endif
+}
+
+
+static void wakeup_signal(struct wakeup * wake)
+{
+#ifdef __linux__
+    unsigned long long one = 1;
+    while (write(wake->writefd, &one, sizeof one) < 0 && errno == EINTR)
+        ;
+#else
+    while (write(wake->writefd, "", 1) < 0 && errno == EINTR)
+        ;
+#endif
+}
+
+
+/* Clear a pending wakeup; blocks until there is one, unless nonblocking. */
+static void wakeup_wait(struct wakeup * wake)
+{
+    char drain[64];
+    while (read(wake->readfd, drain, sizeof drain) < 0 && errno == EINTR)
+        ;
+}
+
+
+static void wakeup_cleanup(struct wakeup * wake)
+{
+    if (wake->writefd != wake->readfd)
+        close(wake->writefd);
+    close(wake->readfd);
+}
+
+
+static void ring_push(struct ring * ring, readpool_buffer * buf)
+{
+    unsigned int tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    ring->slots[tail % READPOOL_BUFFERS] = buf;
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+
+/* The next buffer in the ring, or NULL if it's empty. */
+static readpool_buffer * ring_pop(struct ring * ring)
+{
+    unsigned int head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    if (head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE))
+        return NULL;
+    readpool_buffer * buf = ring->slots[head % READPOOL_BUFFERS];
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    return buf;
+}
+
+
+/* Wait for one of this thread's buffers to come back; NULL if we're stopping. */
+static readpool_buffer * get_buffer(struct reader * reader)
+{
+    readpool_buffer * buf;
+    while ((buf = ring_pop(&reader->free)) == NULL)
+    {
+        if (__atomic_load_n(&reader->pool->stop, __ATOMIC_ACQUIRE))
+            return NULL;
+        wakeup_wait(&reader->wake);
+    }
+    return __atomic_load_n(&reader->pool->stop, __ATOMIC_ACQUIRE) ? NULL : buf;
+}
+
+
+/* Keep data[0, len) for the start of the next buffer. */
+static int save_carry(struct reader * reader, const char * data, size_t len)
+{
+    if (len > reader->carrysize)
+    {
+        char * newcarry = realloc(reader->carry, len);
+        if (newcarry == NULL)
+            return 1;
+        reader->carry = newcarry;
+        reader->carrysize = len;
+    }
+    memcpy(reader->carry, data, len);
+    reader->carrylen = len;
+    return 0;
+}
+
+
+/*
+ * Fill buf with whole lines from fd: whatever was carried over from the last
+ * buffer, then reads until it's full.  The partial line at the end is carried
+ * over to the next, unless it's the only line, in which case the buffer grows.
+ */
+static void fill_buffer(struct reader * reader, readpool_buffer * buf, int fd)
+{
+    int counting = reader->pool->counting;
+    size_t len = reader->carrylen;
+    size_t scanned = 0;         // No newline in data[0, scanned)
+
+    memset(&buf->counts, 0, sizeof buf->counts);
+    buf->end = buf->error = 0;
+    if (len > buf->size)
+    {
+        char * newdata = realloc(buf->data, len);
+        if (newdata == NULL)
+        {
+            buf->end = 1;
+            buf->error = errno;
+            buf->len = 0;
+            return;
+        }
+        buf->data = newdata;
+        buf->size = len;
+        buf->counts.grows++;
+    }
+    memcpy(buf->data, reader->carry, len);
+    reader->carrylen = 0;
+
+    for (;;)
+    {
+        if (len == buf->size)
+        {
+            if (memrchr(buf->data + scanned, '\n', len - scanned) != NULL)
+                break;
+            scanned = len;
+            char * newdata = realloc(buf->data, buf->size * 2);
+            if (newdata == NULL)
+            {
+                buf->end = 1;
+                buf->error = errno;
+                break;
+            }
+            buf->data = newdata;
+            buf->size *= 2;
+            buf->counts.grows++;
+        }
+        unsigned long long start = counting ? clock_ns() : 0;
+        ssize_t got = reader->decoder != NULL ? decoder_read(reader->decoder, buf->data + len, buf->size - len)
+                                              : read(fd, buf->data + len, buf->size - len);
+        if (counting)
+        {
+            buf->counts.read_ns += clock_ns() - start;
+            buf->counts.reads++;
+        }
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+        {
+            buf->end = 1;
+            buf->error = got < 0 ? errno : 0;
+            break;
+        }
+        len += got;
+        buf->counts.bytes += got;
+    }
+
+    // Carry over the partial line at the end, if there's more to come.
+    buf->len = len;
+    if (!buf->end)
+    {
+        char * lastnewline = memrchr(buf->data, '\n', len);
+        buf->len = lastnewline - buf->data + 1;
+        if (save_carry(reader, buf->data + buf->len, len - buf->len) != 0)
+        {
+            buf->end = 1;
+            buf->error = errno;
+        }
+    }
+    if (counting)
+    {
+        buf->counts.lines = count_newlines(buf->data, buf->len);
+        if (buf->end && buf->len > 0 && buf->data[buf->len - 1] != '\n')
+            buf->counts.lines++;
+        buf->counts.bufsize = buf->size;
+    }
+}
+
+
+/* A pool thread: take inputs one at a time, and read each to the end. */
+static void * read_inputs(void * arg)
+{
+    struct reader * reader = arg;
+    readpool * pool = reader->pool;
+
+    for (;;)
+    {
+        unsigned int input = __atomic_fetch_add(&pool->nextinput, 1, __ATOMIC_RELAXED);
+        while (input < pool->numinputs && pool->fds[input] < 0)
+            input = __atomic_fetch_add(&pool->nextinput, 1, __ATOMIC_RELAXED);
+        if (input >= pool->numinputs)
+            return NULL;
+
+        if (reader->decoder != NULL)
+            decoder_start(reader->decoder, pool->fds[input]);
+        readpool_buffer * buf;
+        do
+        {
+            buf = get_buffer(reader);
+            if (buf == NULL)
+                return NULL;
+            buf->input = input;
+            fill_buffer(reader, buf, pool->fds[input]);
+            ring_push(&reader->full, buf);
+            wakeup_signal(&pool->ready);
+        } while (!buf->end);
+    }
+}
+
+
+readpool * readpool_create(unsigned int numthreads, int counting)
+{
+    readpool * pool = calloc(1, sizeof (readpool));
+    if (pool == NULL)
+        return NULL;
+    pool->readers = calloc(numthreads > 0 ? numthreads : 1, sizeof (struct reader));
+    if (pool->readers == NULL || wakeup_init(&pool->ready, 1) != 0)
+    {
+        free(pool->readers);
+        free(pool);
+        return NULL;
+    }
+    pool->numthreads = numthreads;
+    pool->counting = counting;
+    for (unsigned int t = 0 ; t < numthreads ; t++)
+    {
+        pool->readers[t].pool = pool;
+        pool->readers[t].wake.readfd = -1;
+    }
+    for (unsigned int t = 0 ; t < numthreads ; t++)
+    {
+        struct reader * reader = pool->readers + t;
+        for (unsigned int b = 0 ; b < READPOOL_BUFFERS ; b++)
+        {
+            readpool_buffer * buf = reader->buffers + b;
+            buf->thread = t;
+            buf->data = malloc(READPOOL_BUFFER_BYTES);
+            if (buf->data == NULL)
+            {
+                readpool_destroy(pool);
+                return NULL;
+            }
+            buf->size = READPOOL_BUFFER_BYTES;
+            ring_push(&reader->free, buf);
+        }
+        if (wakeup_init(&reader->wake, 0) != 0)
+        {
+            reader->wake.readfd = -1;   // Don't close whatever it was
+            readpool_destroy(pool);
+            return NULL;
+        }
+    }
+    return pool;
+}
+
+
+int readpool_decompress(readpool * pool)
+{
+    for (unsigned int t = 0 ; t < pool->numthreads ; t++)
+    {
+        if (pool->readers[t].decoder == NULL && (pool->readers[t].decoder = decoder_create()) == NULL)
+            return 1;
+    }
+    return 0;
+}
+
+
+int readpool_add(readpool * pool, unsigned int input, int fd)
+{
+    if (input >= pool->numinputs)
+    {
+        int * newfds = realloc(pool->fds, (input + 1) * sizeof (int));
+        if (newfds == NULL)
+            return 1;
+        for (unsigned int i = pool->numinputs ; i < input ; i++)
+            newfds[i] = -1;
+        pool->fds = newfds;
+        pool->numinputs = input + 1;
+    }
+    pool->fds[input] = fd;
+    return 0;
+}
+
+
+int readpool_start(readpool * pool)
+{
+    for ( ; pool->started < pool->numthreads ; pool->started++)
+    {
+        struct reader * reader = pool->readers + pool->started;
+        if (pthread_create(&reader->thread, NULL, read_inputs, reader) != 0)
+            return 1;
+    }
+    return 0;
+}
+
+
+int readpool_fd(const readpool * pool)
+{
+    return pool->ready.readfd;
+}
+
+
+unsigned int readpool_take(readpool * pool, readpool_buffer ** bufs, unsigned int max)
+{
+    unsigned int taken = 0;
+    int any = 1;
+
+    // Clear the wakeup first: anything pushed after this signals again.
+    wakeup_wait(&pool->ready);
+    // A buffer from each thread in turn, so one fast thread can't crowd out the rest.
+    while (taken < max && any)
+    {
+        any = 0;
+        for (unsigned int n = 0 ; n < pool->numthreads && taken < max ; n++)
+        {
+            struct reader * reader = pool->readers + (pool->nexttake + n) % pool->numthreads;
+            readpool_buffer * buf = ring_pop(&reader->full);
+            if (buf != NULL)
+            {
+                bufs[taken++] = buf;
+                any = 1;
+            }
+        }
+    }
+    if (pool->numthreads > 0)
+        pool->nexttake = (pool->nexttake + 1) % pool->numthreads;
+    return taken;
+}
+
+
+void readpool_release(readpool * pool, readpool_buffer * buf)
+{
+    struct reader * reader = pool->readers + buf->thread;
+    ring_push(&reader->free, buf);
+    wakeup_signal(&reader->wake);
+}
+
+
+void readpool_destroy(readpool * pool)
+{
+    __atomic_store_n(&pool->stop, 1, __ATOMIC_RELEASE);
+    for (unsigned int t = 0 ; t < pool->started ; t++)
+    {
+        wakeup_signal(&pool->readers[t].wake);
+        pthread_join(pool->readers[t].thread, NULL);
+    }
+    for (unsigned int t = 0 ; t < pool->numthreads ; t++)
+    {
+        struct reader * reader = pool->readers + t;
+        for (unsigned int b = 0 ; b < READPOOL_BUFFERS ; b++)
+            free(reader->buffers[b].data);
+        free(reader->carry);
+        if (reader->decoder != NULL)
+            decoder_destroy(reader->decoder);
+        if (reader->wake.readfd >= 0)
+            wakeup_cleanup(&reader->wake);
+    }
+    wakeup_cleanup(&pool->ready);
+    free(pool->readers);
+    free(pool->fds);
+    free(pool);
+}
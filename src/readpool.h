@@ -0,0 +1,81 @@
+/****************************************************************************
+ Parallel Text Processing -- Reader Thread Pool
+
+ Copyright 2011 John Kleint
+
+ This is free software, licensed under the GNU General Public License v3,
+ available in the accompanying file LICENSE.txt.
+*****************************************************************************/
+
+#ifndef READPOOL_H_
+#define READPOOL_H_
+
+#include <stdlib.h>
+
+#include "ptp.h"
+
+#define READPOOL_BUFFERS        (4)                 // Buffers per thread
+#define READPOOL_BUFFER_BYTES   (1024*1024)         // Starting size of each; they grow to fit long lines
+
+
+/* A pool of threads reading inputs concurrently.  Opaque. */
+typedef struct readpool readpool;
+
+/* Whole lines read from one input by a pool thread. */
+typedef struct {
+    unsigned int input;         // Which input, as numbered by readpool_add()
+    char * data;
+    size_t len;                 // Can be 0 for an input's last buffer
+    int end;                    // This is the input's last buffer...
+    int error;                  // ...because of this read(2) (or decompression) error, an errno, or EOF if 0
+    process_lines_stats counts; // What reading it took, if the pool is counting
+    size_t size;                // The rest is for the pool's use
+    unsigned int thread;
+} readpool_buffer;
+
+
+/**
+ * Set up a pool of numthreads threads.  If counting, each buffer comes with
+ * counts of the reads it took (see process_lines_count()).  Returns NULL on
+ * error.
+ */
+readpool * readpool_create(unsigned int numthreads, int counting);
+
+/**
+ * Decompress inputs as they're read: gzip and zstd ones are read through a
+ * decoder (see codec.h), on the pool's threads.  Call before readpool_start().
+ * Returns nonzero on error.
+ */
+int readpool_decompress(readpool * pool);
+
+/** Add (open) file descriptor fd to the inputs to read, as input number `input`.  Returns nonzero on error. */
+int readpool_add(readpool * pool, unsigned int input, int fd);
+
+/**
+ * Start the threads reading.  Each takes an input, reads it to the end, then
+ * takes the next one, so several inputs are read at once, and each input's
+ * buffers come out in order.  Returns nonzero on error.
+ */
+int readpool_start(readpool * pool);
+
+/** A file descriptor that's readable (with poll(2) or epoll) when buffers are waiting for readpool_take(). */
+int readpool_fd(const readpool * pool);
+
+/**
+ * Take up to max buffers that are waiting, from any inputs, into bufs.
+ * Returns how many; if that's max, more may be waiting, so call again.  Never
+ * blocks.  Hand each buffer back with readpool_release() when done with it.
+ */
+unsigned int readpool_take(readpool * pool, readpool_buffer ** bufs, unsigned int max);
+
+/** Give a buffer back to its thread, to read into again. */
+void readpool_release(readpool * pool, readpool_buffer * buf);
+
+/**
+ * Stop the threads and free the pool.  Threads that are still reading stop
+ * at the next buffer.  Does not close the inputs' file descriptors.
+ */
+void readpool_destroy(readpool * pool);
+
+
+#endif /* READPOOL_H_ */
@@ -0,0 +1,391 @@
+/****************************************************************************
+ Parallel Text Processing -- io_uring Line Reader
+
+ Copyright 2011 John Kleint
+
+ This is free software, licensed under the GNU General Public License v3,
+ available in the accompanying file LICENSE.txt.
+
+ See uring.h for documentation.
+****************************************************************************/
+
+#define _GNU_SOURCE             // For memrchr(3), syscall(2)
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "ptp.h"
+#include "uring.h"
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+
+/* States of each read slot in a uring_lines_context. */
+enum { SLOT_IDLE, SLOT_INFLIGHT, SLOT_DONE, SLOT_DELIVERED };
+
+
+#ifdef __linux__
+
+/* The shared submission and completion queues, as mapped from the kernel. */
+struct uring {
+    int fd;
+    unsigned int * sq_head;
+    unsigned int * sq_tail;
+    unsigned int * sq_mask;
+    unsigned int * sq_array;
+    struct io_uring_sqe * sqes;
+    unsigned int * cq_head;
+    unsigned int * cq_tail;
+    unsigned int * cq_mask;
+    struct io_uring_cqe * cqes;
+    void * sq_ring;
+    size_t sq_ring_size;
+    void * cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    unsigned int entries;
+    unsigned int inflight;      // Reads submitted and not yet completed, over all contexts
+    unsigned int unsubmitted;   // SQEs queued but not yet passed to io_uring_enter()
+};
+
+
+uring * uring_create(void)
+{
+    struct io_uring_params params;
+    uring * ring = calloc(1, sizeof (uring));
+    if (ring == NULL)
+        return NULL;
+
+    memset(&params, 0, sizeof params);
+    ring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (ring->fd < 0)
+    {
+        free(ring);
+        return NULL;
+    }
+    ring->entries = params.sq_entries;
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof (unsigned int);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof (struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof (struct io_uring_sqe);
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED)
+    {
+        uring_destroy(ring);
+        return NULL;
+    }
+
+    char * sq = ring->sq_ring;
+    char * cq = ring->cq_ring;
+    ring->sq_head = (unsigned int *) (sq + params.sq_off.head);
+    ring->sq_tail = (unsigned int *) (sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned int *) (sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned int *) (sq + params.sq_off.array);
+    ring->cq_head = (unsigned int *) (cq + params.cq_off.head);
+    ring->cq_tail = (unsigned int *) (cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned int *) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+    return ring;
+}
+
+
+void uring_destroy(uring * ring)
+{
+    if (ring->sq_ring != NULL && ring->sq_ring != MAP_FAILED)
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    if (ring->cq_ring != NULL && ring->cq_ring != MAP_FAILED)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED)
+        munmap(ring->sqes, ring->sqes_size);
+    close(ring->fd);
+    free(ring);
+}
+
+
+/* Queue a read into slot of ctx, at the next file offset.  Returns nonzero if
+ * the ring is full, in which case the slot stays idle. */
+static int submit_read(uring_lines_context * ctx, unsigned int slot)
+{
+    uring * ring = ctx->ring;
+    if (ring->inflight + ring->unsubmitted >= ring->entries)
+        return 1;
+    if (ctx->slotbuf[slot] == NULL && (ctx->slotbuf[slot] = malloc(URING_READ_BYTES)) == NULL)
+        return 1;
+
+    unsigned int tail = *ring->sq_tail;
+    unsigned int index = tail & *ring->sq_mask;
+    struct io_uring_sqe * sqe = ring->sqes + index;
+    memset(sqe, 0, sizeof *sqe);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = ctx->fd;
+    sqe->off = ctx->nextoff;
+    sqe->addr = (uintptr_t) ctx->slotbuf[slot];
+    sqe->len = URING_READ_BYTES;
+    sqe->user_data = (uintptr_t) ctx | slot;        // ctx is at least 8-byte aligned, and slot < 8
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->unsubmitted++;
+
+    ctx->slotoff[slot] = ctx->nextoff;
+    ctx->slotstate[slot] = SLOT_INFLIGHT;
+    ctx->nextoff += URING_READ_BYTES;
+    ctx->inflight++;
+    return 0;
+}
+
+
+/* Queue reads for ctx's idle slots, in slot order (so file offsets stay in slot order). */
+static void submit_reads(uring_lines_context * ctx)
+{
+    for (unsigned int s = 0 ; s < URING_DEPTH ; s++)
+    {
+        unsigned int slot = (ctx->head + s) % URING_DEPTH;
+        if (ctx->slotstate[slot] == SLOT_IDLE && submit_read(ctx, slot) != 0)
+            break;
+    }
+}
+
+
+/* Submit queued reads, wait for at least one to complete if `wait` (and we
+ * have any outstanding), and record the results of every completed read in
+ * its context. */
+static int enter(uring * ring, int wait)
+{
+    unsigned int min_complete = wait && ring->inflight + ring->unsubmitted > 0 ? 1 : 0;
+    int submitted = syscall(__NR_io_uring_enter, ring->fd, ring->unsubmitted, min_complete,
+                            min_complete > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (submitted < 0)
+        return errno == EINTR ? 0 : PTP_ERR_READ;
+    debug(2, "io_uring_enter submitted %d read(s)\n", submitted);
+    ring->unsubmitted -= submitted;
+    ring->inflight += submitted;
+
+    unsigned int head = *ring->cq_head;
+    unsigned int tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    for ( ; head != tail ; head++)
+    {
+        struct io_uring_cqe * cqe = ring->cqes + (head & *ring->cq_mask);
+        uring_lines_context * ctx = (uring_lines_context *) (uintptr_t) (cqe->user_data & ~(uint64_t) 7);
+        unsigned int slot = cqe->user_data & 7;
+        ctx->slotres[slot] = cqe->res;
+        ctx->slotstate[slot] = SLOT_DONE;
+        ctx->inflight--;
+        ring->inflight--;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    return 0;
+}
+
+
+/* Make sure ctx->carry has room for len more bytes. */
+static int reserve_carry(uring_lines_context * ctx, size_t len)
+{
+    if (ctx->carrysize - ctx->carrylen >= len)
+        return 0;
+    size_t carrysize = ctx->carrysize > 0 ? ctx->carrysize : READ_SIZE_BYTES;
+    while (carrysize - ctx->carrylen < len)
+        carrysize *= 2;
+    char * carry = realloc(ctx->carry, carrysize);
+    if (carry == NULL)
+        return PTP_ERR_ALLOC;
+    ctx->carry = carry;
+    ctx->carrysize = carrysize;
+    if (ctx->stats != NULL)
+    {
+        ctx->stats->grows++;
+        ctx->stats->bufsize = URING_DEPTH * URING_READ_BYTES + carrysize;
+    }
+    return 0;
+}
+
+
+int uring_lines_init(uring_lines_context * ctx, uring * ring, int fd, void (*process)(char * buf, size_t buflen, void * info), void * info)
+{
+    memset(ctx, 0, sizeof *ctx);
+    ctx->ring = ring;
+    ctx->fd = fd;
+    ctx->process = process;
+    ctx->info = info;
+    ctx->lastslot = -1;
+    ctx->nextoff = ctx->deliveredoff = lseek(fd, 0, SEEK_CUR);
+    if (ctx->nextoff < 0)
+        return PTP_ERR_READ;
+    return 0;
+}
+
+
+void uring_lines_count(uring_lines_context * ctx, process_lines_stats * stats)
+{
+    ctx->stats = stats;
+    stats->bufsize = URING_DEPTH * URING_READ_BYTES + ctx->carrysize;
+}
+
+
+/*
+ * Reads complete in any order, but we hand them to process() in file order:
+ * the slots form a little circular queue starting at head, and we always
+ * submit reads in slot order.  A slot we've handed to process() can't be
+ * reused until the next call (its buffer has to stay valid), so we save its
+ * partial line and requeue it then.
+ *
+ * Reads of regular files are only short at EOF, but just in case, a read
+ * for the wrong offset (issued before a short read) is thrown away and
+ * retried at the right one.
+ */
+int uring_lines_process(uring_lines_context * ctx)
+{
+    ctx->lastread = 0;
+    // Save the partial line from last time, and reuse its slot.
+    if (ctx->lastslot >= 0)
+    {
+        unsigned int slot = ctx->lastslot;
+        size_t len = ctx->slotres[slot] - ctx->remainder;
+        if (len > 0)
+        {
+            if (reserve_carry(ctx, len) != 0)
+                return PTP_ERR_ALLOC;
+            memcpy(ctx->carry + ctx->carrylen, ctx->slotbuf[slot] + ctx->remainder, len);
+            ctx->carrylen += len;
+        }
+        ctx->slotstate[slot] = SLOT_IDLE;
+        ctx->lastslot = -1;
+    }
+
+    for (;;)
+    {
+        submit_reads(ctx);
+        unsigned int slot = ctx->head;
+        if (ctx->slotstate[slot] != SLOT_DONE)
+        {
+            if (ctx->slotstate[slot] == SLOT_IDLE && ctx->ring->inflight + ctx->ring->unsubmitted == 0)
+                return PTP_ERR_ALLOC;           // Couldn't even allocate a buffer for it
+            unsigned long long start = ctx->stats != NULL ? clock_ns() : 0;
+            if (enter(ctx->ring, 1) != 0)
+                return PTP_ERR_READ;
+            if (ctx->stats != NULL)
+                ctx->stats->read_ns += clock_ns() - start;
+            continue;
+        }
+
+        int result = ctx->slotres[slot];
+        debug(1, "uring read on fd %d at %lld returned %d\n", ctx->fd, (long long) ctx->slotoff[slot], result);
+        if (ctx->slotoff[slot] != ctx->deliveredoff)        // Stale; try again
+        {
+            ctx->slotstate[slot] = SLOT_IDLE;
+            ctx->head = (slot + 1) % URING_DEPTH;
+            continue;
+        }
+        if (result < 0)
+        {
+            errno = -result;
+            return PTP_ERR_READ;
+        }
+        if (ctx->stats != NULL)
+        {
+            ctx->stats->reads++;
+            ctx->stats->bytes += result;
+            ctx->stats->lines += result > 0 ? count_newlines(ctx->slotbuf[slot], result) : ctx->carrylen > 0;
+        }
+        if (result == 0)                                    // EOF
+        {
+            if (ctx->carrylen > 0)
+                ctx->process(ctx->carry, ctx->carrylen, ctx->info);
+            ctx->carrylen = 0;
+            return PTP_EOF;
+        }
+
+        ctx->deliveredoff += result;
+        ctx->lastread = result;
+        if (result < URING_READ_BYTES)          // Reads after this one are for the wrong offset
+            ctx->nextoff = ctx->deliveredoff;
+        ctx->slotstate[slot] = SLOT_DELIVERED;
+        ctx->lastslot = slot;
+        ctx->head = (slot + 1) % URING_DEPTH;
+        submit_reads(ctx);
+        if (ctx->ring->unsubmitted > 0 && enter(ctx->ring, 0) != 0)
+            return PTP_ERR_READ;
+
+        // Hand over the line we've been saving up (if any), then the rest of the whole lines.
+        char * buf = ctx->slotbuf[slot];
+        char * last_newline = memrchr(buf, '\n', (size_t) result);
+        if (last_newline == NULL)
+        {
+            ctx->remainder = 0;
+            return 0;
+        }
+        char * lines = buf;
+        if (ctx->carrylen > 0)
+        {
+            lines = (char *) memchr(buf, '\n', (size_t) result) + 1;
+            if (reserve_carry(ctx, lines - buf) != 0)
+                return PTP_ERR_ALLOC;
+            memcpy(ctx->carry + ctx->carrylen, buf, lines - buf);
+            ctx->process(ctx->carry, ctx->carrylen + (lines - buf), ctx->info);
+            ctx->carrylen = 0;
+        }
+        if (last_newline + 1 > lines)
+            ctx->process(lines, last_newline + 1 - lines, ctx->info);
+        ctx->remainder = last_newline + 1 - buf;
+        return 0;
+    }
+}
+
+
+int uring_lines_cleanup(uring_lines_context * ctx)
+{
+    while (ctx->inflight > 0)
+    {
+        if (enter(ctx->ring, 1) != 0)
+            break;
+    }
+    for (unsigned int slot = 0 ; slot < URING_DEPTH ; slot++)
+    {
+        free(ctx->slotbuf[slot]);
+        ctx->slotbuf[slot] = NULL;
+    }
+    free(ctx->carry);
+    ctx->carry = NULL;
+    ctx->carrysize = ctx->carrylen = 0;
+    ctx->fd = -1;
+    return 0;
+}
+
+#else   /* !__linux__ */
+
+uring * uring_create(void)
+{
+    errno = ENOSYS;
+    return NULL;
+}
+
+void uring_destroy(__attribute__((unused)) uring * ring)
+{
+}
+
+int uring_lines_init(__attribute__((unused)) uring_lines_context * ctx, __attribute__((unused)) uring * ring,
+                     __attribute__((unused)) int fd, __attribute__((unused)) void (*process)(char * buf, size_t buflen, void * info),
+                     __attribute__((unused)) void * info)
+{
+    return PTP_ERR_READ;
+}
+
+int uring_lines_process(__attribute__((unused)) uring_lines_context * ctx)
+{
+    return PTP_ERR_READ;
+}
+
+int uring_lines_cleanup(__attribute__((unused)) uring_lines_context * ctx)
+{
+    return 0;
+}
+
+#endif  /* __linux__ */
@@ -0,0 +1,88 @@
+/****************************************************************************
+ Parallel Text Processing -- io_uring Line Reader
+
+ Copyright 2011 John Kleint
+
+ This is free software, licensed under the GNU General Public License v3,
+ available in the accompanying file LICENSE.txt.
+*****************************************************************************/
+
+#ifndef URING_H_
+#define URING_H_
+
+#include <stdlib.h>
+#include <sys/types.h>
+
+#include "ptp.h"
+
+#define URING_ENTRIES       (256)           // Most reads in flight at once, over all files
+#define URING_READ_BYTES    (256*1024)      // Size of each read
+#define URING_DEPTH         (4)             // Most reads in flight per file; at most 8
+
+
+/* An io_uring shared by any number of uring_lines_contexts.  Opaque. */
+typedef struct uring uring;
+
+/* One file being read through a uring.  Opaque, except to uring.c. */
+typedef struct {
+    uring * ring;
+    int fd;
+    void (*process)(char * buf, size_t buflen, void * info);
+    void * info;
+
+    char * carry;               // Partial line we've seen so far
+    size_t carrysize;
+    size_t carrylen;
+
+    char * slotbuf[URING_DEPTH];        // One buffer per read
+    off_t slotoff[URING_DEPTH];         // File offset each read is for
+    int slotres[URING_DEPTH];           // read(2)-style result of each completed read
+    unsigned char slotstate[URING_DEPTH];
+    unsigned int head;                  // Next slot to hand to process(); later reads follow in slot order
+    off_t nextoff;                      // File offset of the next read to submit
+    off_t deliveredoff;                 // How much of the file we've handed to process()
+    int lastslot;                       // Slot handed to process() by the last call, or -1
+    size_t remainder;                   // Offset of the partial line in lastslot
+    unsigned int inflight;              // Reads submitted and not yet completed
+    process_lines_stats * stats;        // Or NULL
+    size_t lastread;                    // Bytes the last call handed over (from reads, not carry)
+} uring_lines_context;
+
+
+/**
+ * Set up a uring.  Returns NULL (with errno set) if io_uring isn't available,
+ * e.g. on old kernels or when it's disabled by seccomp.
+ */
+uring * uring_create(void);
+
+/** Tear down a uring.  Every context using it must be cleaned up first. */
+void uring_destroy(uring * ring);
+
+/**
+ * Like process_lines_init(), but read the (regular, seekable) file fd through
+ * ring, keeping up to URING_DEPTH reads of URING_READ_BYTES queued on it at a
+ * time.  Reads start at the file's current offset.  Returns nonzero on error.
+ */
+int uring_lines_init(uring_lines_context * ctx, uring * ring, int fd, void (*process)(char * buf, size_t buflen, void * info), void * info);
+
+/** Like process_lines_count(): keep count of what ctx does in *stats. */
+void uring_lines_count(uring_lines_context * ctx, process_lines_stats * stats);
+
+/**
+ * Like process_lines(): hand the next completed read's whole lines to
+ * process(), waiting for it if need be, and keep reads queued behind it.
+ * Returns 0, PTP_EOF, or a PTP_ERR_* code.
+ *
+ * Each call results in at most two calls to process(): one for a line that
+ * straddles two reads, and one for the whole lines after it.  Both buffers
+ * stay valid until the next call on the same context.  While we wait, reads
+ * for other contexts on the same uring complete too, so their next calls
+ * don't have to.
+ */
+int uring_lines_process(uring_lines_context * ctx);
+
+/** Wait for ctx's outstanding reads and free its buffers.  Does not close fd. */
+int uring_lines_cleanup(uring_lines_context * ctx);
+
+
+#endif /* URING_H_ */
@@ -0,0 +1,180 @@
+/****************************************************************************
+ Parallel Text Processing -- XXH64 Hashing
+
+ Copyright 2011 John Kleint
+
+ This is free software, licensed under the GNU General Public License v3,
+ available in the accompanying file LICENSE.txt.
+
+ See xxhash.h for documentation.
+****************************************************************************/
+
+#include <string.h>
+
+#include "xxhash.h"
+
+#define PRIME64_1   (0x9E3779B185EBCA87ULL)
+#define PRIME64_2   (0xC2B2AE3D27D4EB4FULL)
+#define PRIME64_3   (0x165667B19E3779F9ULL)
+#define PRIME64_4   (0x85EBCA77C2B2AE63ULL)
+#define PRIME64_5   (0x27D4EB2F165667C5ULL)
+
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+
+/* Little-endian loads from anywhere; keys needn't be aligned. */
+static inline uint64_t read64(const unsigned char * p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof v);
+    return v;
+}
+
+
+static inline uint32_t read32(const unsigned char * p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof v);
+    return v;
+}
+
+
+/* Mix 8 bytes of input into one lane's accumulator. */
+static inline uint64_t xxh64_round(uint64_t acc, uint64_t input)
+{
+    acc += input * PRIME64_2;
+    acc = rotl64(acc, 31);
+    return acc * PRIME64_1;
+}
+
+
+static inline uint64_t xxh64_merge(uint64_t h, uint64_t acc)
+{
+    h ^= xxh64_round(0, acc);
+    return h * PRIME64_1 + PRIME64_4;
+}
+
+
+/* Run whole 32-byte stripes from p through the accumulators; returns how many bytes that took. */
+static size_t xxh64_stripes(uint64_t * acc, const unsigned char * p, size_t len)
+{
+    uint64_t a0 = acc[0], a1 = acc[1], a2 = acc[2], a3 = acc[3];
+    size_t done = 0;
+
+    for ( ; len - done >= 32 ; done += 32)
+    {
+        a0 = xxh64_round(a0, read64(p + done));
+        a1 = xxh64_round(a1, read64(p + done + 8));
+        a2 = xxh64_round(a2, read64(p + done + 16));
+        a3 = xxh64_round(a3, read64(p + done + 24));
+    }
+    acc[0] = a0;
+    acc[1] = a1;
+    acc[2] = a2;
+    acc[3] = a3;
+    return done;
+}
+
+
+/* Combine the accumulators (if any stripes were seen) with the leftover bytes, and avalanche. */
+static uint64_t xxh64_finish(const uint64_t * acc, uint64_t seed, uint64_t total_len,
+                             const unsigned char * p, size_t len)
+{
+    uint64_t h;
+
+    if (total_len >= 32)
+    {
+        h = rotl64(acc[0], 1) + rotl64(acc[1], 7) + rotl64(acc[2], 12) + rotl64(acc[3], 18);
+        for (int lane = 0 ; lane < 4 ; lane++)
+            h = xxh64_merge(h, acc[lane]);
+    }
+    else
+    {
+        h = seed + PRIME64_5;
+    }
+    h += total_len;
+
+    for ( ; len >= 8 ; p += 8, len -= 8)
+    {
+        h ^= xxh64_round(0, read64(p));
+        h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+    }
+    if (len >= 4)
+    {
+        h ^= (uint64_t) read32(p) * PRIME64_1;
+        h = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+        p += 4;
+        len -= 4;
+    }
+    for ( ; len > 0 ; p++, len--)
+    {
+        h ^= *p * PRIME64_5;
+        h = rotl64(h, 11) * PRIME64_1;
+    }
+
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+
+void xxh64_init(xxh64_state * state, uint64_t seed)
+{
+    state->acc[0] = seed + PRIME64_1 + PRIME64_2;
+    state->acc[1] = seed + PRIME64_2;
+    state->acc[2] = seed;
+    state->acc[3] = seed - PRIME64_1;
+    state->seed = seed;
+    state->total_len = 0;
+    state->stripe_len = 0;
+}
+
+
+uint64_t xxh64(const void * key, size_t len, uint64_t seed)
+{
+    xxh64_state state;
+    const unsigned char * p = key;
+
+    xxh64_init(&state, seed);
+    size_t done = xxh64_stripes(state.acc, p, len);
+    return xxh64_finish(state.acc, seed, len, p + done, len - done);
+}
+
+
+void xxh64_update(xxh64_state * state, const void * key, size_t len)
+{
+    const unsigned char * p = key;
+
+    state->total_len += len;
+    if (state->stripe_len > 0)
+    {
+        // Finish the stripe left over from last time.
+        size_t fill = 32 - state->stripe_len;
+        if (fill > len)
+            fill = len;
+        memcpy(state->stripe + state->stripe_len, p, fill);
+        state->stripe_len += fill;
+        p += fill;
+        len -= fill;
+        if (state->stripe_len < 32)
+            return;
+        xxh64_stripes(state->acc, state->stripe, 32);
+        state->stripe_len = 0;
+    }
+    size_t done = xxh64_stripes(state->acc, p, len);
+    memcpy(state->stripe, p + done, len - done);
+    state->stripe_len = len - done;
+}
+
+
+uint64_t xxh64_final(const xxh64_state * state)
+{
+    return xxh64_finish(state->acc, state->seed, state->total_len, state->stripe, state->stripe_len);
+}
@@ -0,0 +1,41 @@
+/****************************************************************************
+ Parallel Text Processing -- XXH64 Hashing
+
+ Copyright 2011 John Kleint
+
+ This is free software, licensed under the GNU General Public License v3,
+ available in the accompanying file LICENSE.txt.
+*****************************************************************************/
+
+#ifndef XXHASH_H_
+#define XXHASH_H_
+
+#include <stdlib.h>
+#include <stdint.h>
+
+
+/* State for hashing a key in pieces. */
+typedef struct {
+    uint64_t acc[4];            // One accumulator per 8-byte lane of a stripe
+    uint64_t seed;
+    uint64_t total_len;
+    unsigned char stripe[32];   // Bytes of the current stripe seen so far...
+    size_t stripe_len;          // ...and how many
+} xxh64_state;
+
+
+/**
+ * Hash len bytes of key with Yann Collet's XXH64 algorithm, giving the same
+ * 64-bit values as the reference xxHash library.  It consumes 32 bytes per
+ * step in four independent lanes, so it's several times faster per byte than
+ * MurmurHash3_x86_32 on long keys.
+ */
+uint64_t xxh64(const void * key, size_t len, uint64_t seed);
+
+/** Hash a key in pieces of any size: xxh64_final() gives what xxh64() would for all of them together. */
+void xxh64_init(xxh64_state * state, uint64_t seed);
+void xxh64_update(xxh64_state * state, const void * key, size_t len);
+uint64_t xxh64_final(const xxh64_state * state);
+
+
+#endif /* XXHASH_H_ */
@@ -35,10 +35,86 @@ done
 "$hsplit" "${files[0]}" < "$infile"
 diff "$infile" "${files[0]}"
 
+# So should reading through a ring buffer.
+"$hsplit" --reader=ring "${files[0]}" < "$infile"
+diff "$infile" "${files[0]}"
+cat "$infile" | "$hsplit" -r ring "${files[@]:0:3}"
+cmp "$sorted" <(sort "${files[@]:0:3}")
+
 # Splitting to no files should give us integer hashcodes on stdout.
 "$hsplit" < "$infile" > "${files[0]}" 
 [[ ! $(egrep -v '^[0-9]+$' "${files[0]}") ]] || fail
 
+# Hashcodes and file assignments must never change: they decide where existing data lives.
+[[ $(printf 'a\nhello\nthe quick brown fox\n\n' | "$hsplit" | tr '\n' ' ') == "3891637768 2609477800 1578704177 4257877737 " ]] || fail
+[[ $(printf 'one\ntwo\nthree' | "$hsplit" | tr '\n' ' ') == "3589075621 1683175331 1374789519 " ]] || fail
+[[ $(seq 100000 | "$hsplit" | md5sum) == "de1bbf92891826a405a90ef99adb134f  -" ]] || fail
+seq 100000 | "$hsplit" "${files[@]:0:7}"
+[[ $(md5sum < "${files[0]}") == "b95bea5cb1810414e98523895ee15a78  -" ]] || fail
+[[ $(md5sum < "${files[6]}") == "0b10ba541458b5f89458bf5264c5ebb8  -" ]] || fail
+[[ $(cat "${files[@]:0:7}" | md5sum) == "869076ce791f36cef7928ab030b2de79  -" ]] || fail
+
+# The other hash functions are fixed too, and should split the same with or without threads or mapping.
+[[ $(printf 'a\nhello\n' | "$hsplit" --hash=murmur3_x64_128 | tr '\n' ' ') == "4612663512227719199 13982554320581602704 " ]] || fail
+[[ $(printf 'a\nhello\n' | "$hsplit" --hash=xxh64 | tr '\n' ' ') == "67619066467499907 6776770924536024496 " ]] || fail
+for h in murmur3_x64_128 xxh64; do
+    cat "$infile" | "$hsplit" --hash=$h "${files[@]:0:3}"
+    "$hsplit" --hash=$h -j 2 "${files[@]:3:3}" < "$infile"
+    for ((f=0; f < 3; f++)); do
+        cmp "${files[$f]}" "${files[$f + 3]}"
+    done
+    cmp "$sorted" <(sort "${files[@]:0:3}")
+    cmp <("$hsplit" --hash=$h < "$infile") <(cat "$infile" | "$hsplit" --hash=$h -j 3)
+done
+! "$hsplit" --hash=md5 < /dev/null 2> /dev/null || fail
+
+# Consistent hashing should split the same way --remap says, and going from 4 to 5 files should only move lines to the new one.
+"$hsplit" --consistent "${files[@]:0:4}" < "$infile"
+"$hsplit" -c --remap=4,5 < "$infile" > "${files[4]}"
+for ((f=0; f < 4; f++)); do
+    cmp "${files[$f]}" <(paste "${files[4]}" "$infile" | awk -F '\t' -v f=$f '$1 == f' | cut -f3-)
+done
+[[ -z $(awk -F '\t' '$1 != $2 && $2 != 4' "${files[4]}") ]] || fail
+moved=$(awk -F '\t' '$1 != $2' "${files[4]}" | wc -l)
+[[ $moved -gt $(($nlines / 6)) && $moved -lt $(($nlines / 4)) ]] || fail
+cmp "${files[4]}" <(cat "$infile" | "$hsplit" -j 2 -c --remap=4,5)
+! "$hsplit" --remap=4 < /dev/null 2> /dev/null || fail
+for remap in -1,3 4,5junk 0,5 4,; do
+    ! "$hsplit" -c --remap=$remap < /dev/null 2> /dev/null || fail
+done
+! "$hsplit" --remap=4,5 "${files[0]}" < /dev/null 2> /dev/null || fail
+
+# Hashing key fields or bytes should match hashing what cut(1) selects, and whole lines should go to files by their keys.
+paste <(awk '{ print NR % 7 }' "$infile") "$infile" <(seq "$nlines") > "${files[4]}"
+for k in 1 2 1,3 2- -2; do
+    cmp <(cut -f$k "${files[4]}" | "$hsplit") <("$hsplit" -k $k < "${files[4]}")
+    cmp <(cut -b$k "${files[4]}" | "$hsplit") <("$hsplit" --key-bytes=$k < "${files[4]}")
+    cmp <(tr '\t' , < "${files[4]}" | cut -d, -f$k | "$hsplit") <(tr '\t' , < "${files[4]}" | "$hsplit" -d , -k $k)
+done
+[[ $(printf 'a\tb' | "$hsplit" -k 2) == $(echo b | "$hsplit") ]] || fail
+"$hsplit" -k 1 "${files[@]:0:3}" < "${files[4]}"
+cmp <(sort "${files[4]}") <(sort "${files[@]:0:3}")
+[[ $(for ((f=0; f < 3; f++)); do cut -f1 "${files[$f]}" | sort -u; done | wc -l) -eq 7 ]] || fail
+cmp <("$hsplit" -k 1,3 < "${files[4]}") <(cat "${files[4]}" | "$hsplit" -j 2 -k 1,3)
+! "$hsplit" -k 0 < /dev/null 2> /dev/null || fail
+! "$hsplit" -k 3-2 < /dev/null 2> /dev/null || fail
+
+# Binary hashcodes and hashcodes with their lines should say the same as decimal ones, with or without threads.
+"$hsplit" < "$infile" > "${files[0]}"
+cmp "${files[0]}" <("$hsplit" --binary < "$infile" | od -An -v -w4 -tu4 | tr -d ' ')
+cmp "${files[0]}" <(cat "$infile" | "$hsplit" -j 2 --binary | od -An -v -w4 -tu4 | tr -d ' ')
+cmp <("$hsplit" --hash=xxh64 < "$infile") <("$hsplit" --hash=xxh64 --binary < "$infile" | od -An -v -w8 -tu8 | tr -d ' ')
+cmp <(paste "${files[0]}" "$infile") <("$hsplit" --with-line < "$infile")
+cmp <(paste "${files[0]}" "$infile") <(cat "$infile" | "$hsplit" -j 3 --with-line)
+! "$hsplit" --binary --with-line < /dev/null 2> /dev/null || fail
+! "$hsplit" --with-line "${files[0]}" < /dev/null 2> /dev/null || fail
+
+# Lines both much shorter and much longer than a vector should all be found.
+awk 'BEGIN { for (i = 0; i < 3000; i++) { s = sprintf("%*d", (i * 7919) % 1500, i); print s } }' > "${files[1]}"
+"$hsplit" "${files[0]}" < "${files[1]}"
+cmp "${files[0]}" "${files[1]}"
+[[ $("$hsplit" < "${files[1]}" | wc -l) -eq 3000 ]] || fail
+
 # Appending to existing files should not overwrite them
 head -$(($nlines / 2)) "$infile" | "$hsplit" "${files[@]:0:2}"
 tail -n+$(($nlines / 2 + 1)) "$infile" | "$hsplit" -a "${files[@]:0:2}"
@@ -83,15 +159,126 @@ for file in "${files[@]}"; do
     sort --check --numeric-sort "$file"
 done
 
+# Splitting with threads should give exactly the same output.
+declare -a threaded
+for ((f=0; f < 5; f++)); do
+    threaded[$f]="$(tempfile -p hsplit || exit 1)"
+done
+seq "$nlines" | cat - "$infile" | "$hsplit" "${files[@]:0:5}"
+seq "$nlines" | cat - "$infile" | "$hsplit" -j 3 "${threaded[@]}"
+for ((f=0; f < 5; f++)); do
+    cmp "${files[$f]}" "${threaded[$f]}"
+done
+cat "$infile" <(echo -n last) | "$hsplit" --jobs=2 "${threaded[@]:0:2}"
+diff <(sort "$infile" <(echo -n last)) <(sort "${threaded[@]:0:2}")
+cmp <("$hsplit" < "$infile") <("$hsplit" -j 4 < "$infile")
+
+# So should tiny output buffers and memory budgets, which make us write out often.
+seq "$nlines" | cat - "$infile" | "$hsplit" --bucket-buffer=100 --memory=1k "${threaded[@]}"
+for ((f=0; f < 5; f++)); do
+    cmp "${files[$f]}" "${threaded[$f]}"
+done
+seq "$nlines" | cat - "$infile" | "$hsplit" -j 2 -B 1 -m 1 "${threaded[@]}"
+for ((f=0; f < 5; f++)); do
+    cmp "${files[$f]}" "${threaded[$f]}"
+done
+! "$hsplit" --memory=lots "${threaded[0]}" < /dev/null 2> /dev/null || fail
+
+# So should nonblocking output, to files or to pipes with a slow reader, even with tiny queues.
+seq "$nlines" | cat - "$infile" | "$hsplit" --nonblock "${threaded[@]}"
+for ((f=0; f < 5; f++)); do
+    cmp "${files[$f]}" "${threaded[$f]}"
+done
+seq "$nlines" | cat - "$infile" | "$hsplit" --nonblock -j 2 -B 1 -m 1 "${threaded[@]:0:3}" \
+    >(sleep 1; cat > "${threaded[3]}") >(cat > "${threaded[4]}")
+sleep 1.5       # For the readers to finish
+for ((f=0; f < 5; f++)); do
+    cmp "${files[$f]}" "${threaded[$f]}"
+done
+! "$hsplit" --nonblock < /dev/null 2> /dev/null || fail
+
+# So should compressed output, in chunks big and small, on one thread or several.
+for opts in "-z gzip" "-z gzip -B 1 -m 1 --compress-jobs=3" "--compress=gzip --compress-jobs=1 -j 2"; do
+    seq "$nlines" | cat - "$infile" | "$hsplit" $opts "${threaded[@]}"
+    for ((f=0; f < 5; f++)); do
+        zcat "${threaded[$f]}" | cmp "${files[$f]}" - || fail
+    done
+done
+! "$hsplit" -z gzip < /dev/null 2> /dev/null || fail
+! "$hsplit" -z gzip --nonblock "${threaded[0]}" < /dev/null 2> /dev/null || fail
+! "$hsplit" -z lzma "${threaded[0]}" < /dev/null 2> /dev/null || fail
+for n in 0 3x abc; do
+    ! "$hsplit" -z gzip --compress-jobs=$n "${threaded[0]}" < /dev/null 2> /dev/null || fail
+    ! "$hsplit" -j $n < /dev/null 2> /dev/null || fail
+done
+
+# --stats shouldn't change the output, and should account for every line, threaded or not, and on SIGUSR1.
+function stat_sum { grep -o "\"$1\": \[[^]]*" | grep -o '"lines": [0-9]*' | awk '{ n += $2 } END { print n }'; }
+seq "$nlines" | cat - "$infile" > "${threaded[4]}"
+total=$(wc -l < "${threaded[4]}")
+for j in 1 2; do
+    stats="$("$hsplit" -j $j --stats -i "${threaded[4]}" "${threaded[@]:0:3}" 2>&1)"
+    [[ $(stat_sum inputs <<< "$stats") -eq $total && $(stat_sum buckets <<< "$stats") -eq $total ]] || fail
+    stats="$(cat "${threaded[4]}" | "$hsplit" -j $j --stats=3 "${threaded[@]:0:3}" 3>&1)"
+    [[ $(stat_sum inputs <<< "$stats") -eq $total && $(stat_sum buckets <<< "$stats") -eq $total ]] || fail
+    cmp <(cat "${threaded[@]:0:3}" | sort) <(sort "${threaded[4]}")
+done
+[[ $("$hsplit" --stats < "${threaded[4]}" 2> /dev/null | md5sum) == $("$hsplit" < "${threaded[4]}" | md5sum) ]] || fail
+(seq 10; sleep 1; seq 5) | "$hsplit" --stats "${threaded[0]}" 2> "${threaded[1]}" &
+sleep 0.5; kill -USR1 $!; wait
+[[ $(grep -c '"final": false' "${threaded[1]}") -eq 1 && $(grep '"final": false' "${threaded[1]}" | stat_sum buckets) -eq 10 ]] || fail
+! "$hsplit" --stats=99 < /dev/null 2> /dev/null || fail
+
+# Mapped inputs (regular files) should split the same as piped ones, in order, from stdin's offset.
+seq "$nlines" | cat - "$infile" > "${threaded[4]}"
+cat "${threaded[4]}" | "$hsplit" "${files[@]:0:4}"
+"$hsplit" -j 3 "${threaded[@]:0:4}" < "${threaded[4]}"
+for ((f=0; f < 4; f++)); do
+    cmp "${files[$f]}" "${threaded[$f]}"
+done
+"$hsplit" -i "${threaded[4]}" -j 1 "${threaded[@]:0:4}"
+cmp <(sort "${threaded[4]}") <(sort "${threaded[@]:0:4}")
+cmp <(tail -n+2 "${threaded[4]}" | "$hsplit") <( (read line; "$hsplit" -j 2) < "${threaded[4]}")
+cmp <(cat "$infile" "$infile" | "$hsplit") <(cat "$infile" | "$hsplit" -j 2 -i "$infile" -i /dev/stdin)
+cmp <("$hsplit" < /dev/null) <("$hsplit" -j 2 -i /dev/null < "${files[0]}")
+
+# Lines too long to buffer are streamed through, and should split the same, mapped or piped, with or without threads.
+head -c 3000000 /dev/zero | tr '\0' x > "${threaded[4]}"
+echo >> "${threaded[4]}"
+cat "$infile" "${threaded[4]}" | head -c 12000000 >> "${threaded[4]}"
+head -c 2500000 /dev/zero | tr '\0' y >> "${threaded[4]}"
+cat "${threaded[4]}" | "$hsplit" "${files[@]:0:3}"
+[[ $(cat "${files[@]:0:3}" | wc -c) -eq $(wc -c < "${threaded[4]}") ]] || fail
+cmp <(sort "${threaded[4]}") <(sort "${files[@]:0:3}")
+for j in 1 2; do
+    cat "${threaded[4]}" | "$hsplit" -j $j "${threaded[@]:0:3}"
+    for ((f=0; f < 3; f++)); do
+        cmp "${files[$f]}" "${threaded[$f]}"
+    done
+    "$hsplit" -j $j "${threaded[@]:0:3}" < "${threaded[4]}"
+    for ((f=0; f < 3; f++)); do
+        cmp "${files[$f]}" "${threaded[$f]}"
+    done
+    cmp <("$hsplit" < "${threaded[4]}") <(cat "${threaded[4]}" | "$hsplit" -j $j)
+done
+for h in murmur3_x64_128 xxh64; do
+    cmp <("$hsplit" --hash=$h < "${threaded[4]}") <(cat "${threaded[4]}" | "$hsplit" --hash=$h)
+done
+cmp <("$hsplit" --with-line < "${threaded[4]}") <(cat "${threaded[4]}" | "$hsplit" -j 2 --with-line)
+[[ $(cat "${threaded[4]}" | "$hsplit" | wc -l) -eq $(($(wc -l < "${threaded[4]}") + 1)) ]] || fail
+rm "${threaded[@]}"
+
 # Distribution of lines to files should be pretty even.
 distlines=1000000
 for ((bins=2; bins < $maxbins; bins++)); do
     wcs="$(printf '>(wc -l) %.0s' $(seq $bins))"        # Cheesy way to replicate a string $bins times
-    sizes=( $(seq $distlines | eval "$hsplit" "$wcs" | sort -n) )
-    min="${sizes[0]}"
-    max="${sizes[$bins-1]}"
-    # TODO: Figure out what the variation should be say 99.99% of the time.
-    [[ $(($max - $min)) -lt $(($distlines / 100)) ]] || fail    # Check that variation in bin sizes is < 1%.
+    for consistent in "" --consistent; do
+        sizes=( $(seq $distlines | eval "$hsplit" $consistent "$wcs" | sort -n) )
+        min="${sizes[0]}"
+        max="${sizes[$bins-1]}"
+        # TODO: Figure out what the variation should be say 99.99% of the time.
+        [[ $(($max - $min)) -lt $(($distlines / 100)) ]] || fail    # Check that variation in bin sizes is < 1%.
+    done
 done
 
 # Clean up
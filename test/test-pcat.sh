@@ -47,21 +47,57 @@ for ((f=1; f < $nfiles ; f++)); do
     diff <(sort "${files[@]:0:$f}") <(sort "$output")
 done
 
+# Each backend should give us everything, from both files and pipes.
+for backend in poll epoll; do
+    "$pcat" --backend=$backend "${files[@]}" > "$output"
+    diff <(sort "${files[@]}") <(sort "$output")
+    eval "$pcat" -b $backend "${pipes[@]}" > "$output"
+    diff <(sort "${files[@]}") <(sort "$output")
+done
+
+# So should reading through a ring buffer, or io_uring.
+eval "$pcat" --reader=ring "${pipes[@]}" "${files[@]}" > "$output"
+diff <(sort "${files[@]}" "${files[@]}") <(sort "$output")
+
+eval "$pcat" --reader=uring "${pipes[@]}" "${files[@]}" > "$output"
+diff <(sort "${files[@]}" "${files[@]}") <(sort "$output")
+"$pcat" -r uring "${files[@]}" > "$output"
+diff <(sort "${files[@]}") <(sort "$output")
+
+# Holding lines to batch up writes shouldn't lose or reorder any.
+for backend in poll epoll; do
+    eval "$pcat" -b $backend --max-delay=5 "${pipes[@]}" "${files[@]}" > "$output"
+    diff <(sort "${files[@]}" "${files[@]}") <(sort "$output")
+done
+cat "${files[@]}" | "$pcat" -t 1 | cmp - <(cat "${files[@]}")
+
+# Splicing from pipes to a pipe should give us everything, too.
+eval "$pcat" --splice "${pipes[@]}" | cat > "$output"
+diff <(sort "${files[@]}") <(sort "$output")
+cat "${files[@]}" | "$pcat" -s | cat > "$output"
+diff <(cat "${files[@]}") "$output"
+
 # Test lines of all lengths.
 # There's probably a faster/prettier way to do this.
 for ((len=0; len < $max_line_len; len++)); do printf '%*s\n' $len; done | "$pcat" | gzip > "$output"
 for ((len=0; len < $max_line_len; len++)); do printf '%*s\n' $len; done | "$pcat" | cmp - <(zcat "$output")
 
+for ((len=0; len < $max_line_len; len++)); do printf '%*s\n' $len; done | "$pcat" -s | cmp - <(zcat "$output")
+for ((len=0; len < $max_line_len; len++)); do printf '%*s\n' $len; done | "$pcat" -r ring | cmp - <(zcat "$output")
+
 # Test that files that don't end with a newline get one
 for ((f=0; f < $nfiles; f++)); do
     tr -cd '[:alnum:]' < /dev/urandom | dd bs=1 count=$RANDOM 2>/dev/null >> "${files[$f]}"
     [[ `tail -c1 "${files[$f]}"` != '\n' ]]     # Just to be sure ;)
 done
 "$pcat" "${files[@]}" > "$output"
+eval "$pcat" -s "${pipes[@]}" | cat > "$output.splice"
 for ((f=0; f < $nfiles; f++)); do
     echo >> "${files[$f]}"
 done
 cmp <(sort "${files[@]}") <(sort "$output") 
+cmp <(sort "${files[@]}") <(sort "$output.splice")
+rm "$output.splice"
 
 # Test that lines from any particular file maintain their original order.
 for ((f=0; f < $nfiles; f++)); do
@@ -72,6 +108,79 @@ cmp <(sort "${files[@]}") <(sort "$output")
 for ((f=0; f < $nfiles; f++)); do
     cmp <(grep "^==$f==" "$output") "${files[$f]}" 
 done
+"$pcat" -r uring "${files[@]}" > "$output"
+for ((f=0; f < $nfiles; f++)); do
+    cmp <(grep "^==$f==" "$output") "${files[$f]}"
+done
+
+# Reading regular files on several threads shouldn't either.
+for backend in epoll poll; do
+    eval "$pcat" -b $backend -j 3 "${pipes[@]:0:2}" "${files[@]:2}" > "$output"
+    for ((f=0; f < $nfiles; f++)); do
+        cmp <(grep "^==$f==" "$output") "${files[$f]}"
+    done
+done
+
+# Opening only a few inputs at a time shouldn't either.
+for backend in epoll poll; do
+    eval "$pcat" -b $backend --max-open=2 "${files[@]:2}" "${pipes[@]:0:2}" > "$output"
+    for ((f=0; f < $nfiles; f++)); do
+        cmp <(grep "^==$f==" "$output") "${files[$f]}"
+    done
+done
+for ((f=0; f < 300; f++)); do echo "$f"; done | split -l 1 - "$output.shard."
+(ulimit -n 64; "$pcat" --max-open=16 "$output".shard.* | sort -n | cmp - <(seq 0 299))
+rm "$output".shard.*
+for n in 0 3x abc; do
+    if "$pcat" --max-open=$n < /dev/null 2> /dev/null; then exit 1; fi
+    if "$pcat" -j $n < /dev/null 2> /dev/null; then exit 1; fi
+    if "$pcat" --merge -k $n < /dev/null 2> /dev/null; then exit 1; fi
+done
+for t in 5ms abc -1 99999999999; do
+    if "$pcat" -t $t < /dev/null 2> /dev/null; then exit 1; fi
+done
+
+# Standard input given twice is read once, like cat - -, whether or not both are open at once.
+"$pcat" - - < <(cat "${files[0]}") | cmp - "${files[0]}"
+"$pcat" --max-open=1 - - < <(cat "${files[0]}") | cmp - "${files[0]}"
+
+# Weighted sharing shouldn't lose or reorder any lines.
+for backend in epoll poll; do
+    "$pcat" -b $backend -w 3,1,0.5 "${files[@]}" > "$output"
+    for ((f=0; f < $nfiles; f++)); do
+        cmp <(grep "^==$f==" "$output") "${files[$f]}"
+    done
+done
+eval "$pcat" -w 2 -r uring "${pipes[@]:0:4}" "${files[@]:4}" > "$output"
+cmp <(sort "${files[@]}") <(sort "$output")
+if "$pcat" -w 1,0 "${files[0]}" > /dev/null 2>&1; then exit 1; fi
+if "$pcat" -w 1,1 "${files[0]}" > /dev/null 2>&1; then exit 1; fi
+
+# --stats should count every line read, and not change the output.
+for args in "" "-b poll" "-r ring" "-r uring" "-j 2"; do
+    lines=$("$pcat" $args --stats=3 "${files[@]}" 3>&1 > "$output" | grep -o '"lines": [0-9]*' | awk '{ n += $2 } END { print n }')
+    [[ $lines -eq $(wc -l < "$output") ]]
+    cmp <(sort "${files[@]}") <(sort "$output")
+done
+(seq 10; sleep 1; seq 5) | "$pcat" --stats 2> "$output" > /dev/null &
+sleep 0.5; kill -USR1 $!; wait
+[[ $(grep -c '"final": false, .*"lines": 10,' "$output") -eq 1 && $(grep -c '"final": true, .*"lines": 15,' "$output") -eq 1 ]]
+if "$pcat" --stats=99 < /dev/null 2> /dev/null; then exit 1; fi
+# Short lines from a pipe shouldn't make the buffer grow (and shrink back) over and over.
+[[ $(seq 2000000 | cat | "$pcat" --stats 2>&1 > /dev/null | grep -o '"grows": [0-9]*' | awk '{ n += $2 } END { print n }') -le 2 ]]
+
+# --merge should give what sort -m does, by whole lines or by a key field.
+for ((f=0; f < 4; f++)); do
+    sort "${files[$f]}" > "$output.sorted.$f"
+    sort -s -t ' ' -k 2,2 "${files[$f]}" > "$output.keyed.$f"
+done
+printf 'zz\nzzz' > "$output.sorted.4"                 # No final newline
+for args in "" "-r ring" "-r uring"; do
+    "$pcat" -m $args "$output".sorted.* | cmp - <(sort -m "$output".sorted.*)
+done
+"$pcat" -m "$output.sorted.0" <(cat "$output.sorted.1") /dev/null | cmp - <(sort -m "$output".sorted.[01])
+"$pcat" --merge --key=2 -d ' ' "$output".keyed.* | cmp - <(sort -m -s -t ' ' -k 2,2 "$output".keyed.*)
+rm "$output".sorted.* "$output".keyed.*
 
 # Test really long lines, and binary zeros.
 nlines=5
@@ -82,6 +191,54 @@ for ((n=0 ; n < $nlines ; n++)); do
 done > "${files[0]}"
 "$pcat" "${files[0]}" > "$output"
 cmp <(sort "${files[0]}") <(sort "$output")
+cat "${files[0]}" | "$pcat" -s | cmp - "${files[0]}"
+"$pcat" -r ring "${files[0]}" | cmp - "${files[0]}"
+"$pcat" -r uring "${files[0]}" | cmp - "${files[0]}"
+cmp <("$pcat" -j 2 "${files[0]}" "${files[0]}" | sort) <(sort "${files[0]}" "${files[0]}")
+
+# With --max-line, long lines should stream through whole and unmixed, be cut short, or be an error.
+seq 100000 > "${files[1]}"
+for reader in buffer ring; do
+    "$pcat" -r $reader --max-line=64K "${files[0]}" "${files[1]}" > "$output"
+    cmp <(sort "${files[0]}" "${files[1]}") <(sort "$output")
+    cmp <(grep -av '^[0-9]*$' "$output") "${files[0]}"
+    cat "${files[0]}" | "$pcat" -r $reader --max-line=1K --on-long-line=truncate - "${files[1]}" > "$output"
+    [[ $(awk '{ print length($0) }' "$output" | sort -n | tail -1) -eq 1024 ]]
+    [[ $(wc -l < "$output") -eq $((nlines + 100000)) ]]
+    if "$pcat" -r $reader --max-line=1K --on-long-line=error "${files[0]}" > /dev/null 2>&1; then exit 1; fi
+done
+"$pcat" --line-memory=256K "${files[0]}" "${files[1]}" | sort | cmp - <(sort "${files[0]}" "${files[1]}")
+"$pcat" --max-open=1 --max-line=1K --on-long-line=truncate "${files[0]}" "${files[1]}" | cmp - <(cut -c -1024 "${files[0]}" "${files[1]}")
+printf 'no final newline' | "$pcat" --max-line=4 | cmp - <(echo 'no final newline')
+if "$pcat" --on-long-line=truncate < /dev/null 2> /dev/null; then exit 1; fi
+if "$pcat" --merge --max-line=1K < /dev/null 2> /dev/null; then exit 1; fi
+
+# A read error (here, from a directory) names the file, and is fatal unless -c, whoever does the reading.
+mkdir "$output.d"
+for args in "-b epoll" "-b poll" "-r ring"; do
+    if "$pcat" $args "$output.d" > /dev/null 2>&1; then exit 1; fi
+    "$pcat" $args "$output.d" 2>&1 > /dev/null | grep -q "Error reading '$output.d'"
+    "$pcat" $args -c "$output.d" "${files[1]}" 2> /dev/null | cmp - "${files[1]}"
+done
+rmdir "$output.d"
+
+# With -z, gzip files (of one member or several) should be decompressed, and other files read as they are.
+gzip -c "${files[1]}" > "$output.1.gz"
+cat "$output.1.gz" <(gzip -c "${files[2]}") > "$output.12.gz"
+cmp <("$pcat" -z "$output.1.gz") "${files[1]}"
+cmp <("$pcat" -z -j 1 "$output.12.gz") <(cat "${files[1]}" "${files[2]}")
+"$pcat" -z "$output.1.gz" "$output.12.gz" "${files[3]}" <(cat "${files[4]}") > "$output"
+cmp <(sort "$output") <(sort "${files[1]}" "${files[1]}" "${files[2]}" "${files[3]}" "${files[4]}")
+"$pcat" -z -j 2 "${files[0]}" "$output.1.gz" | sort | cmp - <(sort "${files[0]}" "${files[1]}")
+# So should one padded out with zeros after its last member, as tar and block devices do.
+cat "$output.12.gz" <(head -c 100000 /dev/zero) > "$output.padded.gz"
+cmp <("$pcat" -z -j 1 "$output.padded.gz") <(cat "${files[1]}" "${files[2]}")
+# A corrupt or truncated one is an error, unless -c.
+head -c 1000 "$output.1.gz" > "$output.bad.gz"
+if "$pcat" -z "$output.bad.gz" > /dev/null 2>&1; then exit 1; fi
+[[ $("$pcat" -z -c "$output.bad.gz" "$output.1.gz" 2> /dev/null | wc -l) -gt $(wc -l < "${files[1]}") ]]
+if "$pcat" -z --merge "$output.1.gz" > /dev/null 2>&1; then exit 1; fi
+rm "$output".*gz
 
 
 # Clean up.
@@ -0,0 +1,81 @@
+#!/bin/bash
+
+# Functional tests for psplit.
+
+# Copyright 2011 John Kleint 
+# This is free software, licensed under the GNU General Public License v3,
+# available in the accompanying file LICENSE.txt.
+
+nfiles=4
+nlines=100000
+export LC_ALL=C
+set -e
+bindir=$(dirname $(readlink -f "${BASH_SOURCE[0]}"))/../bin
+psplit="$bindir/psplit"
+infile="$(tempfile -p psplit || exit 1)"
+sorted="$(tempfile -p psplit || exit 1)"
+
+function fail {
+    lineno="${BASH_LINENO[0]}"
+    echo "Fail on $(basename "${BASH_SOURCE[0]}") line $lineno." >&2
+    exit 1
+}
+
+# Generate some random strings for input.
+tr -cd '[:alnum:]_\n' < /dev/urandom | head -$nlines > "$infile"
+sort "$infile" > "$sorted"
+
+declare -a files
+for ((f=0; f < $nfiles; f++)); do
+    files[$f]="$(tempfile -p psplit || exit 1)"
+done
+
+# Splitting to one file should give us the original, whatever the reader or batch size.
+"$psplit" "${files[0]}" < "$infile"
+diff "$infile" "${files[0]}"
+"$psplit" --reader=ring -b 1 "${files[0]}" < "$infile"
+diff "$infile" "${files[0]}"
+cat "$infile" | "$psplit" --batch=1K "${files[0]}"
+diff "$infile" "${files[0]}"
+
+# Splitting to several should keep every line, whole, and in order within each file.
+cat "$infile" | "$psplit" -b 4K "${files[@]}"
+cat "${files[@]}" | sort | cmp - "$sorted"
+cat -n "$infile" | "$psplit" -b 4K "${files[@]}"
+for ((f=0; f < $nfiles; f++)); do
+    [[ -s "${files[$f]}" ]] || fail
+    cut -f 1 "${files[$f]}" | sort -n -c || fail
+done
+cat "${files[@]}" | sort -n | cut -f 2- | cmp - "$infile"
+printf 'no\nfinal\nnewline' | "$psplit" "${files[0]}"
+[[ "$(cat "${files[0]}")" == "$(printf 'no\nfinal\nnewline')" ]] || fail
+
+# Lines longer than a pipe's buffer (or a batch) go out whole, even when a pipe takes only part of one.
+long="$(head -c 300000 /dev/zero | tr '\0' x)"
+{ seq 1000; echo "$long"; seq 1000; echo "$long"; } > "${files[3]}"
+"$psplit" -b 1K >(sleep 0.5; cat > "${files[0]}") >(cat > "${files[1]}") < "${files[3]}"
+sleep 1         # For the readers to finish
+cat "${files[0]}" "${files[1]}" | sort | cmp - <(sort "${files[3]}")
+[[ $(cat "${files[0]}" "${files[1]}" | awk 'length($0) == 300000' | wc -l) -eq 2 ]] || fail
+
+# A slow reader should get less than a fast one.
+seq 1000000 | "$psplit" >(sleep 2; wc -l > "${files[0]}") >(wc -l > "${files[1]}")
+sleep 2.5       # For the readers to finish
+[[ $(($(cat "${files[0]}") + $(cat "${files[1]}"))) -eq 1000000 ]] || fail
+[[ $(cat "${files[1]}") -gt $((4 * $(cat "${files[0]}"))) ]] || fail
+
+# --stats should account for every byte and line.
+function stat_sum { grep -o "\"$1\": [0-9]*" | tail -n +2 | awk '{ n += $2 } END { print n }'; }
+"$psplit" --stats=3 "${files[@]}" < "$infile" 3> "$sorted"
+[[ $(stat_sum bytes < "$sorted") -eq $(wc -c < "$infile") ]] || fail
+[[ $(stat_sum lines < "$sorted") -eq $nlines ]] || fail
+grep -q '"final": true' "$sorted" || fail
+
+# Bad options should fail.
+! "$psplit" < /dev/null 2> /dev/null || fail
+! "$psplit" --batch=0 "${files[0]}" < /dev/null 2> /dev/null || fail
+
+# Clean up
+rm "$infile" "$sorted" "${files[@]}"
+
+echo OK.